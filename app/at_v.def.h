@@ -27,6 +27,8 @@
 #define VAT_CMDS	\
 	X(vErr)			\
 	X(vInd)			\
+	X(vLag)			\
 	X(vReg)			\
+	X(vTmr)			\
 	X(vWipDump)		\
 	X(vWrn)
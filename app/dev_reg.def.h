@@ -32,10 +32,31 @@ static u32 const u32Max = 0xFFFFFFFF;
 static s16 const portNone = -1;
 static s16 const portAll = 0;
 static char const invalid[] = "change_me";
+static char const defaultChannel[] = "my_channel";
+static char const defaultOrigin[] = "siwi2way";
+static char const tokenNone[] = "0";
+static char const natNone[] = "";
+static char const cacheNone[] = "";
+static char const urcNone[] = "";
+static char const schedNone[] = "";
+static u16 const ms500 = 500;
 
 #endif
 
 #define VE_REGS																					\
 	XR(TRACE_PORT, 	"trace.port", 			tracePort,				&portAll,	VE_SN16		)	\
 	XR(PUBNUB_PUB, 	"pubnub.publish", 		pubnubPublishKey, 		invalid,	VE_STRING	)	\
-	XR(PUBNUB_SUB, 	"pubnub.subscribe", 	pubnubSubscribeKey, 	invalid,	VE_STRING	)
+	XR(PUBNUB_SUB, 	"pubnub.subscribe", 	pubnubSubscribeKey, 	invalid,	VE_STRING	)	\
+	XR(PUBNUB_CMD, 	"pubnub.channel.cmd", 	pubnubCmdChannel, 		defaultChannel, VE_STRING)	\
+	XR(PUBNUB_RSP, 	"pubnub.channel.rsp", 	pubnubRspChannel, 		defaultChannel, VE_STRING)	\
+	XR(PUBNUB_ORIGIN, "pubnub.origin", 		pubnubOrigin, 			defaultOrigin, VE_STRING)	\
+	XR(PUBNUB_TOKEN, "pubnub.timetoken", 	pubnubTimeToken, 		tokenNone,	VE_STRING	)	\
+	XR(PUBNUB_NAT, 	"pubnub.nat", 			pubnubNat, 				natNone,	VE_STRING	)	\
+	XR(PUBNUB_CACHE, "pubnub.cache", 		pubnubCache, 			cacheNone,	VE_STRING	)	\
+	XR(PUBNUB_URC, 	"pubnub.urc", 			pubnubUrc, 				urcNone,	VE_STRING	)	\
+	XR(PUBNUB_JOURNAL, "pubnub.journal", 	pubnubJournal, 			&u8False,	VE_UN8		)	\
+	XR(SCHED_1, 	"sched.1", 				sched1, 				schedNone,	VE_STRING	)	\
+	XR(SCHED_2, 	"sched.2", 				sched2, 				schedNone,	VE_STRING	)	\
+	XR(SCHED_3, 	"sched.3", 				sched3, 				schedNone,	VE_STRING	)	\
+	XR(SCHED_4, 	"sched.4", 				sched4, 				schedNone,	VE_STRING	)	\
+	XR(LAG_WARN, 	"lag.warn", 			lagWarn, 				&ms500,		VE_UN16		)
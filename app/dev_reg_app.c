@@ -28,6 +28,7 @@
 #define VE_DEV_REG_DEFINE_CONSTANTS
 
 #include <dev_reg_app.h>
+#include <pubnub_at.h>
 
 /**
  * preprocessor magic: build a table with information about the settings
@@ -69,6 +70,8 @@ veBool dev_regBeforeChange(DevRegId regId, void const *value)
 void dev_regOnChange(DevRegId regId, void const *value)
 {
 	ve_qtrace("regOnChange: regId %d", regId);
+	pubnub_atRegChanged(regId);
+
 	switch (regId)
 	{
 	default:
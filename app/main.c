@@ -41,9 +41,21 @@
 #include <ve_timer.h>
 #include <ve_trace.h>
 
+#define PUBNUB_HOST		"pubsub.pubnub.com"
+#define PUBNUB_PORT		80
+
+/* the bearer opened, the NAT estimate is kept per network */
+#ifdef __OAT_API_VERSION__
+#define NETWORK			"eth"
+#else
+#define NETWORK			"lan"
+#endif
+
 extern void CfgEth(void (*)(void));
 static void go(void);
 
+static struct PubnubAt nubat;
+
 static int print_req(struct VHttpcRequest* req, ReqEvent ev, char const* buf, int buf_len)
 {
 	switch(ev) {
@@ -80,6 +92,7 @@ void print_nub(struct PubnubRequest* nubreq, NubEv ev, char const* buf,
 	switch(ev)
 	{
 	case NUB_DATA:
+	case NUB_JSON:
 		ve_qtracen("chat:", buf, buf_len);
 		break;
 
@@ -146,24 +159,21 @@ void pubnub_account(void)
 
 void pubnub_at_console(void)
 {
-	static struct PubnubAt nubat;
-	
-	/* Initializes an idle connection... */
-	pubnub_atInit(&nubat, "my_channel", dev_regs.pubnubPublishKey, dev_regs.pubnubSubscribeKey, 
-									"0", "pubsub.pubnub.com", 80);
-
-	/* Something must be done to get it started.. */
-	if (1)
-		pubnub_atPublish(&nubat, "\r\nAT+HELLO_WORLD\r\n"); /* sent */
-	else
-		pubnub_atSubscribe(&nubat); /* listen*/
+	/* Initializes the connections opened by pubnub_connect... */
+	pubnub_atInit(&nubat, dev_regs.pubnubCmdChannel, dev_regs.pubnubRspChannel,
+					dev_regs.pubnubOrigin, dev_regs.pubnubPublishKey,
+					dev_regs.pubnubSubscribeKey, "0", PUBNUB_HOST, PUBNUB_PORT);
+	pubnub_atNetwork(&nubat, NETWORK);
+
+	/* say hello and listen, publishing does not wait for the subscribe */
+	pubnub_atPublish(&nubat, "\r\nAT+HELLO_WORLD\r\n");
+	pubnub_atSubscribe(&nubat);
 
 	/* From here on it should take care of itself */
 }
 
 void init(void)
 {
-	ve_timer_init();
 	dev_regInit();
 	at_vInit();			/* commands registered on it */
 }
@@ -173,8 +183,11 @@ void init(void)
 int main(int argc, char const* argv[])
 {
 	mkdir("regs");
-	init();
+	ve_timer_init();
 	wip_netInit();
+	/* connect while the registers are loaded */
+	pubnub_connect(&nubat.nub, PUBNUB_HOST, PUBNUB_PORT);
+	init();
 	go();
 	glue_main();
 	return 0;
@@ -184,17 +197,21 @@ int main(int argc, char const* argv[])
 void bearer_opened(void)
 {
 	ve_qtrace("bearer opened...");
+	/* lookup and connect first, the journal and such are loaded meanwhile */
+	pubnub_connect(&nubat.nub, PUBNUB_HOST, PUBNUB_PORT);
 	go();
 }
 
+/* the bearer is opened while the registers are loaded from flash */
 void startup(u8 id, void* context)
 {
-	init();
-
-	ve_qtrace("opening bearer...");
+	ve_timer_init();
 	wip_netInitOpts(WIP_NET_OPT_END);
 	wip_debugSetPort(WIP_NET_DEBUG_PORT_UART1);
 	CfgEth(bearer_opened);
+
+	init();
+	ve_qtrace("opening bearer...");
 }
 
 void main_task(void)
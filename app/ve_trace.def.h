@@ -35,4 +35,10 @@ extern u32 const defaultTrace;
 	X(REG,		&defaultTrace)			\
 	X(VHTTPC,	&defaultTrace)			\
 	X(PUBNUB,	&defaultTrace)			\
-	X(PUBNUBAT,	&defaultTrace)
+	X(PUBNUBAT,	&defaultTrace)			\
+	X(PUBNUBNAT,	&defaultTrace)	\
+	X(PUBNUBURC,	&defaultTrace)	\
+	X(PUBNUBJOURNAL,	&defaultTrace)	\
+	X(PUBNUBFRAG,	&defaultTrace)	\
+	X(PUBNUBSCHED,	&defaultTrace)	\
+	X(LAG,		&defaultTrace)
@@ -0,0 +1,96 @@
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+/*
+ * Copyright (c) 2012 All rights reserved.
+ * Jeroen Hofstee, Victron Energy, jhofstee@victronenergy.com.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/*
+ * Shared bits of the host side benchmarks in this directory. Each bench is a
+ * single program, built from its own file plus the sources it names at the
+ * top with the windows platform headers, e.g. from the repository root:
+ *
+ *   cl /Iwindows\inc /Iapp /Iinc bench\bench_pubnub.c src\tcp\pubnub.c ...
+ *
+ * dlmalloc gets its memory with a 32 bit cast, so build them for 32 bit or
+ * map dlmalloc to the C library. Traces are swallowed, so only the code being
+ * measured runs. This header defines the stubs for that and is to be included
+ * by the bench file only.
+ */
+
+#include <platform.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <dev_reg_app.h>
+#include <ve_trace.h>
+
+#ifdef _WIN32
+static double bench_now(void)
+{
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+
+	if (!freq.QuadPart)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (double) now.QuadPart / freq.QuadPart;
+}
+#else
+#include <time.h>
+static double bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+#endif
+
+/* ns per operation, for n operations started at start */
+#define bench_ns(start, n)	((bench_now() - (start)) * 1e9 / (double) (n))
+
+/* xorshift, so runs are repeatable and cost next to nothing */
+static u32 benchSeed = 2463534242u;
+static u32 bench_rand(void)
+{
+	benchSeed ^= benchSeed << 13;
+	benchSeed ^= benchSeed >> 17;
+	benchSeed ^= benchSeed << 5;
+	return benchSeed;
+}
+
+DevRegisters dev_regs;
+
+void ve_trace(VeModule module, u32 level, char const* format, ...)
+{
+	(void) module; (void) level; (void) format;
+}
+
+void ve_tracen(VeModule module, u32 level, char const *prepend, char const *buf, int n)
+{
+	(void) module; (void) level; (void) prepend; (void) buf; (void) n;
+}
+
+#endif
@@ -0,0 +1,158 @@
+/*
+ * Copyright (c) 2012 All rights reserved.
+ * Jeroen Hofstee, Victron Energy, jhofstee@victronenergy.com.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/*
+ * Measures how fast local AT commands are dispatched with n of them
+ * subscribed: the lookup alone, in the prefix tree and in a list compared
+ * with strnicmp as before, and a whole ve_atCmdSendSink of a command with
+ * a parameter which its handler answers with OK. Build from the repository
+ * root with:
+ *
+ *   cl /Iwindows\inc /Iapp /Iinc bench\bench_at.c src\utils\ve_timer.c
+ *      src\utils\ve_lag.c src\utils\mem_utils.c src\utils\malloc-2.8.5.c
+ *
+ * ve_at.c is included, so its static lookup can be timed on its own.
+ */
+
+#include "bench.h"
+
+#include "../src/utils/ve_at.c"
+
+#define LOOKUPS		1000000
+#define SENDS		200000
+
+/* the lookup as it was, a list of all commands compared one by one */
+typedef struct LinearCmdS
+{
+	char *atCmd;
+	struct LinearCmdS *next;
+} LinearCmd;
+
+static LinearCmd* linearList;
+static LinearCmd* linearTail;
+
+static LinearCmd* linear_find(char* atstr)
+{
+	LinearCmd *ret = linearList;
+
+	while (ret)
+	{
+		if (strnicmp(ret->atCmd, atstr, (u32) strlen(ret->atCmd)) == 0)
+			return ret;
+		ret = ret->next;
+	}
+
+	return NULL;
+}
+
+static void linear_add(char const *cmdStr)
+{
+	LinearCmd *cmd = (LinearCmd*) malloc(sizeof(*cmd));
+
+	cmd->atCmd = strcpy((char*) malloc(strlen(cmdStr) + 1), cmdStr);
+	cmd->next = NULL;
+	if (linearTail)
+		linearTail->next = cmd;
+	else
+		linearList = cmd;
+	linearTail = cmd;
+}
+
+char *adl_strGetResponse(adl_strID_e RspID)
+{
+	return ve_strdup(RspID == ADL_STR_OK ? "OK" : "ERROR");
+}
+
+static void handler(adl_atCmdPreParser_t *paras)
+{
+	ve_atSendResponsePort(ADL_AT_RSP, paras->Port, "\r\nOK\r\n");
+}
+
+static u32 answers;
+
+static void sink(char const *line, veBool terminal, void* ctx)
+{
+	if (terminal)
+		answers++;
+}
+
+static void name(char* buf, u32 n)
+{
+	sprintf(buf, "AT+V%c%c%u", 'A' + n % 26, 'A' + n / 26 % 26, (unsigned) n);
+}
+
+int main(void)
+{
+	static u32 const counts[] = {10, 100, 1000, 5000};
+	char cmds[256][32];
+	u32 subscribed = 0;
+	u32 c, i, n;
+	double start, trie, linear, send;
+	void* volatile found;
+
+	printf("  cmds   trie lookup   list lookup   send+OK\n");
+	for (c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+		for (; subscribed < counts[c]; subscribed++) {
+			char buf[32];
+
+			name(buf, subscribed);
+			ve_atCmdSubscribe(buf, handler, ADL_CMD_TYPE_PARA | 0x11);
+			linear_add(buf);
+		}
+
+		/* any subscribed command, with a parameter */
+		for (i = 0; i < 256; i++) {
+			name(cmds[i], bench_rand() % subscribed);
+			strcat(cmds[i], "=1");
+		}
+
+		start = bench_now();
+		for (n = 0; n < LOOKUPS; n++)
+			found = ve_atCmdSubscribeFindNext(cmds[n & 0xFF], NULL);
+		trie = bench_ns(start, LOOKUPS);
+
+		start = bench_now();
+		for (n = 0; n < LOOKUPS / subscribed; n++)
+			found = linear_find(cmds[n & 0xFF]);
+		linear = bench_ns(start, LOOKUPS / subscribed);
+
+		answers = 0;
+		start = bench_now();
+		for (n = 0; n < SENDS; n++)
+			ve_atCmdSendSink(cmds[n & 0xFF], ADL_PORT_UART1, 0, NULL, sink);
+		send = bench_ns(start, SENDS);
+		if (answers != SENDS) {
+			printf("%u of %u commands answered\n", (unsigned) answers, SENDS);
+			return 1;
+		}
+
+		printf("  %5u %10.0f ns %10.0f ns %8.0f ns\n", (unsigned) subscribed,
+				trie, linear, send);
+	}
+	(void) found;
+
+	return 0;
+}
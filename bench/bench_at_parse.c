@@ -0,0 +1,255 @@
+/*
+ * Copyright (c) 2012 All rights reserved.
+ * Jeroen Hofstee, Victron Energy, jhofstee@victronenergy.com.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/*
+ * Fuzzes and times the parser of local AT commands. Random parameter
+ * strings of quotes, commas, backslashes, spaces and text are parsed by
+ * ve_atCmdParse and by a copy of parseParams as it was, with a heap copy of
+ * the command and of every parameter, and the results must be the same.
+ * Then both are timed on typical commands. Build from the repository root
+ * with:
+ *
+ *   cl /Iwindows\inc /Iapp /Iinc bench\bench_at_parse.c src\utils\ve_timer.c
+ *      src\utils\ve_lag.c src\utils\mem_utils.c src\utils\malloc-2.8.5.c
+ *
+ * ve_at.c is included, so its static parser can be called directly.
+ */
+
+#include "bench.h"
+
+#include "../src/utils/ve_at.c"
+
+#define FUZZ		1000000
+#define PARSES		1000000
+#define CMD			"AT+VREG"
+
+char *adl_strGetResponse(adl_strID_e RspID)
+{
+	return ve_strdup(RspID == ADL_STR_OK ? "OK" : "ERROR");
+}
+
+/* the parameters as parseParams found them before, all on the heap */
+typedef struct
+{
+	u16 type;
+	u8 count;
+	char *params[VE_AT_PARAMS_MAX];
+} RefParsed;
+
+static void ref_free(RefParsed *ref)
+{
+	while (ref->count)
+		ve_free(ref->params[--ref->count]);
+}
+
+static s8 ref_parse_params(RefParsed *ref, char const *atstr)
+{
+	size_t atCmdLength = strlen(CMD);
+	char *copy;
+	char *p;
+	char *begin;
+	veBool inStr = veFalse;
+	s8 ret = OK;
+
+	ref->count = 0;
+	ref->type = ADL_CMD_TYPE_ACT;
+	if (strlen(atstr) <= atCmdLength)
+		return OK;
+	if (atstr[atCmdLength] == '?') {
+		ref->type = ADL_CMD_TYPE_READ;
+		return OK;
+	}
+	if (atstr[atCmdLength] != '=')
+		return ERROR;
+	if (atstr[atCmdLength + 1] == '?') {
+		ref->type = ADL_CMD_TYPE_TEST;
+		return OK;
+	}
+	ref->type = ADL_CMD_TYPE_PARA;
+
+	begin = p = copy = ve_strdup(&atstr[atCmdLength + 1]);
+	for (;;) {
+		char c;
+		switch ((c = *p))
+		{
+		case '"':
+			if (!inStr) {
+				begin = p + 1;
+				inStr = veTrue;
+				break;
+			}
+			inStr = veFalse;
+			// fall through
+		case ',':
+		case 0:
+			if (begin != p) {
+				*p = 0;
+				if (ref->count >= VE_AT_PARAMS_MAX) {
+					ret = ERROR;
+					goto cleanup;
+				}
+				ref->params[ref->count++] = ve_strdup(begin);
+			}
+			begin = p + 1;
+			if (c == 0) {
+				ret = (inStr ? ERROR : OK);
+				goto cleanup;
+			}
+			break;
+
+		case '\\':
+			if (inStr && p[1] == '"')
+				p++;
+			break;
+
+		case ' ':
+			if (!inStr && begin == p)
+				begin = p + 1;
+			break;
+
+		default:
+			break;
+		}
+		p++;
+	}
+
+cleanup:
+	ve_free(copy);
+	return ret;
+}
+
+/* the command was copied into a parse object on the heap first */
+static s8 ref_parse(RefParsed *ref, char const *atstr)
+{
+	char *obj = ve_strdup(atstr);
+	s8 ret;
+
+	if (!obj)
+		return ERROR;
+	ret = ref_parse_params(ref, atstr);
+	ve_free(obj);
+	return ret;
+}
+
+static s8 parse(char const *atstr, VeAtCmdArena *arena, adl_atCmdPreParser_t **paras)
+{
+	if (!(*paras = ve_atAllocCmdPreParser(atstr, arena)))
+		return ERROR;
+	(*paras)->Port = ADL_PORT_VICTRON;
+	return ve_atCmdParse(*paras, CMD);
+}
+
+static veBool same(char const *atstr)
+{
+	VeAtCmdArena arena;
+	adl_atCmdPreParser_t *paras;
+	RefParsed ref;
+	s8 ret = parse(atstr, &arena, &paras);
+	s8 refRet = ref_parse(&ref, atstr);
+	veBool ok = (ret == refRet);
+	u8 n;
+
+	/* the parameters are only compared when both accepted the command */
+	if (ok && ret == OK) {
+		ok = (paras->Type == ref.type && paras->NbPara == ref.count);
+		for (n = 0; ok && n < ref.count; n++)
+			ok = (strcmp(ve_atParam(paras, n), ref.params[n]) == 0);
+	}
+
+	if (!ok)
+		printf("differs: %s\n", atstr);
+	ve_atFreeCmdPreParser(paras, &arena);
+	ref_free(&ref);
+	return ok;
+}
+
+static void fuzz_cmd(char *buf, size_t max)
+{
+	static char const alphabet[] = "\"\",,\\  aZ19=?";
+	size_t len = bench_rand() % max;
+	size_t n = strlen(CMD);
+
+	strcpy(buf, CMD);
+	buf[n++] = (bench_rand() % 8 ? '=' : "?x"[bench_rand() % 2]);
+	while (n < len)
+		buf[n++] = alphabet[bench_rand() % (sizeof(alphabet) - 1)];
+	buf[n] = 0;
+}
+
+static void time_cmd(char const *atstr)
+{
+	VeAtCmdArena arena;
+	adl_atCmdPreParser_t *paras;
+	RefParsed ref;
+	double start, now, before;
+	u32 n;
+
+	start = bench_now();
+	for (n = 0; n < PARSES; n++) {
+		parse(atstr, &arena, &paras);
+		ve_atFreeCmdPreParser(paras, &arena);
+	}
+	now = bench_ns(start, PARSES);
+
+	start = bench_now();
+	for (n = 0; n < PARSES; n++) {
+		ref_parse(&ref, atstr);
+		ref_free(&ref);
+	}
+	before = bench_ns(start, PARSES);
+
+	printf("  %4u bytes %6.0f ns %6.0f ns  %s\n", (unsigned) strlen(atstr),
+			now, before, strlen(atstr) > 40 ? "(long)" : atstr);
+}
+
+int main(void)
+{
+	char buf[2 * VE_AT_ARENA_CMD];
+	char longCmd[300];
+	u32 n;
+
+	for (n = 0; n < FUZZ; n++) {
+		/* mostly short ones, some longer than fit the arena */
+		fuzz_cmd(buf, n % 16 ? 40 : sizeof(buf));
+		if (!same(buf))
+			return 1;
+	}
+	printf("%u fuzzed commands parsed alike\n", FUZZ);
+
+	strcpy(longCmd, CMD "=2,1,\"");
+	while (strlen(longCmd) < 250)
+		strcat(longCmd, "pub-c-8a7f1e ");
+	strcat(longCmd, "\"");
+
+	printf("             now  before\n");
+	time_cmd(CMD "?");
+	time_cmd(CMD "=1");
+	time_cmd(CMD "=2,1,\"pub-c-8a7f1e\"");
+	time_cmd(CMD "=2,3,\"say \\\"hi\\\"\",4,5");
+	time_cmd(longCmd);
+
+	return 0;
+}
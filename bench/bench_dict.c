@@ -0,0 +1,219 @@
+/*
+ * Copyright (c) 2012 All rights reserved.
+ * Jeroen Hofstee, Victron Energy, jhofstee@victronenergy.com.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/*
+ * Codes AT commands and answers with the pubnub dictionary and reports how
+ * much smaller they get, as text and as they go out: json escaped and url
+ * encoded. Also reports the cost of coding and decoding per byte. Build from
+ * the repository root with:
+ *
+ *   cl /Iwindows\inc /Iapp /Iinc bench\bench_dict.c src\tcp\pubnub_dict.c
+ *      src\utils\str.c src\utils\malloc-2.8.5.c
+ *
+ * Without arguments a built in sample of the V commands is used. Recorded
+ * traffic can be passed as a file instead, one message per line with \r, \n,
+ * \" and \\ written as in C.
+ */
+
+#include "bench.h"
+
+#include <pubnub_dict.h>
+#include <str.h>
+
+#define REPS		2000
+
+static char const* sample[] = {
+	"AT+VREG=1",
+	"\r\n+VREG: 1,0,\"-1\",\"trace.port\"\r\n+VREG: 1,1,\"pub-c-8a7f1e\",\"pubnub.publish\"\r\n"
+		"+VREG: 1,2,\"sub-c-41d2aa\",\"pubnub.subscribe\"\r\n+VREG: 1,3,\"my_channel\",\"pubnub.channel.cmd\"\r\n"
+		"+VREG: 1,4,\"my_channel\",\"pubnub.channel.rsp\"\r\n+VREG: 1,5,\"siwi2way\",\"pubnub.origin\"\r\n"
+		"+VREG: 1,6,\"13581234567890123\",\"pubnub.timetoken\"\r\n\r\nOK\r\n",
+	"AT+VREG=0,1",
+	"\r\n+VREG: 0,1,\"pub-c-8a7f1e\"\r\n\r\nOK\r\n",
+	"AT+VREG=2,3,\"my_channel\"",
+	"\r\nOK\r\n",
+	"AT+VIND?",
+	"\r\n+VIND: 1,\"PUBNUB\",3\r\n+VIND: 1,\"VHTTPC\",1\r\n+VIND: 0,\"common\",0\r\n\r\nOK\r\n",
+	"AT+VIND=0,reg",
+	"\r\nOK\r\n",
+	"AT+VERR?",
+	"\r\n+VERR: 0x0000\r\n\r\nOK\r\n",
+	"AT+CSQ",
+	"\r\n+CSQ: 17,99\r\n\r\nOK\r\n",
+	"AT+CREG?",
+	"\r\n+CREG: 0,1\r\n\r\nOK\r\n",
+	"AT+CGREG?",
+	"\r\n+CGREG: 0,5\r\n\r\nOK\r\n",
+	"AT+VREG=7",
+	"\r\n+CME ERROR: 3\r\n",
+	"AT+VLIST",
+	"\r\n+VLIST: \"AT+VREG\",\"AT+VIND\",\"AT+VERR\",\"AT+VWRN\",\"AT+VWIPDUMP\"\r\n\r\nOK\r\n",
+	"\r\n+VWRN: \"PUBNUB\",\"journal full, oldest message dropped\"\r\n",
+	"AT+XYZ",
+	"\r\nERROR\r\n"
+};
+
+static void json_escape(char const* s, size_t len, Str* out)
+{
+	size_t n;
+
+	for (n = 0; n < len; n++) {
+		switch (s[n]) {
+		case '\r': str_add(out, "\\r"); break;
+		case '\n': str_add(out, "\\n"); break;
+		case '"': str_add(out, "\\\""); break;
+		case '\\': str_add(out, "\\\\"); break;
+		default: str_addc(out, s[n]); break;
+		}
+	}
+}
+
+/* the length once escaped in json and url encoded, as published */
+static size_t wire_len(char const* s, size_t len, Str* tmp)
+{
+	Str json;
+	size_t ret;
+
+	str_new(&json, 256, 256);
+	json_escape(s, len, &json);
+	str_set(tmp, "");
+	str_addUrlEncN(tmp, str_cstr(&json), str_len(&json));
+	ret = str_len(tmp);
+	str_free(&json);
+	return ret;
+}
+
+/* a line of the capture, with the C escapes undone */
+static char* unescape(char* line)
+{
+	char* in = line;
+	char* out = line;
+
+	while (*in && *in != '\n' && *in != '\r') {
+		if (*in == '\\' && in[1]) {
+			in++;
+			*out++ = (*in == 'r' ? '\r' : *in == 'n' ? '\n' : *in);
+			in++;
+		} else {
+			*out++ = *in++;
+		}
+	}
+	*out = 0;
+	return line;
+}
+
+static char** load(char const* file, u32* count)
+{
+	static char line[4096];
+	char** msgs = NULL;
+	FILE* f = fopen(file, "r");
+
+	*count = 0;
+	if (!f)
+		return NULL;
+	while (fgets(line, sizeof(line), f)) {
+		if (!unescape(line)[0])
+			continue;
+		msgs = (char**) realloc(msgs, (*count + 1) * sizeof(char*));
+		msgs[(*count)++] = strcpy((char*) malloc(strlen(line) + 1), line);
+	}
+	fclose(f);
+	return msgs;
+}
+
+int main(int argc, char** argv)
+{
+	char const** msgs = sample;
+	u32 count = sizeof(sample) / sizeof(sample[0]);
+	size_t plain = 0, coded = 0, plainWire = 0, codedWire = 0;
+	Str enc, dec, tmp;
+	double start, encNs, decNs;
+	u32 i, r;
+
+	if (argc > 1 && (msgs = (char const**) load(argv[1], &count)) == NULL) {
+		printf("cannot read %s\n", argv[1]);
+		return 1;
+	}
+
+	str_new(&enc, 1024, 1024);
+	str_new(&dec, 1024, 1024);
+	str_new(&tmp, 1024, 1024);
+
+	for (i = 0; i < count; i++) {
+		size_t len = strlen(msgs[i]);
+
+		str_set(&enc, "");
+		pubnub_dictEncode(msgs[i], len, &enc);
+		str_set(&dec, "");
+		if (!pubnub_dictDecode(enc.data, str_len(&enc), &dec) ||
+				str_len(&dec) != len || memcmp(dec.data, msgs[i], len) != 0) {
+			printf("message %u does not survive coding\n", (unsigned) i);
+			return 1;
+		}
+		plain += len;
+		coded += str_len(&enc);
+		plainWire += wire_len(msgs[i], len, &tmp);
+		codedWire += wire_len(enc.data, str_len(&enc), &tmp);
+	}
+
+	start = bench_now();
+	for (r = 0; r < REPS; r++) {
+		for (i = 0; i < count; i++) {
+			str_set(&enc, "");
+			pubnub_dictEncode(msgs[i], strlen(msgs[i]), &enc);
+		}
+	}
+	encNs = bench_ns(start, (double) REPS * plain);
+
+	start = bench_now();
+	for (r = 0; r < REPS; r++) {
+		for (i = 0; i < count; i++) {
+			str_set(&enc, "");
+			pubnub_dictEncode(msgs[i], strlen(msgs[i]), &enc);
+			str_set(&dec, "");
+			pubnub_dictDecode(enc.data, str_len(&enc), &dec);
+		}
+	}
+	decNs = bench_ns(start, (double) REPS * plain) - encNs;
+
+	printf("%u messages\n", (unsigned) count);
+	printf("  text      %6u -> %6u bytes, %5.1f%%\n", (unsigned) plain,
+			(unsigned) coded, 100.0 * coded / plain);
+	printf("  on wire   %6u -> %6u bytes, %5.1f%%\n", (unsigned) plainWire,
+			(unsigned) codedWire, 100.0 * codedWire / plainWire);
+	printf("  encode    %6.2f ns/byte\n", encNs);
+	printf("  decode    %6.2f ns/byte\n", decNs);
+
+	str_free(&enc);
+	str_free(&dec);
+	str_free(&tmp);
+	if (msgs != sample) {
+		for (i = 0; i < count; i++)
+			free((char*) msgs[i]);
+		free((void*) msgs);
+	}
+	return 0;
+}
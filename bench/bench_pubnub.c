@@ -0,0 +1,241 @@
+/*
+ * Copyright (c) 2012 All rights reserved.
+ * Jeroen Hofstee, Victron Energy, jhofstee@victronenergy.com.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/*
+ * Feeds large batched subscribe responses, [[msg,...],"timetoken"], through
+ * the pubnub response tokenizer, whole and split in TCP sized reads, and
+ * reports the time per response and the throughput. Build from the
+ * repository root with:
+ *
+ *   cl /Iwindows\inc /Iapp /Iinc bench\bench_pubnub.c src\tcp\pubnub.c
+ *      src\tcp\pubnub_nat.c src\utils\ve_timer.c src\utils\ve_lag.c
+ *      src\utils\str.c src\utils\malloc-2.8.5.c
+ *
+ * Define BENCH_YAJL and add the yajl include and library to run yajl on the
+ * same input as well, the way json_parse used it: a yajl_alloc per request,
+ * the strings passed to the callback and a yajl_free at the end. yajl gets
+ * the whole response parsed before yajl_complete_parse, which json_parse
+ * did not wait for.
+ */
+
+#include "bench.h"
+
+#include <pubnub.h>
+#include <ve_httpc.h>
+
+#ifdef BENCH_YAJL
+#include <yajl/yajl_parse.h>
+#endif
+
+#define CHUNK		1460		/* a full TCP segment */
+
+static vhttpc_req_callback parse;
+static u32 msgCount;
+static size_t msgBytes;
+
+/* only what pubnub.c needs of the http client, the request is never send */
+void vhttpc_init(struct VHttpc* httpc, char const* host, u16 port) {}
+void vhttpc_deinit(struct VHttpc* httpc) {}
+void vhttpc_connect(struct VHttpc* httpc) {}
+void vhttpc_req_host(struct VHttpcRequest* req) {}
+void vhttpc_req_keepalive_timeout(struct VHttpcRequest* req, s32 timeout, s32 margin) {}
+void vhttpc_req_retry(struct VHttpcRequest* req, u32 sec) {}
+void vhttpc_req_abort(struct VHttpcRequest* req) {}
+void vhttpc_req_setHttpc(struct VHttpcRequest* req, struct VHttpc* httpc) {}
+
+void vhttpc_req_init(struct VHttpc* httpc, struct VHttpcRequest* req, u16 length, u16 step)
+{
+	str_new(&req->data, length, step);
+}
+
+void vhttpc_req_deinit(struct VHttpcRequest* req)
+{
+	str_free(&req->data);
+}
+
+int vhttpc_add(struct VHttpcRequest* req, vhttpc_req_callback callback)
+{
+	parse = callback;
+	return RET_OK;
+}
+
+static void received(struct PubnubRequest* req, NubEv ev, char const* buf, int len, void *ctx)
+{
+	if (ev != NUB_DATA && ev != NUB_JSON)
+		return;
+	msgCount++;
+	msgBytes += len;
+}
+
+/* n answers to AT commands, as pubnub_at publishes them */
+static void response(Str* s, u32 n)
+{
+	char msg[128];
+	u32 i;
+
+	str_set(s, "[[");
+	for (i = 0; i < n; i++) {
+		if (i)
+			str_addc(s, ',');
+		sprintf(msg, "{\"id\":\"%u\",\"cmd\":\"AT+VREG=1\","
+			"\"ret\":\"\\r\\n+VREG: 1,\\\"pub-c-8a7f\\\",%u\\r\\n"
+			"\\r\\nOK\\r\\n\",\"ms\":%u}", i, bench_rand() % 1000, i % 40);
+		str_add(s, msg);
+	}
+	str_add(s, "],\"13581234567890123\"]");
+}
+
+static void tok_run(struct PubnubRequest* nubreq, Str const* s, int chunk)
+{
+	struct VHttpcRequest* req = &nubreq->req;
+	size_t pos;
+	int n;
+
+	pubnub_subscribe(nubreq, "0", received);
+	parse(req, REQ_BEING_SEND, NULL, 0);
+	for (pos = 0; pos < str_len(s); pos += n) {
+		n = (int) MIN((size_t) chunk, str_len(s) - pos);
+		if (parse(req, REQ_DATA, &s->data[pos], n) != RET_OK) {
+			printf("parse error\n");
+			exit(1);
+		}
+	}
+	parse(req, REQ_DONE, NULL, 0);
+}
+
+#ifdef BENCH_YAJL
+static int yajl_level;
+static int yajl_maps;
+
+/* the strings in a message are passed on, so count the message once */
+static int json_string(void *ctx, const unsigned char *buf, size_t len)
+{
+	if (yajl_level > 1 && !yajl_maps)
+		msgCount++;
+	msgBytes += len;
+	return 1;
+}
+
+static int json_start_map(void *ctx)
+{
+	if (yajl_level > 1 && !yajl_maps++)
+		msgCount++;
+	return 1;
+}
+
+static int json_end_map(void *ctx)
+{
+	yajl_maps--;
+	return 1;
+}
+
+static int json_start_array(void *ctx)
+{
+	yajl_level++;
+	return 1;
+}
+
+static int json_end_array(void *ctx)
+{
+	yajl_level--;
+	return 1;
+}
+
+static yajl_callbacks callbacks = {
+	NULL, NULL, NULL, NULL, NULL, json_string,
+	json_start_map, NULL, json_end_map, json_start_array, json_end_array
+};
+
+static void yajl_run(Str const* s, int chunk)
+{
+	yajl_handle yajl = yajl_alloc(&callbacks, NULL, NULL);
+	size_t pos;
+	size_t n;
+
+	yajl_level = 0;
+	yajl_maps = 0;
+	for (pos = 0; pos < str_len(s); pos += n) {
+		n = MIN((size_t) chunk, str_len(s) - pos);
+		if (yajl_parse(yajl, (unsigned char const*) &s->data[pos], n) != yajl_status_ok) {
+			printf("yajl parse error\n");
+			exit(1);
+		}
+	}
+	yajl_complete_parse(yajl);
+	yajl_free(yajl);
+}
+#endif
+
+/* per response, the batches are repeated to parse about the same amount */
+static void report(char const* name, double start, u32 reps, size_t len)
+{
+	double ns = bench_ns(start, reps);
+
+	printf("  %-6s %9.1f us/response %7.1f MB/s %6u msgs\n", name, ns / 1000,
+			len * 1e3 / ns, (unsigned) (msgCount / reps));
+}
+
+int main(void)
+{
+	static struct Pubnub nub;
+	static struct PubnubRequest nubreq;
+	static u32 const batches[] = {1, 10, 100, 400};
+	static int const chunks[] = {CHUNK, 0x7FFF};
+	Str s;
+	u32 b, c, i, reps;
+	double start;
+
+	pubnub_init(&nub, "bench", "pub", "sub", "0", "localhost", 80, NULL);
+	pubnub_req_init(&nub, &nubreq, 200, 200);
+	str_new(&s, 1024, 1024);
+
+	for (b = 0; b < sizeof(batches) / sizeof(batches[0]); b++) {
+		response(&s, batches[b]);
+		reps = 2000000 / str_len(&s) + 10;
+		for (c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++) {
+			printf("%u msgs, %u bytes, %s:\n", (unsigned) batches[b],
+					(unsigned) str_len(&s), chunks[c] == CHUNK ? "1460 byte reads" : "one read");
+
+			msgCount = 0;
+			start = bench_now();
+			for (i = 0; i < reps; i++)
+				tok_run(&nubreq, &s, chunks[c]);
+			report("tok", start, reps, str_len(&s));
+
+#ifdef BENCH_YAJL
+			msgCount = 0;
+			start = bench_now();
+			for (i = 0; i < reps; i++)
+				yajl_run(&s, chunks[c]);
+			report("yajl", start, reps, str_len(&s));
+#endif
+		}
+	}
+
+	str_free(&s);
+	pubnub_req_deinit(&nubreq);
+	return 0;
+}
@@ -0,0 +1,212 @@
+/*
+ * Copyright (c) 2012 All rights reserved.
+ * Jeroen Hofstee, Victron Energy, jhofstee@victronenergy.com.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/*
+ * Runs the timing wheel of ve_timer with 10k to 1M timers armed, on a clock
+ * of its own so no time is spent waiting: the time to arm, to reload and to
+ * cancel a timer, the time a tick takes which expires nothing and the time
+ * per expired timer while they all run out. The timer list as it was is
+ * timed alongside, at the sizes it can bear. Build from the repository root
+ * with:
+ *
+ *   cl /Iwindows\inc /Iapp /Iinc bench\bench_timer.c src\utils\ve_lag.c
+ *      src\utils\malloc-2.8.5.c
+ *
+ * ve_timer.c is included, so it takes its time from bench_clock.
+ */
+
+#include "bench.h"
+
+static u32 clockMs;
+
+static u32 bench_clock(void)
+{
+	return clockMs;
+}
+
+#define GetTickCount	bench_clock
+#include "../src/utils/ve_timer.c"
+
+#define OPS			100000
+#define IDLE		10000
+#define LIST_OPS	1000
+
+/* up to ten minutes, as a poll, retry or scheduled job would use */
+#define RANDOM_MS	(1000 + bench_rand() % 600000)
+
+static u32 fired;
+
+static void expired(void *ctx)
+{
+	fired++;
+}
+
+/* the list the timers were kept in, timed on its own since it can't hold many */
+static struct VeTimer* queue;
+
+static void list_timer(struct VeTimer* tmr, u32 sec)
+{
+	struct VeTimer *p = queue;
+
+	tmr->value = sec;
+	while (p) {
+		if (p == tmr)
+			return;
+		p = p->next;
+	}
+	tmr->next = queue;
+	queue = tmr;
+}
+
+static void list_cancel(struct VeTimer* tmr)
+{
+	struct VeTimer **p = &queue;
+
+	while (*p && *p != tmr)
+		p = &(*p)->next;
+	if (*p)
+		*p = tmr->next;
+}
+
+static void list_tick(void)
+{
+	struct VeTimer **p = &queue;
+
+	while (*p) {
+		if (--(*p)->value == 0)
+			*p = (*p)->next;
+		else
+			p = &(*p)->next;
+	}
+}
+
+static void list_bench(struct VeTimer* tmrs, u32 count)
+{
+	double start, arm, cancel, tick;
+	u32 n;
+
+	queue = NULL;
+	for (n = 0; n < count; n++) {
+		tmrs[n].value = 1 + RANDOM_MS / 1000;
+		tmrs[n].next = queue;
+		queue = &tmrs[n];
+	}
+
+	/* reloads, so the whole list is searched */
+	start = bench_now();
+	for (n = 0; n < LIST_OPS; n++)
+		list_timer(&tmrs[bench_rand() % count], 1 + RANDOM_MS / 1000);
+	arm = bench_ns(start, LIST_OPS);
+
+	start = bench_now();
+	for (n = 0; n < LIST_OPS; n++)
+		list_cancel(&tmrs[bench_rand() % count]);
+	cancel = bench_ns(start, LIST_OPS);
+
+	start = bench_now();
+	for (n = 0; n < 10; n++)
+		list_tick();
+	tick = bench_ns(start, 10);
+
+	printf("  list  %8.0f %8.0f %8.0f %10.0f\n", arm, arm, cancel, tick);
+}
+
+static void wheel_bench(struct VeTimer* tmrs, u32 count)
+{
+	double start, arm, reload, cancel, idle, fire;
+	u32 n;
+
+	memset(tmrs, 0, count * sizeof(*tmrs));
+	clockMs = 0;
+	ve_timer_init();
+
+	start = bench_now();
+	for (n = 0; n < count; n++)
+		ve_timer_ms(&tmrs[n], RANDOM_MS, expired, NULL);
+	arm = bench_ns(start, count);
+
+	start = bench_now();
+	for (n = 0; n < OPS; n++)
+		ve_timer_ms(&tmrs[bench_rand() % count], RANDOM_MS, expired, NULL);
+	reload = bench_ns(start, OPS);
+
+	/* and armed again, so all of them stay in */
+	start = bench_now();
+	for (n = 0; n < OPS; n++)
+		ve_timer_cancel(&tmrs[bench_rand() % count]);
+	cancel = bench_ns(start, OPS);
+	for (n = 0; n < count; n++)
+		if (!tmrs[n].pprev)
+			ve_timer_ms(&tmrs[n], RANDOM_MS, expired, NULL);
+
+	/*
+	 * Ticks before the first timer is due, a second at most, over and
+	 * over. The slots are only read, so going back does no harm.
+	 */
+	start = bench_now();
+	for (n = 0; n < IDLE; n++) {
+		ve_timer_tick();
+		if (n % (1000 / VE_TIMER_TICK_MS - 1) == 1000 / VE_TIMER_TICK_MS - 2)
+			ticks -= 1000 / VE_TIMER_TICK_MS - 1;
+	}
+	idle = bench_ns(start, IDLE);
+
+	/* let them all expire, waking for each deadline as a main loop would */
+	fired = 0;
+	start = bench_now();
+	while (ve_timer_next_deadline() != VE_TIMER_NONE) {
+		clockMs += ve_timer_next_deadline();
+		ve_timer_update();
+	}
+	fire = bench_ns(start, fired);
+	if (fired != count) {
+		printf("%u of %u timers expired\n", (unsigned) fired, (unsigned) count);
+		exit(1);
+	}
+
+	printf("  wheel %8.0f %8.0f %8.0f %10.0f %8.0f\n", arm, reload, cancel, idle, fire);
+}
+
+int main(void)
+{
+	static u32 const counts[] = {10000, 100000, 1000000};
+	struct VeTimer* tmrs;
+	u32 c;
+
+	printf("ns per    arm   reload   cancel       tick   expire\n");
+	for (c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+		printf("%u timers\n", (unsigned) counts[c]);
+		tmrs = (struct VeTimer*) calloc(counts[c], sizeof(*tmrs));
+		if (!tmrs)
+			return 1;
+		wheel_bench(tmrs, counts[c]);
+		if (counts[c] <= 100000)
+			list_bench(tmrs, counts[c]);
+		free(tmrs);
+	}
+
+	return 0;
+}
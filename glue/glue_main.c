@@ -26,40 +26,52 @@
 
 #include <platform.h>
 
-#include <conio.h>
+#include <stdio.h>
 
-#include <str.h>
 #include <ve_at.h>
 #include <ve_timer.h>
 
+#define GLUE_LINE_MAX		512
+
 static void print_it(adl_atResponse_t* paras)
 {
 	printf("%s", paras->StrData);
 }
 
+/*
+ * The console can't be waited for together with the sockets, so the lines
+ * typed are read by a thread of their own and posted to the main loop.
+ */
+static DWORD WINAPI keyboard(LPVOID arg)
+{
+	char line[GLUE_LINE_MAX];
+
+	while (fgets(line, sizeof(line), stdin)) {
+		line[strcspn(line, "\r\n")] = 0;
+		glue_post(line);
+	}
+	return 0;
+}
+
 void glue_main(void)
 {
-	Str cmd;
-	str_new(&cmd, 512, 512);
+	char cmd[GLUE_LINE_MAX];
+	int len;
+	u32 wait;
+
+	CreateThread(NULL, 0, keyboard, NULL, 0, NULL);
 
 	while (1)
 	{
-		while (kbhit()) {
-			char c = getche();
-			if (c == '\r') {
-				fputc('\n', stdout);
-				if (ve_atCmdSendExt(cmd.data, ADL_PORT_NONE, 0, NULL, print_it) != OK)
-					printf("ERROR\n");
-				str_set(&cmd, "");
-			} else if (c == '\b') {
-				str_rmc(&cmd);
-				fputc(' ', stdout);
-				fputc('\b', stdout);
-			} else {
-				str_addc(&cmd, c);
-			}
+		/* sleep till a socket event, a command or the next timer is due */
+		wait = ve_timer_next_deadline();
+		wip_update(wait == VE_TIMER_NONE ? -1 : (int) MIN(wait, 0x7FFFFFFF));
+
+		while ((len = glue_fetch(cmd, sizeof(cmd) - 1)) > 0) {
+			cmd[len] = 0;
+			if (ve_atCmdSendExt(cmd, ADL_PORT_NONE, 0, NULL, print_it) != OK)
+				printf("ERROR\n");
 		}
-		wip_update(100);
 		ve_timer_update();
 	}
 }
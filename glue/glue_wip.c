@@ -48,6 +48,8 @@ typedef struct SocketInfo_s
 } SocketInfo;
 
 static SocketInfo* queue;
+static SOCKET postSock;			/* wakes wip_update, see glue_post */
+static struct sockaddr_in postAddr;
 static fd_set rx;
 static fd_set tx;
 static fd_set err;
@@ -127,24 +129,29 @@ static void handle_events(fd_set* set, enum wip_event_kind_t kind)
 	}
 }
 
+/* wait ms for socket events or a glue_post, for ever if ms is negative */
 int wip_update(int ms)
 {
 	struct timeval waitd;
 	int n;
 
-	waitd.tv_sec = 0;
-	waitd.tv_usec = ms;
+	waitd.tv_sec = ms / 1000;
+	waitd.tv_usec = (ms % 1000) * 1000;
 	rx_ev = rx;
 	tx_ev = tx;
 	err_ev = rx;
 
-	n = select(0, &rx_ev, &tx_ev, &err_ev, &waitd);
+	n = select(0, &rx_ev, &tx_ev, &err_ev, (ms < 0 ? NULL : &waitd));
 	if (n < 0)
 		return RET_NOT_IMPLEMENTED;
 
 	if (n == 0)
 		return RET_OK;
 
+	/* the message is left for glue_fetch */
+	FD_CLR(postSock, &rx_ev);
+	FD_CLR(postSock, &err_ev);
+
 	handle_events(&err_ev, WIP_CEV_ERROR);
 	handle_events(&rx_ev, WIP_CEV_READ);
 	handle_events(&tx_ev, WIP_CEV_WRITE);
@@ -250,13 +257,44 @@ int wip_close(wip_channel_t c)
 	return 0;
 }
 
+/*
+ * A message to the main loop, which is woken by it. It can be send from
+ * another thread, e.g. one waiting for the keyboard.
+ */
+void glue_post(char const* msg)
+{
+	sendto(postSock, msg, (int) strlen(msg), 0,
+			(struct sockaddr*) &postAddr, sizeof(postAddr));
+}
+
+/* a message send by glue_post, 0 when there is none */
+int glue_fetch(char* buf, int size)
+{
+	int ret = recv(postSock, buf, size, 0);
+	return (ret > 0 ? ret : 0);
+}
+
 s8 wip_netInitOpts(int opt, ...)
 {
+	int len = sizeof(postAddr);
+	u_long nonblock = 1;
 #if defined(_WIN32)
 	WSADATA wsaData;
 	if (WSAStartup(MAKEWORD(2, 0), &wsaData) != NO_ERROR)
 		return -1;
 #endif
+
+	/* a datagram to itself wakes the select */
+	postSock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	memset(&postAddr, 0, sizeof(postAddr));
+	postAddr.sin_family = AF_INET;
+	postAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(postSock, (struct sockaddr*) &postAddr, sizeof(postAddr)) != 0 ||
+			getsockname(postSock, (struct sockaddr*) &postAddr, &len) != 0 ||
+			ioctlsocket(postSock, FIONBIO, &nonblock) != 0)
+		return -1;
+	FD_SET(postSock, &rx);
+
 	return 0;
 }
 
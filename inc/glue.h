@@ -101,8 +101,15 @@ typedef struct {
 	char StrData[1];
 } adl_atResponse_t;
 
+typedef struct {
+	u8 Dest;
+	u16 StrLength;
+	char StrData[1];
+} adl_atUnsolicited_t;
+
 typedef void (*adl_atCmdHandler_t)(adl_atCmdPreParser_t*);
 typedef void (*adl_atRspHandler_t)(adl_atResponse_t*);
+typedef veBool (*adl_atUnSoHandler_t)(adl_atUnsolicited_t*);
 
 __inline s16 adl_atCmdSubscribe(char *cmdStr, adl_atCmdHandler_t Cmdhdl, u16 Cmdopt) { return OK; }
 __inline s16 adl_atCmdUnSubscribe(char *cmdstr, adl_atCmdHandler_t Cmdhdl) { return ERROR; }
@@ -110,6 +117,8 @@ __inline s8 adl_atCmdSendExt(char *atstr, adl_atPort_e port, u16 NI, void *ctx,
 __inline s8 adl_atSendResponsePort(int k, adl_atPort_e port, char const* str) {	return ERROR; }
 __inline s8 adl_atSendResponse(u16 type, char const *str) {	printf("%s", str); return OK; }
 __inline s8 adl_atSendStdResponse(u16 Type, adl_strID_e rspId) { return ERROR; }
+__inline s16 adl_atUnSoSubscribe(char *unsoStr, adl_atUnSoHandler_t unsoHdl) { return OK; }
+__inline s16 adl_atUnSoUnSubscribe(char *unsoStr, adl_atUnSoHandler_t unsoHdl) { return OK; }
 
 /* Flash */
 s8 adl_flhSubscribe(char *handle, u16 nbObjectsRes);
@@ -146,6 +155,7 @@ typedef enum {
 #define ADL_RTC_GET_TIMESTAMP_HOURS(a)			0
 #define ADL_RTC_GET_TIMESTAMP_MINUTES(a)		0
 #define ADL_RTC_GET_TIMESTAMP_SECONDS(a)		0
+#define ADL_RTC_GET_TIMESTAMP_MSECONDS(a)		0
 
 void adl_rtcGetTime(adl_rtcTime_t* tm);
 void adl_rtcConvertTime(adl_rtcTime_t* a, adl_rtcTimeStamp_t* b, rtcConvert conv);
@@ -205,6 +215,8 @@ veBool wip_inet_aton(const char *str, wip_in_addr_t *addr);
 veBool wip_inet_ntoa(wip_in_addr_t addr, char *buf, u16 buflen);
 
 int wip_update(int ms);
+void glue_post(char const* msg);
+int glue_fetch(char* buf, int size);
 void glue_main(void);
 
 #endif
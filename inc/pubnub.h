@@ -27,12 +27,13 @@
  * DAMAGE.
  */
 
+#include "pubnub_nat.h"
 #include "ve_httpc.h"
-#include "yajl/yajl_parse.h"
 
 typedef enum {
-	NUB_DATA,
-	NUB_ERROR,
+	NUB_DATA,		/* a string message, buf is the unescaped string */
+	NUB_JSON,		/* any other message, buf is the message as json */
+	NUB_ERROR,		/* the request failed or a message was dropped */
 	NUB_DONE
 } NubEv;
 
@@ -41,21 +42,65 @@ struct PubnubRequest;
 typedef void (*pubnub_req_callback)(struct PubnubRequest* req, NubEv ev,
 									char const* buf, int buf_len, void *ctx);
 
+/*
+ * A subscribed channel, owned by the caller. Messages on the channel are
+ * passed to its callback, or to the callback of the subscribe request when
+ * the channel has none. NUB_DONE and NUB_ERROR always go to the request.
+ */
+struct PubnubChannel {
+	char const* name;
+	pubnub_req_callback callback;
+	void *ctx;
+	struct PubnubChannel* next;
+};
+
 struct Pubnub {
-	char const* channel;
+	struct PubnubChannel* channels;	/* subscribed channels */
+	struct PubnubChannel mainChannel;	/* the channel passed to pubnub_init */
+	char const* pubChannel;		/* channel published to */
 	char const* publishKey;
 	char const* subscribeKey;
 	char const* secretKey;
 	char timeToken[20];
-	struct VHttpc httpc;
+	struct PubnubRequest* subReq;	/* last subscribe request */
+	veBool subQueued;			/* subReq is queued or in progress */
+	struct PubnubNat* nat;		/* optional, limits the poll duration */
+	struct VeTimer pollTmr;
+	u16 pollLimit;				/* s the current poll may take, 0 for no limit */
+	veBool reconnect;			/* the subscribe was ended on purpose */
+	struct PubnubRequest* probeReq;	/* optional, publishes the NAT probes */
+	struct PubnubChannel probeChannel;	/* the probes come back on */
+	veBool probing;				/* the current poll waits for a probe */
+	veBool probeQueued;			/* probeReq is queued or in progress */
+	struct VHttpc httpc;		/* subscribe connection */
+	struct VHttpc pubHttpc;		/* publish, not stuck behind the long poll */
+	veBool preconnected;		/* by pubnub_connect, before pubnub_init */
 	void *ctx;
 };
 
 struct PubnubRequest {
 	struct Pubnub* nub;
 	struct VHttpcRequest req;
-	yajl_handle yajl;
-	int level;
+	/* response tokenizer */
+	u8 tokState;
+	u8 out;						/* where the current value goes to */
+	u16 level;
+	u16 item;					/* index of the current envelope element */
+	veBool raw;					/* copy the string as is, with escapes */
+	u8 hexDigits;
+	u16 ucs;
+	u16 surrogate;
+	u8 tokenLen;
+	char token[20];
+	size_t msgPos;				/* header of the message being collected */
+	u16 msgCount;				/* messages in the response so far */
+	veBool msgDropped;			/* the message being collected is too long */
+
+	veBool isSubscribe;
+	veBool complete;			/* the envelope is parsed */
+	veBool chanList;			/* the response ends with the channel list */
+	Str msgs;					/* messages waiting for the channel list */
+	size_t chanPos;				/* start of the channel list in msgs */
 	pubnub_req_callback callback;
 };
 
@@ -63,10 +108,22 @@ int pubnub_init(struct Pubnub* nub, char const* channel, const char* publishKey,
 					const char* subscribeKey, const char* secretKey,
 					const char* host, u16 port, void *ctx);
 void pubnub_deinit(struct Pubnub* nub);
+void pubnub_setPublishChannel(struct Pubnub* nub, char const* channel);
+void pubnub_setTimeToken(struct Pubnub* nub, char const* timeToken);
+void pubnub_connect(struct Pubnub* nub, char const* host, u16 port);
+void pubnub_setNat(struct Pubnub* nub, struct PubnubNat* nat,
+					struct PubnubRequest* probeReq, char const* probeChannel);
+void pubnub_channelAdd(struct Pubnub* nub, struct PubnubChannel* ch, char const* name,
+						pubnub_req_callback callback, void *ctx);
+void pubnub_channelRemove(struct Pubnub* nub, struct PubnubChannel* ch);
 
 void pubnub_req_init(struct Pubnub* nub, struct PubnubRequest* req, u16 length, u16 step);
 void pubnub_req_deinit(struct PubnubRequest* nubreq);
 int pubnub_subscribe(struct PubnubRequest* nubreq, const char* timeToken, pubnub_req_callback callback);
 int pubnub_publish(struct PubnubRequest* nubreq, const char* json, pubnub_req_callback callback);
+int pubnub_publishTo(struct PubnubRequest* nubreq, char const* channel, const char* json,
+						pubnub_req_callback callback);
+Str* pubnub_publishBegin(struct PubnubRequest* nubreq, char const* channel);
+int pubnub_publishEnd(struct PubnubRequest* nubreq, pubnub_req_callback callback);
 
 #endif
@@ -27,21 +27,120 @@
  * DAMAGE.
  */
 
+#include <dev_reg_app.h>
 #include <pubnub.h>
+#include <pubnub_delta.h>
+#include <pubnub_dict.h>
+#include <pubnub_frag.h>
+#include <pubnub_journal.h>
+#include <pubnub_sched.h>
+#include <pubnub_urc.h>
 #include <yajl/yajl_gen.h>
 
+/* max number of commands waiting to be executed */
+#define PUBNUB_AT_QUEUE		8
+
+/* seconds a response may wait for the connection */
+#define PUBNUB_AT_TTL		(5*60)
+
+/* max number of commands whose answer can be cached */
+#define PUBNUB_AT_CACHE		8
+
+/* max number of commands in a single script */
+#define PUBNUB_AT_SCRIPT_MAX	64
+
+/* max number of commands whose last reply is kept for delta replies */
+#define PUBNUB_AT_DELTA		4
+
+/* after this many delta replies all lines are sent again */
+#define PUBNUB_AT_KEYFRAME	10
+
+/*
+ * A command waiting for execution. A script stores its commands one after
+ * the other, each zero terminated, the id follows the last one.
+ */
+struct PubnubAtCmd {
+	char* cmd;					/* allocated, the id is stored after it */
+	char* id;					/* NULL when there is none */
+	veBool idIsNumber;
+	veBool envelope;			/* answered with a single reply */
+	u8 steps;					/* number of commands of a script, 0 if none */
+	veBool stopOnError;
+	veBool delta;				/* reply with the changes to the last one */
+	veBool dict;				/* reply with coded lines, see pubnub_dict.h */
+	u32 timeout;				/* ms, 0 for none */
+};
+
+/* the last answer to a read only command, see pubnub.cache */
+struct PubnubAtCache {
+	char* cmd;					/* allocated */
+	u16 ttl;					/* s */
+	veBool readsRegs;			/* invalidated by register changes */
+	veBool valid;
+	u32 stored;					/* ve_timer_uptime */
+	u16 regChanges;				/* when stored */
+	Str rsp;					/* zero terminated lines, the last is final */
+};
+
+/* the last reply to a command send with "delta":true */
+struct PubnubAtDelta {
+	char* cmd;					/* allocated */
+	Str lines;					/* zero terminated lines of the reply */
+	u16 seq;					/* of the reply */
+	u8 deltas;					/* delta replies since all lines were sent */
+	veBool dict;				/* the lines are coded */
+	u32 used;					/* ve_timer_uptime */
+};
+
 struct PubnubAt {
 	struct Pubnub nub;
 	struct PubnubRequest subReq;
+	struct PubnubNat nat;
+	struct PubnubRequest probeReq;	/* NAT probes, see pubnub_nat.c */
+	Str probeChannel;			/* the probes are send to */
+	char const* origin;			/* identifies the messages send by this device */
+	veBool tagResponses;		/* commands and responses share a channel */
 	veBool atCmdPending;
+	veBool cmdRunning;			/* guards cmd_next against recursion */
+	struct PubnubAtCmd cmdQueue[PUBNUB_AT_QUEUE];
+	u8 cmdHead;
+	u8 cmdCount;
+	struct PubnubAtCmd cur;		/* being executed */
+	char* step;					/* the command of cur being executed */
+	veBool scriptFailed;
+	yajl_gen reply;				/* reply to cur, built while it runs */
+	Str replyJson;				/* the reply is escaped into */
+	Str lines;					/* lines of cur, for a delta reply */
+	u32 cmdStart;				/* ve_timer_now_ms when cur was started */
+	struct VeTimer cmdTmr;
+	struct PubnubAtCache cache[PUBNUB_AT_CACHE];
+	u8 cacheCount;
+	u16 cacheConfig;			/* config changes seen */
+	struct PubnubAtCache* recording;	/* answer of cur being stored */
+	struct PubnubAtDelta delta[PUBNUB_AT_DELTA];
+	u8 deltaCount;
+	struct PubnubUrc urc;
+	struct PubnubJournal journal;	/* outgoing messages */
+	struct PubnubFrag frag;		/* messages too long for a single publish */
+	struct PubnubSched sched;	/* commands run periodically */
+	veBool cmdReceived;			/* since the time token was last saved */
+	veBool tokenTmrArmed;
+	veBool tokenSaveSoon;		/* armed for TOKEN_CMD_DELAY, after commands */
+	struct VeTimer tokenTmr;
 	yajl_gen g;
 };
 
-int pubnub_atInit(struct PubnubAt* nubat, char const* channel, const char* publishKey,
-		const char* subscribeKey, const char* secretKey, const char* host, u16 port);
+int pubnub_atInit(struct PubnubAt* nubat, char const* cmdChannel, char const* rspChannel,
+		char const* origin, const char* publishKey, const char* subscribeKey,
+		const char* secretKey, const char* host, u16 port);
+void pubnub_atDeinit(struct PubnubAt* nubat);
+void pubnub_atNetwork(struct PubnubAt* nubat, char const* net);
 
 veBool pubnub_atPublishN(struct PubnubAt* nubat, char const *buf, size_t buf_len);
 veBool pubnub_atPublish(struct PubnubAt* nubat, char const *str);
+veBool pubnub_atPublishJson(struct PubnubAt* nubat, char const* json, u16 ttl);
+void pubnub_atReceived(struct PubnubAt* nubat, char const* json, size_t len);
 void pubnub_atSubscribe(struct PubnubAt* nubat);
+void pubnub_atRegChanged(DevRegId regId);
 
 #endif
@@ -0,0 +1,55 @@
+#ifndef _PUBNUB_DELTA_H_
+#define _PUBNUB_DELTA_H_
+
+/*
+ * Copyright (c) 2012 All rights reserved.
+ * Jeroen Hofstee, Victron Energy, jhofstee@victronenergy.com.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#include <str.h>
+#include <types.h>
+#include <yajl/yajl_gen.h>
+
+/* max number of operations of a diff, more differences send all lines */
+#define PUBNUB_DELTA_OPS		32
+/* how many lines ahead a diff looks for a match */
+#define PUBNUB_DELTA_LOOKAHEAD	4
+
+/*
+ * Line level difference between two lists of lines. Lists are kept in a Str
+ * as zero terminated lines, one after the other. In json a diff is an array
+ * of operations on the old list: a positive number copies that many lines,
+ * a negative number skips that many lines and a string is a new line.
+ */
+struct PubnubDeltaOp {
+	s16 n;				/* lines to copy (> 0) or skip (< 0), 0 to add one */
+	u16 line;			/* the line added, an index in the new list */
+};
+
+int pubnub_deltaDiff(Str const* base, Str const* lines, struct PubnubDeltaOp* ops, int maxOps);
+size_t pubnub_deltaSize(struct PubnubDeltaOp const* ops, int n, Str const* lines);
+veBool pubnub_deltaGen(yajl_gen g, struct PubnubDeltaOp const* ops, int n, Str const* lines);
+veBool pubnub_deltaApply(Str const* base, char const* diff, size_t len, Str* out);
+
+#endif
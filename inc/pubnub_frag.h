@@ -0,0 +1,121 @@
+#ifndef _PUBNUB_FRAG_H_
+#define _PUBNUB_FRAG_H_
+
+/*
+ * Copyright (c) 2012 All rights reserved.
+ * Jeroen Hofstee, Victron Energy, jhofstee@victronenergy.com.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#include <pubnub.h>
+#include <types.h>
+#include <ve_timer.h>
+
+/* max escaped bytes of data in a fragment, so it fits a single publish */
+#define PUBNUB_FRAG_DATA		640
+/*
+ * max number of fragments sent but not acknowledged, about a second of a
+ * GPRS uplink. A single acknowledgement can list all of them in sack.
+ */
+#define PUBNUB_FRAG_WINDOW		16
+/* max number of fragments in a single publish */
+#define PUBNUB_FRAG_BATCH		4
+/* seconds without progress before the unacknowledged fragments are resent */
+#define PUBNUB_FRAG_RTO			10
+/* max bytes of transfers waiting to be sent */
+#define PUBNUB_FRAG_OUT_SIZE	(64*1024)
+/* max number of fragments and bytes of a received transfer */
+#define PUBNUB_FRAG_IN_COUNT	64
+#define PUBNUB_FRAG_IN_SIZE		(16*1024)
+/* max number of fragments listed in sack */
+#define PUBNUB_FRAG_SACK		16
+/* seconds an acknowledgement is delayed, to cover several fragments */
+#define PUBNUB_FRAG_ACK_DELAY	1
+/* seconds after which an incomplete received transfer is given up */
+#define PUBNUB_FRAG_IDLE		60
+
+struct PubnubAt;
+
+/* a transfer to send, allocated with its data, boundaries and ack bitmap */
+struct PubnubFragOut {
+	struct PubnubFragOut* next;
+	u16 id;
+	u16 count;				/* number of fragments */
+	u16 acks;				/* all fragments before it are acknowledged */
+	u16 sent;				/* fragments sent at least once */
+	veBool binary;			/* data is base64 */
+	u32 expires;			/* ve_timer_uptime */
+	u32 size;				/* bytes allocated */
+	u32* offset;			/* count + 1 boundaries in data */
+	u8* acked;				/* bit per fragment */
+	u8* pending;			/* bit per fragment, to be published */
+	char* data;
+};
+
+/* the transfer being received, or the last one when done */
+struct PubnubFragIn {
+	u16 id;
+	char* origin;			/* allocated, of the sender, "" if none */
+	u16 count;				/* 0 when there is none */
+	u16 have;
+	char** part;			/* allocated, count fragments, NULL if missing */
+	u32 size;
+	veBool done;
+	veBool ackDue;
+};
+
+/*
+ * Messages too long for a single publish are split in fragments,
+ * {"origin":"dev1","frag":7,"seq":0,"of":66,"data":"<part of the message>"},
+ * "b64":true is added when data is base64. The receiver acknowledges them,
+ * {"origin":"web","ack":7,"to":"dev1","next":12,"sack":[14,15]}: all before
+ * "next" have been received and so have those in "sack". A few fragments are
+ * sent ahead of the acknowledgements, the ones missing are sent again.
+ * Fragments do not go through the journal, they have a request of their own
+ * which publishes several at once, as a json array. The acknowledgements are
+ * small and are published with the other messages.
+ * Long commands can be sent to the device in the same way, they are handled
+ * as a single message when all fragments are received.
+ */
+struct PubnubFrag {
+	struct PubnubRequest req;	/* first, the callback casts it back */
+	veBool busy;			/* req is underway */
+	struct PubnubAt* nubat;
+	u16 lastId;
+	struct PubnubFragOut* out;	/* the first one is being sent */
+	u32 outSize;
+	struct VeTimer outTmr;
+	struct PubnubFragIn in;
+	struct VeTimer inTmr;
+};
+
+void pubnub_fragInit(struct PubnubFrag* frag, struct PubnubAt* nubat);
+void pubnub_fragDeinit(struct PubnubFrag* frag);
+veBool pubnub_fragSend(struct PubnubFrag* frag, char const* data, size_t len,
+							veBool binary, u16 ttl);
+void pubnub_fragReceived(struct PubnubFrag* frag, char const* origin, u16 id,
+							u16 seq, u16 count, char const* data, size_t len);
+void pubnub_fragAcked(struct PubnubFrag* frag, char const* to, u16 id, u16 next,
+							u16 const* sack, u8 sackCount);
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef _PUBNUB_JOURNAL_H_
+#define _PUBNUB_JOURNAL_H_
+
+/*
+ * Copyright (c) 2012 All rights reserved.
+ * Jeroen Hofstee, Victron Energy, jhofstee@victronenergy.com.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#include <pubnub.h>
+#include <types.h>
+#include <ve_timer.h>
+
+/* max number of bytes of messages waiting to be published */
+#define PUBNUB_JOURNAL_SIZE		4096
+/* max number of bytes of messages published at once */
+#define PUBNUB_JOURNAL_BATCH	1024
+/* seconds messages wait before they are stored in flash as well */
+#define PUBNUB_JOURNAL_SYNC		60
+/* seconds storing them may wait for another timer */
+#define PUBNUB_JOURNAL_SYNC_SLACK	10
+
+struct PubnubJournalMsg {
+	struct PubnubJournalMsg* next;
+	u32 queued;				/* ve_timer_uptime */
+	u32 expires;			/* ve_timer_uptime */
+	u16 len;
+	char* json;				/* allocated with the message, or taken over */
+};
+
+/*
+ * Messages to publish, oldest first. Only one publish is underway at a time,
+ * so while the connection is down messages wait here instead of piling up
+ * as requests. The size is bounded, when full the oldest messages are
+ * dropped. Optionally, messages which cannot be sent for a while are also
+ * kept in flash, so they survive a reboot.
+ */
+struct PubnubJournal {
+	struct PubnubRequest req;	/* first, the callback casts it back */
+	struct Pubnub* nub;
+	veBool busy;			/* req is underway */
+	u8 inFlight;			/* number of messages in req */
+	struct PubnubJournalMsg* head;
+	struct PubnubJournalMsg* tail;
+	u16 size;				/* bytes of json waiting */
+	u16 dropped;			/* messages dropped since the last warning */
+	char const* flash;		/* flash handle, NULL if not stored */
+	veBool stored;			/* the flash contains messages */
+	veBool dirty;			/* changed since stored */
+	struct VeTimer syncTmr;
+	veBool syncArmed;
+};
+
+void pubnub_journalInit(struct PubnubJournal* journal, struct Pubnub* nub, veBool persistent);
+void pubnub_journalDeinit(struct PubnubJournal* journal);
+veBool pubnub_journalAdd(struct PubnubJournal* journal, char const* json, u16 ttl);
+veBool pubnub_journalAddStr(struct PubnubJournal* journal, Str* json, u16 ttl);
+
+#endif
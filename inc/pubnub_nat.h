@@ -0,0 +1,71 @@
+#ifndef _PUBNUB_NAT_H_
+#define _PUBNUB_NAT_H_
+
+/*
+ * Copyright (c) 2012 All rights reserved.
+ * Jeroen Hofstee, Victron Energy, jhofstee@victronenergy.com.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#include <str.h>
+#include <types.h>
+
+/* bounds of the poll duration in seconds */
+#define PUBNUB_NAT_MIN		30
+#define PUBNUB_NAT_MAX		(3*60)
+
+/* seconds a probe may take to come back through the subscribe */
+#define PUBNUB_NAT_QUICK	5
+
+/* max length of the name of a network, e.g. "gprs-20404" */
+#define PUBNUB_NAT_NET		24
+
+/*
+ * Estimate of how long an idle connection survives on a network. Mappings
+ * of NAT routers which are dropped silently stall the subscribe until its
+ * read timeout. So the poll is ended by the client after a while, and the
+ * estimate tries to keep that as long as possible while still safe.
+ */
+struct PubnubNat {
+	char net[PUBNUB_NAT_NET];	/* the network the estimate is for */
+	u16 good;				/* longest idle time seen to survive */
+	u16 bad;				/* shortest idle time seen to fail, 0 if unknown */
+	u16 polls;				/* since the last probe */
+	u16 probe;				/* idle time tested by the current poll, 0 if none */
+	veBool polling;
+	u32 start;				/* uptime the poll was started */
+	u32 startToken;			/* server time of the token polled from */
+	u16 aborted;			/* duration of the last poll if ended by the client */
+	veBool changed;			/* not saved yet */
+};
+
+void pubnub_natInit(struct PubnubNat* nat, char const* net, char const* stored);
+u16 pubnub_natTimeout(struct PubnubNat* nat);
+u16 pubnub_natProbe(struct PubnubNat* nat);
+void pubnub_natProbeLost(struct PubnubNat* nat);
+void pubnub_natPollStart(struct PubnubNat* nat, char const* token);
+void pubnub_natPollAbort(struct PubnubNat* nat);
+void pubnub_natPollDone(struct PubnubNat* nat, char const* token, veBool hadMessages);
+void pubnub_natStore(struct PubnubNat* nat, char const* stored, Str* out);
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef _PUBNUB_SCHED_H_
+#define _PUBNUB_SCHED_H_
+
+/*
+ * Copyright (c) 2012 All rights reserved.
+ * Jeroen Hofstee, Victron Energy, jhofstee@victronenergy.com.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#include <str.h>
+#include <types.h>
+#include <ve_timer.h>
+#include <yajl/yajl_gen.h>
+
+/* number of sched.N registers */
+#define PUBNUB_SCHED_ENTRIES	4
+/* shortest interval in seconds */
+#define PUBNUB_SCHED_MIN		10
+/* seconds a command may wait for another timer */
+#define PUBNUB_SCHED_SLACK		2
+/* seconds a report may wait for the connection */
+#define PUBNUB_SCHED_TTL		(30*60)
+/* seconds a command may take, else it is reported as TIMEOUT */
+#define PUBNUB_SCHED_TIMEOUT	30
+
+struct PubnubAt;
+struct PubnubSched;
+
+struct PubnubSchedEntry {
+	struct PubnubSched* sched;
+	char* cmd;				/* allocated */
+	u16 interval;			/* s */
+	u16 threshold;			/* numbers which differ no more are unchanged */
+	u32 due;				/* ve_timer_uptime */
+	Str last;				/* zero terminated lines last reported, final last */
+	veBool reported;
+	u8 stale;				/* answers still to come of timed out runs */
+};
+
+/*
+ * Runs the commands of the sched.N registers periodically on the device
+ * itself and only reports answers which differ from the last reported one.
+ * The reports of commands which are due at the same time are published
+ * together.
+ */
+struct PubnubSched {
+	struct PubnubAt* nubat;
+	struct PubnubSchedEntry entries[PUBNUB_SCHED_ENTRIES];
+	u8 count;
+	struct PubnubSchedEntry* running;
+	veBool looping;			/* guards sched_next against recursion */
+	Str lines;				/* of the running command */
+	yajl_gen report;		/* NULL till a command changed */
+	struct VeTimer tmr;
+	struct VeTimer cmdTmr;	/* of the running command */
+};
+
+void pubnub_schedInit(struct PubnubSched* sched, struct PubnubAt* nubat);
+void pubnub_schedDeinit(struct PubnubSched* sched);
+
+#endif
@@ -0,0 +1,83 @@
+#ifndef _PUBNUB_URC_H_
+#define _PUBNUB_URC_H_
+
+/*
+ * Copyright (c) 2012 All rights reserved.
+ * Jeroen Hofstee, Victron Energy, jhofstee@victronenergy.com.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#include <types.h>
+#include <ve_at.h>
+#include <ve_timer.h>
+
+/* max number of prefixes in pubnub.urc */
+#define PUBNUB_URC_PREFIXES		8
+/* max number of different lines per message */
+#define PUBNUB_URC_LINES		8
+/* max number of types rate limited separately */
+#define PUBNUB_URC_TYPES		8
+/* seconds lines are collected before they are published */
+#define PUBNUB_URC_WINDOW		2
+/* max number of different lines per type per minute */
+#define PUBNUB_URC_RATE			10
+/* seconds a message may wait for the connection */
+#define PUBNUB_URC_TTL			(30*60)
+
+struct PubnubAt;
+
+struct PubnubUrcLine {
+	char* line;				/* allocated */
+	u16 count;
+};
+
+/* the part of the line before the colon, e.g. +CSQ */
+struct PubnubUrcType {
+	char name[12];
+	u8 sent;				/* lines since */
+	u32 since;				/* ve_timer_uptime */
+};
+
+/*
+ * Forwards unsolicited output, of the modem and the traces of the device,
+ * to the pubnub response channel. Lines are collected for a short while and
+ * published together, repeated lines are counted instead of sent again.
+ */
+struct PubnubUrc {
+	struct PubnubAt* nubat;
+	char* prefixes;			/* copy of the config, the listeners point in it */
+	VeAtUnso unso[PUBNUB_URC_PREFIXES];
+	u8 unsoCount;
+	struct PubnubUrcLine lines[PUBNUB_URC_LINES];
+	u8 lineCount;
+	struct PubnubUrcType types[PUBNUB_URC_TYPES];
+	u8 typeCount;
+	u16 dropped;			/* lines over the rate limit */
+	veBool windowOpen;
+	struct VeTimer windowTmr;
+};
+
+void pubnub_urcInit(struct PubnubUrc* urc, struct PubnubAt* nubat, char const* prefixes);
+void pubnub_urcDeinit(struct PubnubUrc* urc);
+
+#endif
@@ -31,6 +31,9 @@
 #include <stdarg.h>
 #include <types.h>
 
+/// Largest buffer of a Str, growing beyond it sets error
+#define STR_MAX_SIZE	0xFFFF
+
 /// Simple string which dynamically allocates memory
 typedef struct
 {
@@ -53,6 +56,7 @@ size_t str_len(Str const *str);
 void str_free(Str *str);
 
 size_t str_add(Str *str, char const *value);
+void str_addn(Str *str, char const *buf, size_t len);
 void str_addc(Str *str, char value);
 void str_addInt(Str *str, int val);
 void str_addIntStr(Str *str, int val, char const *post);
@@ -64,6 +68,7 @@ void str_addFloat(Str *str, float val, int dec);
 void str_addFloatExt(Str *str, float val, int len, int dec, veBool fixed);
 void str_addFloatStr(Str *str, float val, int dec, char const *post);
 void str_addUrlEnc(Str *str, char const *string);
+void str_addUrlEncN(Str *str, char const *buf, size_t len);
 void str_addUrlEncChr(Str *str, char chr);
 
 void str_addQVarNrStr(Str *str, char const *var, int n, char const* value);
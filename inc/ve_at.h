@@ -28,21 +28,55 @@
 
 #include <platform.h>
 
-/// The port used for internal AT commands
+/// The first port used for internal AT commands
 #define ADL_PORT_VICTRON	(ADL_PORT_OPEN_AT_VIRTUAL_BASE + 0x10)
 
+/// Max number of internal AT commands running at the same time, each has a port
+#define VE_AT_CONTEXTS		4
+
+#define ve_atIsVictronPort(_p)	((_p) >= ADL_PORT_VICTRON && (_p) < ADL_PORT_VICTRON + VE_AT_CONTEXTS)
+
 // free response
 #define ve_atSendResponsePort(_t,_p,_r) ve_atSendResponse(ADL_AT_PORT_TYPE(_p,_t),_r)
 s32 	ve_atSendResponse(u16 Type, char const *Text);
+s32 	ve_atSendResponseExt(u16 Type, char const *Text, veBool dispatch);
 
 // standard response
 #define ve_atSendStdResponsePort(_t,_p,_r) ve_atSendStdResponse(ADL_AT_PORT_TYPE(_p,_t),_r)
 s32 	ve_atSendStdResponse(u16 Type, adl_strID_e RspID);
 
 s8 		ve_atCmdSendExt(char *atstr, adl_atPort_e port, u16 NI, void* Contxt, adl_atRspHandler_t rsphdl);
+
+// receives the response lines of a command, without copying them
+typedef void (*ve_atRspSink_t)(char const *line, veBool terminal, void* ctx);
+
+s8		ve_atCmdSendSink(char *atstr, adl_atPort_e port, u16 NI, void* Contxt, ve_atRspSink_t sink);
+
+// handlers finishing a command later, the port and a sequence number
+typedef u16 VeAtPending;
+
+VeAtPending	ve_atDefer(adl_atCmdPreParser_t *paras, u16 timeout);
+adl_port_e	ve_atPendingPort(VeAtPending pending);
 s16 	ve_atCmdSubscribe(char const *Cmdstr, adl_atCmdHandler_t Cmdhdl, u16 Cmdopt);
+// use instead of ADL_GET_PARAM, local commands have no ParaList
+char const *ve_atParam(adl_atCmdPreParser_t const *paras, u8 n);
 s8 		ve_atCmdCreate(char *atstr, u16 rspflag, adl_atRspHandler_t rsphdl);
 
+// unsolicited output, of the modem and local
+typedef void (*ve_atUnsoHandler_t)(char const *line, void* ctx);
+
+typedef struct VeAtUnsoS
+{
+	char const *prefix;			///< e.g. "+CREG", matched ignoring case
+	ve_atUnsoHandler_t handler;
+	void *ctx;
+	struct VeAtUnsoS *next;
+} VeAtUnso;
+
+s16		ve_atUnsoSubscribe(VeAtUnso *unso, char const *prefix, ve_atUnsoHandler_t handler, void *ctx);
+void	ve_atUnsoUnSubscribe(VeAtUnso *unso);
+void	ve_atUnsoDispatch(char const *line);
+
 // testing
 adl_atResponse_t* ve_atAllocAtResponse(char const *str, veBool addCrLf, u16 Type);
 
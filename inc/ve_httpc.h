@@ -40,6 +40,7 @@ typedef enum {
 	RET_RSP_TOO_LONG = -9994,
 	RET_NOT_IMPLEMENTED = -9993,
 	RET_TIMEOUT = -9992,
+	RET_ABORTED = -9991,
 
 	/* HTTP payload errors */
 	RET_DATA_PARSE_ERROR = -9000,
@@ -116,6 +117,7 @@ struct VHttpc
 	char* tx_ptr;
 	int tx_bytes;
 	VHttpcState state;
+	veBool preconnect;			/* socket opened without a request */
 	struct VeTimer tmr;
 };
 
@@ -136,15 +138,18 @@ struct VHttpcRequest
 
 void vhttpc_init(struct VHttpc* httpc, char const* host, u16 port);
 void vhttpc_deinit(struct VHttpc* httpc);
+void vhttpc_connect(struct VHttpc* httpc);
 
 void vhttpc_req_init(struct VHttpc* httpc, struct VHttpcRequest* req, u16 length, u16 step);
 void vhttpc_req_set(struct VHttpcRequest* req, const char* request_line);
 void vhttpc_req_add(struct VHttpcRequest* req, const char* header);
 void vhttpc_req_host(struct VHttpcRequest* req);
 void vhttpc_req_keepalive_timeout(struct VHttpcRequest* req, s32 sec, s32 margin);
+void vhttpc_req_setHttpc(struct VHttpcRequest* req, struct VHttpc* httpc);
 
 /* possible actions on error */
 void vhttpc_req_retry(struct VHttpcRequest* req, u32 sec);
+void vhttpc_req_abort(struct VHttpcRequest* req);
 
 /* must be called from REG_DONE */
 void vhttpc_req_deinit(struct VHttpcRequest* req);
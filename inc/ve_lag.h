@@ -0,0 +1,68 @@
+#ifndef _VE_LAG_H_
+#define _VE_LAG_H_
+
+/*
+ * Copyright (c) 2012 All rights reserved.
+ * Jeroen Hofstee, Victron Energy, jhofstee@victronenergy.com.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#include <types.h>
+
+/*
+ * Bucket n of a histogram counts the durations from 2^(n-1) up to 2^n ms,
+ * bucket 0 those below a ms and the last one all longer ones. They are
+ * measured with ve_timer_now_ms, which follows the RTC on the device, so it
+ * also advances while a handler blocks the application.
+ */
+#define VE_LAG_BUCKETS		12
+
+/* what is measured */
+#define VE_LAGS									\
+	X(TIMER,		"timer")	/* ms timers expired late */			\
+	X(TIMER_CB,		"timer_cb")	/* ms a timer callback took */		\
+	X(SOCKET,		"socket")	/* ms handling a socket event took */	\
+	X(AT,			"at")		/* ms a local AT handler took */		\
+	X(TRACE,		"trace")	/* ms sending a trace took */
+
+typedef enum {
+#define X(_kind, _name) VE_LAG_ ## _kind,
+	VE_LAGS
+#undef X
+	VE_LAG_COUNT
+} VeLagKind;
+
+struct VeLagHist
+{
+	u32 count;
+	u32 max;					/* ms */
+	u32 buckets[VE_LAG_BUCKETS];
+};
+
+void ve_lagAdd(VeLagKind kind, u32 ms);
+struct VeLagHist const* ve_lagHist(VeLagKind kind);
+char const* ve_lagName(VeLagKind kind);
+void ve_lagReset(void);
+void ve_lagTrace(void);
+
+#endif
@@ -27,21 +27,46 @@
  * DAMAGE.
  */
 
+/* resolution of the timers */
+#if defined(__OAT_API_VERSION__)
+#define VE_TIMER_TICK_MS	100
+#else
+#define VE_TIMER_TICK_MS	10
+#endif
+
+/* no timer is armed, see ve_timer_next_deadline */
+#define VE_TIMER_NONE		0xFFFFFFFF
+
 typedef void (*VeTimerCallback)(void *ctx);
 
 struct VeTimer
 {
-	u32 value;
+	u32 value;					/* tick it expires */
 	VeTimerCallback cb;
 	void *ctx;
 	struct VeTimer *next;
+	struct VeTimer **pprev;		/* link to it, NULL when not queued */
 };
 
 void ve_timer(struct VeTimer* tmr, u32 sec, VeTimerCallback cb, void *ctx);
+void ve_timer_ms(struct VeTimer* tmr, u32 ms, VeTimerCallback cb, void *ctx);
+void ve_timer_slack(struct VeTimer* tmr, u32 ms, u32 slack, VeTimerCallback cb, void *ctx);
 void ve_timer_cancel(struct VeTimer* tmr);
+u32 ve_timer_next_deadline(void);
+
+struct VeTimerStats
+{
+	u32 wakeups;				/* times the application was woken for them */
+	u32 fired;					/* timers which expired */
+	u32 coalesced;				/* timers armed to expire with another one */
+};
+
+void ve_timer_stats(struct VeTimerStats* out, veBool reset);
 
 void ve_timer_init(void);
 void ve_timer_tick(void);
 void ve_timer_update(void);
+u32 ve_timer_uptime(void);
+u32 ve_timer_now_ms(void);
 
 #endif
@@ -63,6 +63,8 @@ void ve_traceDisableErrors(void);
 void ve_tracesEnable(void);
 void ve_tracesDisable(void);
 veBool ve_traceLevelsStore(void);
+void ve_traceUnsoDisable(VeModule module);
+void ve_traceUnsoEnable(VeModule module);
 
 veBool ve_traceEnabledExt(VeModule module, u32 level);
 #define ve_traceEnabled(level) ve_traceEnabledExt(VE_MOD, level)
@@ -74,7 +74,7 @@ long at_vGetLong(adl_atCmdPreParser_t* paras, int n)
 		return -1;
 
 	// check arguments
-	command = strtol(ADL_GET_PARAM(paras, n), &p, 0);
+	command = strtol(ve_atParam(paras, n), &p, 0);
 	if (*p)
 		return -1;
 
@@ -103,7 +103,7 @@ void at_vIndHandler(adl_atCmdPreParser_t* paras)
 		return;
 	}
 
-	command = strtol(ADL_GET_PARAM(paras, 0), &p, 0);
+	command = strtol(ve_atParam(paras, 0), &p, 0);
 	if (*p)
 	{
 		at_vErrorTxt("\"Command must be numeric\"");
@@ -121,7 +121,7 @@ void at_vIndHandler(adl_atCmdPreParser_t* paras)
 	// get the module
 	if (paras->NbPara >= 2)
 	{
-		module = ADL_GET_PARAM(paras, 1);
+		module = ve_atParam(paras, 1);
 		moduleId = ve_traceModuleByName(module);
 		if (moduleId == VE_MOD_NONE)
 		{
@@ -133,10 +133,10 @@ void at_vIndHandler(adl_atCmdPreParser_t* paras)
 	// from
 	if (paras->NbPara >= 3)
 	{
-		from = strtol(ADL_GET_PARAM(paras, 2), &p, 0);
+		from = strtol(ve_atParam(paras, 2), &p, 0);
 		if (*p != 0 || from < 0 || from > 31 )
 		{
-			at_vErrorTxt("\"from invalid: '%s'\"", ADL_GET_PARAM(paras, 2));
+			at_vErrorTxt("\"from invalid: '%s'\"", ve_atParam(paras, 2));
 			return;
 		}
 	}
@@ -144,10 +144,10 @@ void at_vIndHandler(adl_atCmdPreParser_t* paras)
 	// till
 	if (paras->NbPara >= 4)
 	{
-		till = strtol(ADL_GET_PARAM(paras, 3), &p, 0);
+		till = strtol(ve_atParam(paras, 3), &p, 0);
 		if (*p != 0 || till < 0 || till > 31 )
 		{
-			at_vErrorTxt("\"till invalid: '%s'\"", ADL_GET_PARAM(paras, 3));
+			at_vErrorTxt("\"till invalid: '%s'\"", ve_atParam(paras, 3));
 			return;
 		}
 	}
@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2012 All rights reserved.
+ * Jeroen Hofstee, Victron Energy, jhofstee@victronenergy.com.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#include "platform.h"
+#define VE_MOD VE_MOD_ATV
+#define AT_VSTR "VLAG"
+#include "at_v.h"
+#include "ve_lag.h"
+
+/**
+ * @addtogroup atvDoc
+ * @subsection VLAG AT+VLAG
+ * @par Description:
+ * 	Shows how late timers expired and how long callbacks blocked the event
+ * 	loop, one line per kind:
+ * 	<tt>+VLAG: "kind",count,max,b0,...,b11</tt>, where bucket n counts the
+ * 	times below 2^n ms and the last one the longer ones. Callbacks taking
+ * 	register lag.warn ms or longer are warned about, 0 disables that.
+ * @par Parameters:
+ * 	<tt>AT+VLAG=command</tt>\n\n
+ *	\c command
+ * 		- 0 - reset the histograms
+ * 		- 1	- trace the histograms
+ */
+static void at_vHandler(adl_atCmdPreParser_t* paras)
+{
+	struct VeLagHist const* hist;
+	Str str;
+	u8 kind;
+	u8 n;
+
+	if (paras->Type == ADL_CMD_TYPE_ACT)
+	{
+		str_new(&str, 128, 64);
+		for (kind = 0; kind < VE_LAG_COUNT; kind++)
+		{
+			hist = ve_lagHist((VeLagKind) kind);
+			str_set(&str, "");
+			for (n = 0; n < VE_LAG_BUCKETS; n++)
+				str_addf(&str, ",%u", hist->buckets[n]);
+			at_vInt("\"%s\",%u,%u%s", ve_lagName((VeLagKind) kind), hist->count,
+					hist->max, str_cstr(&str));
+		}
+		str_free(&str);
+		at_vOk();
+		return;
+	}
+
+	switch (at_vGetLong(paras, 0))
+	{
+	case 0:
+		ve_lagReset();
+		break;
+
+	case 1:
+		ve_lagTrace();
+		break;
+
+	default:
+		at_vError();
+		return;
+	}
+	at_vOk();
+}
+
+void at_vLagInit(void)
+{
+	ve_atCmdSubscribe(AT_VCMD, at_vHandler, ADL_CMD_TYPE_ACT | ADL_CMD_TYPE_PARA | 0x11);
+}
@@ -127,7 +127,7 @@ static void at_vregHandler(adl_atCmdPreParser_t* paras)
 	if(paras->Type == ADL_CMD_TYPE_PARA)
 	{
 		command = at_vGetLong(paras, 0);
-		fromId = dev_regIdFromString(ADL_GET_PARAM(paras, 1));
+		fromId = dev_regIdFromString(ve_atParam(paras, 1));
 	}
 	else
 		command = AT_VREG_VALUES;
@@ -152,7 +152,7 @@ static void at_vregHandler(adl_atCmdPreParser_t* paras)
 			if (command == AT_VREG_SET)
 				tillId = fromId;
 			else
-				tillId = dev_regIdFromString(ADL_GET_PARAM(paras, 2));
+				tillId = dev_regIdFromString(ve_atParam(paras, 2));
 			break;
 
 		default:
@@ -227,7 +227,7 @@ static void at_vregHandler(adl_atCmdPreParser_t* paras)
 			}
 
 			str_new(&str, 512, 512);
-			str_addUnescaped(&str, ADL_GET_PARAM(paras, 2));
+			str_addUnescaped(&str, ve_atParam(paras, 2));
 			if (str.error)
 			{
 				at_vError();
@@ -263,7 +263,7 @@ static void at_vregHandler(adl_atCmdPreParser_t* paras)
 			else if (paras->NbPara == 2)
 			{
 				// A group was specified, so list those registers.
-				group = dev_regGroupFromString(ADL_GET_PARAM(paras, 1));
+				group = dev_regGroupFromString(ve_atParam(paras, 1));
 				if (group == NULL)
 				{
 					at_vError();
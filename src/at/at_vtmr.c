@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2012 All rights reserved.
+ * Jeroen Hofstee, Victron Energy, jhofstee@victronenergy.com.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#include "platform.h"
+#define VE_MOD VE_MOD_ATV
+#define AT_VSTR "VTMR"
+#include "at_v.h"
+#include "ve_timer.h"
+
+/**
+ * @addtogroup atvDoc
+ * @subsection VTMR AT+VTMR
+ * @par Description:
+ * 	Shows how often the timers woke the application, see ve_timer_stats.
+ * 	<tt>+VTMR: wakeups,fired,coalesced</tt>, where fired - wakeups is the
+ * 	number of wakeups saved by timers expiring together. Every ADL timer
+ * 	callback counts as a wakeup, also one for a timer which was canceled.
+ * @par Parameters:
+ * 	<tt>AT+VTMR=command</tt>\n\n
+ *	\c command
+ * 		- 0 - show and reset the counters
+ */
+static void at_vHandler(adl_atCmdPreParser_t* paras)
+{
+	struct VeTimerStats stats;
+
+	if (paras->Type == ADL_CMD_TYPE_PARA && at_vGetLong(paras, 0) != 0)
+	{
+		at_vError();
+		return;
+	}
+
+	ve_timer_stats(&stats, paras->Type == ADL_CMD_TYPE_PARA);
+	at_vInt("%u,%u,%u", stats.wakeups, stats.fired, stats.coalesced);
+	at_vOk();
+}
+
+void at_vTmrInit(void)
+{
+	ve_atCmdSubscribe(AT_VCMD, at_vHandler, ADL_CMD_TYPE_ACT | ADL_CMD_TYPE_PARA | 0x11);
+}
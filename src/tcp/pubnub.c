@@ -27,106 +27,747 @@
 #define VE_MOD VE_MOD_PUBNUB
 
 #include <platform.h>
+#include <stdio.h>
 
 #include <pubnub.h>
-#include <yajl/yajl_parse.h>
 #include <ve_trace.h>
 
-static int json_string(void *ctx, const u8 *buf, size_t bufLen);
-static int json_start_array(void *ctx);
-static int json_end_array(void *ctx);
-
-static yajl_callbacks callbacks = {
-	NULL,
-	NULL,
-	NULL,
-	NULL,
-	NULL,
-	json_string,
-	NULL,
-	NULL,
-	NULL,
-	json_start_array,
-	json_end_array
-};
-
-static int json_string(void *ctx, const u8 *buf, size_t bufLen)
-{
-	struct PubnubRequest* req = (struct PubnubRequest*) ctx;
-
-	if (req->level > 1) {
+/* keep-alive asked for the subscribe and the margin on top of it, in s */
+#define SUB_KEEPALIVE			(3*60)
+#define SUB_KEEPALIVE_MARGIN	30
+
+/*
+ * The subscribe response looks like [[msg, msg, ...], "timetoken"]. Messages
+ * are at level 2. Strings are passed unescaped as NUB_DATA, other messages
+ * are passed as NUB_JSON, as received.
+ *
+ * When subscribed to multiple channels a third element follows with the
+ * channel of every message, [[msg, msg], "timetoken", "ch1,ch2"]. Since it
+ * comes last, the messages are then kept in msgs till the envelope is closed.
+ * Every message is stored as its NubEv, a 16 bit length and the data. With a
+ * single channel a message is passed on as soon as it is complete, so only
+ * one is kept at a time.
+ *
+ * The envelope is parsed by a small resumable tokenizer, so responses can be
+ * split over reads anywhere. It only decodes what is needed, allocates
+ * nothing itself and does not validate the messages beyond their nesting.
+ */
+#define MSG_LEVEL		2
+#define MSG_HDR			3
+#define MSGS_MAX		0x8000	/* collected messages, a larger one is dropped */
+#define TOK_MAX_LEVEL	64
+
+/* elements of the subscribe envelope */
+#define ITEM_MSGS		0
+#define ITEM_TOKEN		1
+#define ITEM_CHANNELS	2
+
+typedef enum {
+	TOK_VALUE,		/* before, between or after values */
+	TOK_STRING,
+	TOK_ESCAPE,		/* after a backslash */
+	TOK_UNICODE,	/* in \uXXXX */
+	TOK_LITERAL,	/* number, true, false or null */
+	TOK_DONE,		/* the envelope is closed */
+	TOK_ERROR
+} TokState;
+
+typedef enum {
+	OUT_NONE,
+	OUT_MSG,		/* a message, to msgs */
+	OUT_TOKEN,		/* the time token */
+	OUT_CHANNELS	/* the channel list, to msgs after the messages */
+} TokOut;
+
+/*
+ * Find the channel the n-th message was published on. Without a channel list
+ * there is only one channel. NULL is returned for unknown channels.
+ */
+static struct PubnubChannel* channel_lookup(struct PubnubRequest* req, int n, veBool* known)
+{
+	struct PubnubChannel* ch;
+	char const* name;
+	char const* end;
+	char const* comma;
+	size_t len;
+
+	*known = veTrue;
+	if (req->chanPos == 0) {
+		ch = req->nub->channels;
+		return ch && !ch->next ? ch : NULL;
+	}
+
+	name = str_cstr(&req->msgs) + req->chanPos;
+	end = str_cstr(&req->msgs) + str_len(&req->msgs);
+	while (n-- > 0) {
+		comma = (char const*) memchr(name, ',', end - name);
+		if (!comma)
+			break;
+		name = comma + 1;
+	}
+	comma = (char const*) memchr(name, ',', end - name);
+	len = (comma ? comma : end) - name;
+
+	for (ch = req->nub->channels; ch; ch = ch->next)
+		if (strlen(ch->name) == len && memcmp(ch->name, name, len) == 0)
+			return ch;
+
+	*known = veFalse;
+	return NULL;
+}
+
+/* pass the collected messages to the handler of their channel */
+static void msg_dispatch(struct PubnubRequest* req)
+{
+	struct PubnubChannel* ch;
+	char const* p;
+	char const* end;
+	size_t len;
+	veBool known;
+	int n = 0;
+
+	if (req->msgs.error) {
+		ve_error("messages lost, out of memory");
 		if (req->callback)
-			req->callback(req, NUB_DATA, (char*) buf, bufLen, req->nub->ctx);
-		return 1;
+			req->callback(req, NUB_ERROR, NULL, 0, req->nub->ctx);
+		return;
+	}
+
+	p = str_cstr(&req->msgs);
+	end = p + (req->chanPos ? req->chanPos : str_len(&req->msgs));
+	while (p + MSG_HDR <= end) {
+		NubEv ev = (NubEv) p[0];
+		len = ((u8) p[1] << 8) | (u8) p[2];
+		p += MSG_HDR;
+
+		ch = channel_lookup(req, n++, &known);
+		if (ev == NUB_ERROR) {
+			ve_error("message dropped, too long");
+			if (req->callback)
+				req->callback(req, NUB_ERROR, NULL, 0, req->nub->ctx);
+		} else if (ch && ch->callback)
+			ch->callback(req, ev, p, (int) len, ch->ctx);
+		else if (known && req->callback)
+			req->callback(req, ev, p, (int) len, req->nub->ctx);
+		else
+			ve_qtrace("message for unsubscribed channel dropped");
+		p += len;
+	}
+
+	str_set(&req->msgs, "");
+	req->chanPos = 0;
+}
+
+/* the poll ended by a response */
+static void poll_done(struct PubnubRequest* req)
+{
+	struct Pubnub* nub = req->nub;
+
+	if (!req->isSubscribe || !nub->nat)
+		return;
+
+	ve_timer_cancel(&nub->pollTmr);
+	nub->probing = veFalse;
+	pubnub_natPollDone(nub->nat, nub->timeToken, req->msgCount != 0);
+}
+
+/* the poll ended without a response */
+static void poll_abort(struct PubnubRequest* req)
+{
+	struct Pubnub* nub = req->nub;
+
+	if (!req->isSubscribe || !nub->nat)
+		return;
+
+	ve_timer_cancel(&nub->pollTmr);
+	nub->probing = veFalse;
+	pubnub_natPollAbort(nub->nat);
+}
+
+/* end the subscribe and send it again right away */
+static void poll_restart(struct Pubnub* nub)
+{
+	nub->reconnect = veTrue;
+	vhttpc_req_abort(&nub->subReq->req);
+}
+
+/* reconnect before the connection is likely dropped by a NAT router */
+static void poll_expired(void *ctx)
+{
+	struct Pubnub* nub = (struct Pubnub*) ctx;
+
+	ve_qtrace("poll limit reached, reconnecting");
+	poll_abort(nub->subReq);
+	poll_restart(nub);
+}
+
+/* the probe did not come back, so the connection is gone already */
+static void probe_lost(void *ctx)
+{
+	struct Pubnub* nub = (struct Pubnub*) ctx;
+
+	ve_qtrace("probe not received, reconnecting");
+	nub->probing = veFalse;
+	pubnub_natProbeLost(nub->nat);
+	poll_abort(nub->subReq);
+	poll_restart(nub);
+}
+
+static void probe_published(struct PubnubRequest* req, NubEv ev,
+									char const* buf, int buf_len, void *ctx)
+{
+	struct Pubnub* nub = req->nub;
+
+	if (ev != NUB_DONE)
+		return;
+	nub->probeQueued = veFalse;
+	if (!nub->probing)
+		return;
+
+	/* without the publish there is nothing to wait for */
+	if (!req->complete) {
+		ve_qtrace("probe not published");
+		poll_expired(nub);
+		return;
+	}
+
+	ve_timer(&nub->pollTmr, PUBNUB_NAT_QUICK, probe_lost, nub);
+}
+
+/* publish to ourselves, it must end the poll if the connection is alive */
+static void probe_send(void *ctx)
+{
+	struct Pubnub* nub = (struct Pubnub*) ctx;
+	char msg[12];
+
+	sprintf(msg, "%u", (unsigned) ve_timer_uptime());
+	if (pubnub_publishTo(nub->probeReq, nub->probeChannel.name, msg, probe_published) != RET_OK) {
+		poll_expired(nub);
+		return;
+	}
+	nub->probeQueued = veTrue;
+}
+
+/* the probe came back, poll_done already took the evidence */
+static void probe_received(struct PubnubRequest* req, NubEv ev,
+									char const* buf, int buf_len, void *ctx)
+{
+	ve_qtracen("probe back: ", buf, buf_len);
+}
+
+static void poll_start(struct PubnubRequest* req)
+{
+	struct Pubnub* nub = req->nub;
+	u16 probe = 0;
+
+	if (!req->isSubscribe)
+		return;
+
+	nub->pollLimit = 0;
+	nub->reconnect = veFalse;
+	if (!nub->nat)
+		return;
+
+	pubnub_natPollStart(nub->nat, nub->timeToken);
+	nub->pollLimit = pubnub_natTimeout(nub->nat);
+
+	/* a probe still being published is of no use anymore */
+	if (nub->probeReq && !nub->probeQueued)
+		probe = pubnub_natProbe(nub->nat);
+
+	if (probe) {
+		nub->probing = veTrue;
+		nub->pollLimit = probe + PUBNUB_NAT_QUICK;
+		ve_timer(&nub->pollTmr, probe, probe_send, nub);
+	} else if (nub->pollLimit) {
+		ve_timer(&nub->pollTmr, nub->pollLimit, poll_expired, nub);
+	}
+}
+
+
+static void tok_emit(struct PubnubRequest* req, char const* buf, size_t len)
+{
+	switch (req->out)
+	{
+	case OUT_MSG:
+		if (req->msgDropped)
+			break;
+		/* only the header is kept, msg_end marks it as dropped */
+		if (str_len(&req->msgs) + len > MSGS_MAX) {
+			req->msgDropped = veTrue;
+			if (!req->msgs.error) {
+				req->msgs.str_len = req->msgPos + MSG_HDR;
+				req->msgs.data[req->msgs.str_len] = 0;
+			}
+			break;
+		}
+		str_addn(&req->msgs, buf, len);
+		break;
+
+	case OUT_CHANNELS:
+		str_addn(&req->msgs, buf, len);
+		break;
+
+	case OUT_TOKEN:
+		if (req->tokenLen + len >= sizeof(req->token)) {
+			req->tokState = TOK_ERROR;
+			return;
+		}
+		memcpy(&req->token[req->tokenLen], buf, len);
+		req->tokenLen += (u8) len;
+		break;
+
+	default:
+		break;
+	}
+}
+
+/* as utf-8 */
+static void tok_emit_ucs(struct PubnubRequest* req, u32 code)
+{
+	char buf[4];
+	size_t n;
+
+	if (code < 0x80) {
+		buf[0] = (char) code;
+		n = 1;
+	} else if (code < 0x800) {
+		buf[0] = (char) (0xC0 | (code >> 6));
+		buf[1] = (char) (0x80 | (code & 0x3F));
+		n = 2;
+	} else if (code < 0x10000) {
+		buf[0] = (char) (0xE0 | (code >> 12));
+		buf[1] = (char) (0x80 | ((code >> 6) & 0x3F));
+		buf[2] = (char) (0x80 | (code & 0x3F));
+		n = 3;
+	} else {
+		buf[0] = (char) (0xF0 | (code >> 18));
+		buf[1] = (char) (0x80 | ((code >> 12) & 0x3F));
+		buf[2] = (char) (0x80 | ((code >> 6) & 0x3F));
+		buf[3] = (char) (0x80 | (code & 0x3F));
+		n = 4;
+	}
+	tok_emit(req, buf, n);
+}
+
+/* the length is filled in by msg_end */
+static void msg_begin(struct PubnubRequest* req, NubEv ev)
+{
+	char hdr[MSG_HDR];
+
+	hdr[0] = (char) ev;
+	hdr[1] = hdr[2] = 0;
+	req->msgPos = str_len(&req->msgs);
+	req->msgCount++;
+	req->msgDropped = veFalse;
+	str_addn(&req->msgs, hdr, MSG_HDR);
+}
+
+/*
+ * A message too long to keep is passed on as NUB_ERROR, the rest of the
+ * response is still parsed so the time token moves past it.
+ */
+static void msg_end(struct PubnubRequest* req)
+{
+	size_t len;
+
+	/* reported when dispatched */
+	if (req->msgs.error)
+		return;
+
+	if (req->msgDropped)
+		req->msgs.data[req->msgPos] = (char) NUB_ERROR;
+
+	/* fits the 16 bit length, msgs stays below MSGS_MAX */
+	len = str_len(&req->msgs) - req->msgPos - MSG_HDR;
+	req->msgs.data[req->msgPos + 1] = (char) (len >> 8);
+	req->msgs.data[req->msgPos + 2] = (char) len;
+
+	/* without a channel list to wait for */
+	if (!req->chanList)
+		msg_dispatch(req);
+}
+
+/* a value starts, decide where it goes to */
+static void value_begin(struct PubnubRequest* req, NubEv ev)
+{
+	/* part of a message */
+	if (req->level > MSG_LEVEL)
+		return;
+
+	req->out = OUT_NONE;
+
+	/* publish responses, [1,"Sent","timetoken"], do not resume subscribe */
+	if (!req->isSubscribe)
+		return;
+
+	if (req->level == MSG_LEVEL) {
+		if (req->item == ITEM_MSGS) {
+			msg_begin(req, ev);
+			req->out = OUT_MSG;
+		}
+	} else if (req->item == ITEM_TOKEN) {
+		req->tokenLen = 0;
+		req->out = OUT_TOKEN;
+	} else if (req->item == ITEM_CHANNELS && str_len(&req->msgs)) {
+		req->chanPos = str_len(&req->msgs);
+		req->out = OUT_CHANNELS;
+	}
+}
+
+static veBool value_end(struct PubnubRequest* req)
+{
+	struct Pubnub* nub = req->nub;
+
+	if (req->level > MSG_LEVEL)
+		return veTrue;
+
+	switch (req->out)
+	{
+	case OUT_MSG:
+		msg_end(req);
+		break;
+
+	case OUT_TOKEN:
+		memcpy(nub->timeToken, req->token, req->tokenLen);
+		nub->timeToken[req->tokenLen] = 0;
+		ve_qtrace("token is %s", nub->timeToken);
+		break;
+
+	default:
+		break;
+	}
+
+	req->out = OUT_NONE;
+	if (req->level == 1)
+		req->item++;
+	return veTrue;
+}
+
+static void envelope_done(struct PubnubRequest* req)
+{
+	req->tokState = TOK_DONE;
+	req->complete = veTrue;
+	poll_done(req);
+	msg_dispatch(req);
+}
+
+static veBool tok_value(struct PubnubRequest* req, char c)
+{
+	switch (c)
+	{
+	case ' ':
+	case '\t':
+	case '\r':
+	case '\n':
+		return veTrue;
+
+	case ',':
+	case ':':
+		if (req->level > MSG_LEVEL)
+			tok_emit(req, &c, 1);
+		return veTrue;
+
+	case '[':
+	case '{':
+		if (req->level == 0 && c != '[')
+			return veFalse;
+		if (req->level == TOK_MAX_LEVEL)
+			return veFalse;
+		if (req->level)
+			value_begin(req, NUB_JSON);
+		if (req->level >= MSG_LEVEL)
+			tok_emit(req, &c, 1);
+		req->level++;
+		return veTrue;
+
+	case ']':
+	case '}':
+		if (req->level == 0)
+			return veFalse;
+		if (req->level > MSG_LEVEL)
+			tok_emit(req, &c, 1);
+		if (--req->level == 0) {
+			envelope_done(req);
+			return veTrue;
+		}
+		return value_end(req);
+
+	case '"':
+		if (req->level == 0)
+			return veFalse;
+		req->raw = req->level > MSG_LEVEL;
+		if (req->raw)
+			tok_emit(req, &c, 1);
+		else
+			value_begin(req, NUB_DATA);
+		req->surrogate = 0;
+		req->tokState = TOK_STRING;
+		return veTrue;
+
+	default:
+		if (req->level == 0)
+			return veFalse;
+		value_begin(req, NUB_JSON);
+		tok_emit(req, &c, 1);
+		req->tokState = TOK_LITERAL;
+		return veTrue;
+	}
+}
+
+/* copies the plain part of a string at once */
+static char const* tok_string(struct PubnubRequest* req, char const* p, char const* end)
+{
+	char const* run;
+
+	/* a high surrogate must be followed by a low one */
+	if (req->surrogate && *p != '\\') {
+		tok_emit_ucs(req, 0xFFFD);
+		req->surrogate = 0;
+	}
+
+	run = p;
+	while (p < end && *p != '"' && *p != '\\')
+		p++;
+	tok_emit(req, run, p - run);
+	/* an overlong token, not to be turned into a value again */
+	if (p == end || req->tokState == TOK_ERROR)
+		return p;
+
+	if (req->raw)
+		tok_emit(req, p, 1);
+
+	if (*p == '\\') {
+		req->tokState = TOK_ESCAPE;
+	} else {
+		req->tokState = TOK_VALUE;
+		if (!value_end(req))
+			req->tokState = TOK_ERROR;
+	}
+	return p + 1;
+}
+
+static void tok_escape(struct PubnubRequest* req, char c)
+{
+	char chr;
+
+	if (req->raw) {
+		tok_emit(req, &c, 1);
+		req->hexDigits = 0;
+		req->tokState = (c == 'u' ? TOK_UNICODE : TOK_STRING);
+		return;
+	}
+
+	if (req->surrogate && c != 'u') {
+		tok_emit_ucs(req, 0xFFFD);
+		req->surrogate = 0;
+	}
+
+	switch (c)
+	{
+	case 'b':	chr = '\b';	break;
+	case 'f':	chr = '\f';	break;
+	case 'n':	chr = '\n';	break;
+	case 'r':	chr = '\r';	break;
+	case 't':	chr = '\t';	break;
+	case '"':
+	case '\\':
+	case '/':	chr = c;	break;
+
+	case 'u':
+		req->hexDigits = 0;
+		req->ucs = 0;
+		req->tokState = TOK_UNICODE;
+		return;
+
+	default:
+		req->tokState = TOK_ERROR;
+		return;
+	}
+
+	/* before the emit, which can fail */
+	req->tokState = TOK_STRING;
+	tok_emit(req, &chr, 1);
+}
+
+static void tok_unicode(struct PubnubRequest* req, char c)
+{
+	u16 ucs;
+
+	if (!isxdigit((u8) c)) {
+		req->tokState = TOK_ERROR;
+		return;
 	}
 
-	if (bufLen >= sizeof(req->nub->timeToken))
-		return 0;
+	if (req->raw) {
+		tok_emit(req, &c, 1);
+		if (++req->hexDigits == 4)
+			req->tokState = TOK_STRING;
+		return;
+	}
+
+	req->ucs = (u16) ((req->ucs << 4) | (c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10));
+	if (++req->hexDigits < 4)
+		return;
+
+	req->tokState = TOK_STRING;
+	ucs = req->ucs;
+
+	if (ucs >= 0xD800 && ucs < 0xDC00) {
+		if (req->surrogate)
+			tok_emit_ucs(req, 0xFFFD);
+		req->surrogate = ucs;
+		return;
+	}
 
-	memcpy(req->nub->timeToken, buf, bufLen);
-	req->nub->timeToken[bufLen] = 0;
-	ve_qtrace("token is %s", req->nub->timeToken);
-	return 1;
+	if (ucs >= 0xDC00 && ucs < 0xE000) {
+		if (req->surrogate)
+			tok_emit_ucs(req, 0x10000 + ((u32) (req->surrogate - 0xD800) << 10) + (ucs - 0xDC00));
+		else
+			tok_emit_ucs(req, 0xFFFD);
+		req->surrogate = 0;
+		return;
+	}
+
+	/* a high surrogate without its low half */
+	if (req->surrogate) {
+		tok_emit_ucs(req, 0xFFFD);
+		req->surrogate = 0;
+	}
+	tok_emit_ucs(req, ucs);
 }
 
-static int json_start_array(void * ctx)
+static void tok_init(struct PubnubRequest* req)
 {
-	struct PubnubRequest* req = (struct PubnubRequest*) ctx;
-	req->level++;
-	return 1;
+	req->tokState = TOK_VALUE;
+	req->out = OUT_NONE;
+	req->level = 0;
+	req->item = 0;
+	req->surrogate = 0;
+}
+
+static int tok_parse(struct PubnubRequest* req, char const* buf, int len)
+{
+	char const* end = buf + len;
+	char c;
+
+	while (buf < end) {
+		c = *buf;
+
+		switch (req->tokState)
+		{
+		case TOK_VALUE:
+			buf++;
+			if (!tok_value(req, c))
+				req->tokState = TOK_ERROR;
+			break;
+
+		case TOK_STRING:
+			buf = tok_string(req, buf, end);
+			break;
+
+		case TOK_ESCAPE:
+			buf++;
+			tok_escape(req, c);
+			break;
+
+		case TOK_UNICODE:
+			buf++;
+			tok_unicode(req, c);
+			break;
+
+		case TOK_LITERAL:
+			if (isalnum((u8) c) || c == '.' || c == '+' || c == '-') {
+				tok_emit(req, &c, 1);
+				buf++;
+				break;
+			}
+			/* the literal ended, c is handled as a value again */
+			req->tokState = TOK_VALUE;
+			if (!value_end(req))
+				req->tokState = TOK_ERROR;
+			break;
+
+		case TOK_DONE:
+			buf++;
+			if (!isspace((u8) c))
+				req->tokState = TOK_ERROR;
+			break;
+
+		default:
+			break;
+		}
+
+		if (req->tokState == TOK_ERROR) {
+			ve_qtrace("JSON parse error");
+			return RET_DATA_PARSE_ERROR;
+		}
+	}
+
+	return RET_OK;
 }
 
-static int json_end_array(void * ctx)
+static void subscribe_url(struct PubnubRequest* nubreq);
+
+/* a subscribe ended by ourselves is send again without delay */
+static u32 reconnect_delay(struct PubnubRequest* nubreq, u32 sec)
 {
-	struct PubnubRequest* req = (struct PubnubRequest*) ctx;
-	req->level--;
-	return 1;
+	struct Pubnub* nub = nubreq->nub;
+
+	if (!nubreq->isSubscribe || !nub->reconnect)
+		return sec;
+
+	nub->reconnect = veFalse;
+	return 0;
 }
 
 static int json_parse(struct VHttpcRequest* req, ReqEvent ev, char const* buf, int buf_len)
 {
-	yajl_status stat;
 	struct PubnubRequest* nubreq = (struct PubnubRequest*) req->ctx;
 
 	switch(ev)
 	{
 	case REQ_BEING_SEND_AGAIN:
-		ve_qtrace("resend, cleaning up %p", req);
-		yajl_free(nubreq->yajl);
+		ve_qtrace("resend %p", req);
 		// fall through
 
 	case REQ_BEING_SEND:
 		ve_qtrace("sending request %p", req);
-		nubreq->yajl = yajl_alloc(&callbacks, NULL, nubreq);
-		if (!nubreq->yajl)
-			return RET_NO_MEM;
+		poll_start(nubreq);
+		/* the channels might have changed while waiting */
+		if (nubreq->isSubscribe)
+			subscribe_url(nubreq);
+		tok_init(nubreq);
+		nubreq->complete = veFalse;
+		nubreq->chanPos = 0;
+		nubreq->msgCount = 0;
+		nubreq->msgDropped = veFalse;
+		if (nubreq->msgs.error)
+			str_new(&nubreq->msgs, 256, 256);
+		else
+			str_set(&nubreq->msgs, "");
 		break;
 
 	case REQ_DATA:
 		ve_qtrace("parsing response %p", req);
-		if ( (stat = yajl_parse(nubreq->yajl, (u8 const*) buf, buf_len)) != yajl_status_ok ) {
-			ve_qtrace("JSON parse error");
-			return RET_DATA_PARSE_ERROR;
-		}
-
-		if ( (stat = yajl_complete_parse(nubreq->yajl)) != yajl_status_ok ) {
-			ve_qtrace("JSON parse error");
-			return RET_DATA_PARSE_ERROR;
-		}
-		break;
+		return tok_parse(nubreq, buf, buf_len);
 
 	case REQ_TCP_PEER_CLOSE:
-		vhttpc_req_retry(req, 1);
+		poll_abort(nubreq);
+		vhttpc_req_retry(req, reconnect_delay(nubreq, 1));
 		break;
 
 	case REQ_TCP_ERROR:
-		vhttpc_req_retry(req, 15);
+		poll_abort(nubreq);
+		vhttpc_req_retry(req, reconnect_delay(nubreq, 15));
 		break;
 
 	case REQ_DONE:
 		ve_qtrace("end of request %p", req);
-		yajl_free(nubreq->yajl);
-		nubreq->yajl = NULL;
+		if (!nubreq->complete)
+			ve_qtrace("incomplete response");
+		if (nubreq->isSubscribe)
+			nubreq->nub->subQueued = veFalse;
 		if (nubreq->callback)
 			nubreq->callback(nubreq, NUB_DONE, NULL, 0, nubreq->nub->ctx);
 		break;
@@ -141,8 +782,22 @@ static int json_parse(struct VHttpcRequest* req, ReqEvent ev, char const* buf, i
 int pubnub_init(struct Pubnub* nub, char const* channel, const char* publishKey,
 	const char* subscribeKey, const char* secretKey, const char* host, u16 port, void *ctx)
 {
-	vhttpc_init(&nub->httpc, host, port);
-	nub->channel = channel;
+	if (!nub->preconnected) {
+		vhttpc_init(&nub->httpc, host, port);
+		vhttpc_init(&nub->pubHttpc, host, port);
+	}
+	nub->preconnected = veFalse;
+	nub->channels = NULL;
+	nub->subReq = NULL;
+	nub->subQueued = veFalse;
+	nub->nat = NULL;
+	nub->pollLimit = 0;
+	nub->reconnect = veFalse;
+	nub->probeReq = NULL;
+	nub->probing = veFalse;
+	nub->probeQueued = veFalse;
+	pubnub_channelAdd(nub, &nub->mainChannel, channel, NULL, NULL);
+	nub->pubChannel = channel;
 	nub->publishKey = publishKey;
 	nub->subscribeKey = subscribeKey;
 	nub->secretKey = secretKey;
@@ -153,18 +808,124 @@ int pubnub_init(struct Pubnub* nub, char const* channel, const char* publishKey,
 
 void pubnub_deinit(struct Pubnub* nub)
 {
+	ve_timer_cancel(&nub->pollTmr);
 	vhttpc_deinit(&nub->httpc);
+	vhttpc_deinit(&nub->pubHttpc);
+}
+
+/* publish to a different channel then the one subscribed to */
+void pubnub_setPublishChannel(struct Pubnub* nub, char const* channel)
+{
+	nub->pubChannel = channel;
+}
+
+/* resume from an earlier time token, e.g. one saved before a restart */
+void pubnub_setTimeToken(struct Pubnub* nub, char const* timeToken)
+{
+	char const* p = timeToken;
+
+	if (!p || !*p || strlen(p) >= sizeof(nub->timeToken))
+		return;
+
+	while (*p)
+		if (!isdigit((u8) *p++))
+			return;
+
+	strcpy(nub->timeToken, timeToken);
+	ve_qtrace("resuming from token %s", nub->timeToken);
+}
+
+/*
+ * Learn how long the subscribe can wait on this network. When probeReq is
+ * given, an initialised request not used otherwise, the limit is probed by
+ * publishing to probeChannel, which is subscribed to for that. Without it
+ * only traffic of the application tells.
+ */
+void pubnub_setNat(struct Pubnub* nub, struct PubnubNat* nat,
+					struct PubnubRequest* probeReq, char const* probeChannel)
+{
+	nub->nat = nat;
+	nub->probeReq = (probeChannel ? probeReq : NULL);
+	if (nub->probeReq)
+		pubnub_channelAdd(nub, &nub->probeChannel, probeChannel, probe_received, nub);
+}
+
+/*
+ * Look up the host and open both connections before pubnub_init, e.g. as
+ * soon as the bearer is up, so that is done while the rest is set up. The
+ * Pubnub must be zeroed before, as static ones are, and pubnub_init must be
+ * passed the same host.
+ */
+void pubnub_connect(struct Pubnub* nub, char const* host, u16 port)
+{
+	vhttpc_init(&nub->httpc, host, port);
+	vhttpc_init(&nub->pubHttpc, host, port);
+	vhttpc_connect(&nub->httpc);
+	vhttpc_connect(&nub->pubHttpc);
+	nub->preconnected = veTrue;
+}
+
+/*
+ * Restart a pending subscribe so it listens to the current channels. Once
+ * its response is parsed the next subscribe will pick them up anyway.
+ */
+static void pubnub_resubscribe(struct Pubnub* nub)
+{
+	if (nub->subReq && nub->subQueued && !nub->subReq->complete) {
+		poll_abort(nub->subReq);
+		poll_restart(nub);
+	}
+}
+
+/*
+ * Subscribe to an additional channel, messages on it are passed to callback.
+ * A subscribe in progress is restarted with the same time token, so no
+ * messages are lost on the other channels.
+ */
+void pubnub_channelAdd(struct Pubnub* nub, struct PubnubChannel* ch, char const* name,
+						pubnub_req_callback callback, void *ctx)
+{
+	ch->name = name;
+	ch->callback = callback;
+	ch->ctx = ctx;
+	ch->next = nub->channels;
+	nub->channels = ch;
+	pubnub_resubscribe(nub);
+}
+
+/* @note at least one channel must remain subscribed */
+void pubnub_channelRemove(struct Pubnub* nub, struct PubnubChannel* ch)
+{
+	struct PubnubChannel** p = &nub->channels;
+
+	while (*p) {
+		if (*p == ch) {
+			*p = ch->next;
+			ch->next = NULL;
+			pubnub_resubscribe(nub);
+			return;
+		}
+		p = &(*p)->next;
+	}
 }
 
 void pubnub_req_init(struct Pubnub* nub, struct PubnubRequest* nubreq, u16 length, u16 step)
 {
-	nubreq->level = 0;
+	tok_init(nubreq);
+	nubreq->isSubscribe = veFalse;
+	nubreq->complete = veFalse;
+	nubreq->chanList = veFalse;
+	nubreq->chanPos = 0;
+	nubreq->msgCount = 0;
+	nubreq->msgDropped = veFalse;
 	nubreq->nub = nub;
+	str_new(&nubreq->msgs, 256, 256);
 	vhttpc_req_init(&nub->httpc, &nubreq->req, 2000, 200);
 }
 
 void pubnub_req_deinit(struct PubnubRequest* nubreq)
 {
+	str_free(&nubreq->msgs);
 	vhttpc_req_deinit(&nubreq->req); 	/* free memory associated with the request */
 }
 
@@ -175,38 +936,92 @@ static int pubnub_send(struct PubnubRequest* nubreq, pubnub_req_callback callbac
 	return vhttpc_add(&nubreq->req, json_parse);
 }
 
-// pubsub.pubnub.com/subscribe/sub-key/channel/callback/timetoken
-int pubnub_subscribe(struct PubnubRequest* nubreq, const char* timeToken, pubnub_req_callback callback)
+// pubsub.pubnub.com/subscribe/sub-key/channel,channel/callback/timetoken
+static void subscribe_url(struct PubnubRequest* nubreq)
 {
 	Str* s = &nubreq->req.data;
-	
+	struct PubnubChannel* ch;
+
 	str_set(s, "GET /subscribe/");
 	str_addUrlEnc(s, nubreq->nub->subscribeKey);
 	str_add(s, "/");
-	str_addUrlEnc(s, nubreq->nub->channel);
+	for (ch = nubreq->nub->channels; ch; ch = ch->next) {
+		str_addUrlEnc(s, ch->name);
+		if (ch->next)
+			str_addc(s, ',');
+	}
+	/* pubnub only names the channel of every message for more than one */
+	nubreq->chanList = (nubreq->nub->channels && nubreq->nub->channels->next);
 	str_add(s, "/0/"); // callback
-	str_addUrlEnc(s, timeToken);
+	str_addUrlEnc(s, nubreq->nub->timeToken);
 	str_add(s, " HTTP/1.1\r\n");
 	vhttpc_req_host(&nubreq->req); /* host header */
-	vhttpc_req_keepalive_timeout(&nubreq->req, 3*60, 30);
+	/* the server need not keep it longer than the poll is going to take */
+	if (nubreq->nub->pollLimit && nubreq->nub->pollLimit < SUB_KEEPALIVE)
+		vhttpc_req_keepalive_timeout(&nubreq->req, nubreq->nub->pollLimit, PUBNUB_NAT_QUICK);
+	else
+		vhttpc_req_keepalive_timeout(&nubreq->req, SUB_KEEPALIVE, SUB_KEEPALIVE_MARGIN);
 	str_add(s, "\r\n");
+}
+
+/* the url is build when the request is send, so with the current channels */
+int pubnub_subscribe(struct PubnubRequest* nubreq, const char* timeToken, pubnub_req_callback callback)
+{
+	struct Pubnub* nub = nubreq->nub;
+
+	if (timeToken != nub->timeToken) {
+		if (strlen(timeToken) >= sizeof(nub->timeToken))
+			return RET_DATA_PARSE_ERROR;
+		strcpy(nub->timeToken, timeToken);
+	}
+
+	nubreq->isSubscribe = veTrue;
+	vhttpc_req_setHttpc(&nubreq->req, &nub->httpc);
+	nub->subReq = nubreq;
+	nub->subQueued = veTrue;
+	str_set(&nubreq->req.data, "");
 
 	return pubnub_send(nubreq, callback);
 }
 
 // pubsub.pubnub.com/publish/pub-key/sub-key/signature/channel/callback/message
 int pubnub_publish(struct PubnubRequest* nubreq, const char* json, pubnub_req_callback callback)
+{
+	return pubnub_publishTo(nubreq, nubreq->nub->pubChannel, json, callback);
+}
+
+int pubnub_publishTo(struct PubnubRequest* nubreq, char const* channel, const char* json,
+						pubnub_req_callback callback)
+{
+	str_addUrlEnc(pubnub_publishBegin(nubreq, channel), json);
+	return pubnub_publishEnd(nubreq, callback);
+}
+
+/*
+ * Start a publish to channel, the message is to be added urlencoded to the
+ * returned request buffer, e.g. straight from where it is kept, and is sent
+ * by pubnub_publishEnd.
+ */
+Str* pubnub_publishBegin(struct PubnubRequest* nubreq, char const* channel)
 {
 	Str* s = &nubreq->req.data;
 
+	nubreq->isSubscribe = veFalse;
+	vhttpc_req_setHttpc(&nubreq->req, &nubreq->nub->pubHttpc);
 	str_set(s, "GET /publish/");
 	str_addUrlEnc(s, nubreq->nub->publishKey);
 	str_add(s, "/");
 	str_addUrlEnc(s, nubreq->nub->subscribeKey);
 	str_add(s, "/0/"); // signature
-	str_addUrlEnc(s, nubreq->nub->channel);
+	str_addUrlEnc(s, channel);
 	str_add(s, "/0/"); // callback
-	str_addUrlEnc(s, json);
+	return s;
+}
+
+int pubnub_publishEnd(struct PubnubRequest* nubreq, pubnub_req_callback callback)
+{
+	Str* s = &nubreq->req.data;
+
 	str_add(s, " HTTP/1.1\r\n");
 	vhttpc_req_host(&nubreq->req);
 	str_add(s, "\r\n");
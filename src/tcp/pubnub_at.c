@@ -27,39 +27,1243 @@
 #define VE_MOD	VE_MOD_PUBNUBAT
 
 #include <platform.h>
+#include <stdlib.h>
+
+#include <dev_reg_app.h>
 #include <pubnub_at.h>
 #include <ve_at.h>
 #include <ve_trace.h>
+#include <yajl/yajl_parse.h>
 
-static void publish_callback(struct PubnubRequest* req, NubEv ev,
-									char const* buf, int buf_len, void *ctx)
+/*
+ * The time token is kept in flash, so commands send while the device was off
+ * are received after a restart. Since it changes with every poll it is saved
+ * at most every TOKEN_SAVE_INTERVAL seconds, but within TOKEN_CMD_DELAY when
+ * commands were received, so they are not executed again after a restart. A
+ * burst of commands over several polls is still saved only once.
+ */
+#define TOKEN_SAVE_INTERVAL		(10*60)
+/* seconds saving it may wait for another timer */
+#define TOKEN_SAVE_SLACK		60
+#define TOKEN_CMD_DELAY			10
+#define TOKEN_CMD_SLACK			5
+
+/*
+ * Besides plain strings, messages can be objects. Commands look like
+ * {"cmd":"AT+VIND"}, responses of a device {"origin":"dev1","rsp":"OK"}.
+ * The origin is used to ignore the responses of this device itself when
+ * commands and responses share a channel.
+ *
+ * A command with an id, {"id":7,"cmd":"AT+VIND","timeout":5000}, is answered
+ * with a single reply {"id":7,"lines":["+VIND: 1"],"final":"OK",
+ * "elapsed_ms":120}, so it can be matched with the command. The timeout is
+ * in ms and optional, when it expires "final" is "TIMEOUT".
+ *
+ * A script runs several commands in one go, {"id":8,"script":["AT+VA",
+ * "AT+VB"],"mode":"continue"}, and is answered with {"id":8,"results":[
+ * {"cmd":"AT+VA","lines":[],"final":"OK"},..],"final":"OK","elapsed_ms":..}.
+ * The mode "stop", the default, ends the script at the first command which
+ * is not answered with OK, "continue" runs all of them. The final result is
+ * "ERROR" when any of the commands failed. The timeout covers the whole
+ * script.
+ *
+ * Commands polled over and over, {"id":9,"cmd":"AT+VLIST","delta":true}, can
+ * be answered with the changes since the previous reply to the same command
+ * only, {"id":9,"seq":6,"base":5,"diff":[3,-1,"+VLIST: 4,1",2],"final":"OK",..}.
+ * A number copies (> 0) or skips (< 0) that many lines of reply "base", a
+ * string is a new line, see pubnub_deltaApply. All lines are sent, with a seq
+ * but without base, when that is shorter, for the first reply and after
+ * PUBNUB_AT_KEYFRAME delta replies, so a receiver which missed one recovers.
+ *
+ * With "dict":1 the cmd or script of a message is coded with the dictionary
+ * of pubnub_dict.c, and so are the lines, or rsp, of its answer, which then
+ * also carries "dict":1. Messages without it are neither decoded nor coded,
+ * so peers which do not know the dictionary keep working.
+ */
+typedef enum {
+	MSG_KEY_NONE,
+	MSG_KEY_ORIGIN,
+	MSG_KEY_CMD,
+	MSG_KEY_RSP,
+	MSG_KEY_ID,
+	MSG_KEY_TIMEOUT,
+	MSG_KEY_SCRIPT,
+	MSG_KEY_MODE,
+	MSG_KEY_DELTA,
+	MSG_KEY_DICT,
+	MSG_KEY_FRAG,
+	MSG_KEY_SEQ,
+	MSG_KEY_OF,
+	MSG_KEY_DATA,
+	MSG_KEY_ACK,
+	MSG_KEY_TO,
+	MSG_KEY_NEXT,
+	MSG_KEY_SACK
+} MsgKey;
+
+struct AtMsg {
+	Str origin;
+	Str cmd;
+	Str id;
+	veBool idIsNumber;
+	u32 timeout;
+	Str script;					/* zero terminated commands */
+	u8 steps;
+	veBool stopOnError;
+	veBool delta;
+	u32 dict;					/* dictionary version, 0 if not coded */
+	veBool isFrag;				/* a fragment, see pubnub_frag.h */
+	u32 frag;
+	u32 seq;
+	u32 of;
+	Str data;
+	veBool isAck;				/* of fragments */
+	u32 ack;
+	Str to;
+	u32 next;
+	u16 sack[PUBNUB_FRAG_SACK];
+	u8 sackCount;
+	veBool isRsp;
+	MsgKey key;
+	int level;
+};
+
+static void cmd_next(struct PubnubAt* nubat);
+static void cmd_result(struct PubnubAt* nubat, char const* final);
+
+/* response lines are surrounded by line ends, drop them */
+static char const* line_trim(char const* line, size_t* len)
 {
-	struct PubnubAt* nubat = (struct PubnubAt*) ctx;
+	while (*line == '\r' || *line == '\n')
+		line++;
+	*len = strlen(line);
+	while (*len && (line[*len - 1] == '\r' || line[*len - 1] == '\n'))
+		(*len)--;
+	return line;
+}
 
-	switch (ev)
+static veBool gen_line(yajl_gen g, char const* line)
+{
+	size_t len;
+
+	line = line_trim(line, &len);
+	return yajl_gen_string(g, (u8 const*) line, len) == yajl_gen_status_ok;
+}
+
+static veBool rsp_is_ok(char const* line)
+{
+	size_t len;
+
+	line = line_trim(line, &len);
+	return len == 2 && strncmp(line, "OK", 2) == 0;
+}
+
+/* {"cmd":"<cmd>","lines":[ */
+static veBool step_begin(yajl_gen g, char const* cmd)
+{
+	return	yajl_gen_map_open(g) == yajl_gen_status_ok &&
+			yajl_gen_string(g, (u8*) "cmd", 3) == yajl_gen_status_ok &&
+			yajl_gen_string(g, (u8*) cmd, strlen(cmd)) == yajl_gen_status_ok &&
+			yajl_gen_string(g, (u8*) "lines", 5) == yajl_gen_status_ok &&
+			yajl_gen_array_open(g) == yajl_gen_status_ok;
+}
+
+/* ],"final":"<final>"} */
+static veBool step_end(yajl_gen g, char const* final)
+{
+	return	yajl_gen_array_close(g) == yajl_gen_status_ok &&
+			yajl_gen_string(g, (u8*) "final", 5) == yajl_gen_status_ok &&
+			gen_line(g, final) &&
+			yajl_gen_map_close(g) == yajl_gen_status_ok;
+}
+
+static void reply_print(void* ctx, char const* str, size_t len)
+{
+	str_addn((Str*) ctx, str, len);
+}
+
+/*
+ * {"origin":"<origin>","dict":1,"id":<id>, with out the reply is escaped
+ * straight into it, so it can be handed to the journal as is.
+ */
+static yajl_gen reply_open(struct PubnubAt* nubat, struct PubnubAtCmd const* cmd, Str* out)
+{
+	yajl_gen g = yajl_gen_alloc(NULL);
+	veBool ok;
+
+	if (!g)
+		return NULL;
+
+	if (out) {
+		str_new(out, 256, 256);
+		if (out->error) {
+			yajl_gen_free(g);
+			return NULL;
+		}
+		yajl_gen_config(g, yajl_gen_print_callback, reply_print, out);
+	}
+
+	ok = yajl_gen_map_open(g) == yajl_gen_status_ok;
+	if (ok && nubat->tagResponses)
+		ok =	yajl_gen_string(g, (u8*) "origin", 6) == yajl_gen_status_ok &&
+				yajl_gen_string(g, (u8*) nubat->origin, strlen(nubat->origin)) == yajl_gen_status_ok;
+	if (ok && cmd->dict)
+		ok =	yajl_gen_string(g, (u8*) "dict", 4) == yajl_gen_status_ok &&
+				yajl_gen_integer(g, PUBNUB_DICT_VERSION) == yajl_gen_status_ok;
+	if (ok && cmd->id) {
+		ok = yajl_gen_string(g, (u8*) "id", 2) == yajl_gen_status_ok;
+		if (ok && cmd->idIsNumber)
+			ok = yajl_gen_number(g, cmd->id, strlen(cmd->id)) == yajl_gen_status_ok;
+		else if (ok)
+			ok = yajl_gen_string(g, (u8*) cmd->id, strlen(cmd->id)) == yajl_gen_status_ok;
+	}
+
+	if (!ok) {
+		ve_error("json: could not start reply");
+		yajl_gen_free(g);
+		if (out)
+			str_free(out);
+		return NULL;
+	}
+	return g;
+}
+
+/* {"origin":"<origin>","id":<id>,"lines":[ or "results":[ for a script */
+static yajl_gen reply_begin(struct PubnubAt* nubat, struct PubnubAtCmd const* cmd, Str* out)
+{
+	yajl_gen g = reply_open(nubat, cmd, out);
+	veBool ok;
+
+	if (!g)
+		return NULL;
+
+	if (cmd->steps)
+		ok = yajl_gen_string(g, (u8*) "results", 7) == yajl_gen_status_ok;
+	else
+		ok = yajl_gen_string(g, (u8*) "lines", 5) == yajl_gen_status_ok;
+	ok = ok && yajl_gen_array_open(g) == yajl_gen_status_ok;
+
+	if (!ok) {
+		ve_error("json: could not start reply");
+		yajl_gen_free(g);
+		if (out)
+			str_free(out);
+		return NULL;
+	}
+	return g;
+}
+
+/*
+ * ],"final":"<final>","elapsed_ms":<ms>} and publish it, frees g and out.
+ * A reply in out is not copied again unless it needs fragments.
+ */
+static void reply_end(struct PubnubAt* nubat, yajl_gen g, Str* out, char const* final, u32 elapsed)
+{
+	u8 const *json;
+	size_t json_len;
+	veBool ok;
+
+	ok =	yajl_gen_array_close(g) == yajl_gen_status_ok &&
+			yajl_gen_string(g, (u8*) "final", 5) == yajl_gen_status_ok &&
+			gen_line(g, final) &&
+			yajl_gen_string(g, (u8*) "elapsed_ms", 10) == yajl_gen_status_ok &&
+			yajl_gen_integer(g, elapsed) == yajl_gen_status_ok &&
+			yajl_gen_map_close(g) == yajl_gen_status_ok;
+
+	if (out && ok && !out->error) {
+		if (str_len(out) > PUBNUB_JOURNAL_BATCH)
+			pubnub_atPublishJson(nubat, out->data, PUBNUB_AT_TTL);
+		else
+			pubnub_journalAddStr(&nubat->journal, out, PUBNUB_AT_TTL);
+	} else if (!out && ok && yajl_gen_get_buf(g, &json, &json_len) == yajl_gen_status_ok) {
+		pubnub_atPublishJson(nubat, (char const*) json, PUBNUB_AT_TTL);
+	} else {
+		ve_error("json: could not finish reply");
+	}
+
+	if (out)
+		str_free(out);
+	yajl_gen_free(g);
+}
+
+/*
+ * Answers to read only commands can be cached, so dashboards polling many
+ * devices do not keep the modems busy. pubnub.cache lists them with the
+ * number of seconds an answer stays valid, e.g. "10:AT+VIND;30:AT+VREG=1".
+ * Only OK answers are stored. A register change invalidates the cached
+ * AT+VREG answers, a change of pubnub.cache all of them. The registers the
+ * device keeps its own state in are written after most polls, they don't
+ * invalidate anything, else nothing would ever be answered from the cache.
+ */
+static u16 regChanges;
+static u16 cacheChanges;
+
+void pubnub_atRegChanged(DevRegId regId)
+{
+	switch (regId)
 	{
-	case NUB_DONE:
-		pubnub_req_deinit(req);			/* destruct the request data */
-		ve_free(req);					/* free the request itself */
-		pubnub_atSubscribe(nubat);		/* wait for commands when idle */
+	case DEV_REG_PUBNUB_CACHE:
+		cacheChanges++;
+		break;
+	case DEV_REG_PUBNUB_TOKEN:
+	case DEV_REG_PUBNUB_NAT:
 		break;
+	default:
+		regChanges++;
+	}
+}
+
+static void cache_clear(struct PubnubAt* nubat)
+{
+	struct PubnubAtCache* entry;
+
+	while (nubat->cacheCount) {
+		entry = &nubat->cache[--nubat->cacheCount];
+		ve_free(entry->cmd);
+		str_free(&entry->rsp);
+	}
+	nubat->recording = NULL;
+}
+
+static veBool cmd_readsRegs(char const* cmd)
+{
+	char const* vreg = "AT+VREG";
+
+	while (*vreg && toupper((u8) *cmd) == *vreg) {
+		cmd++;
+		vreg++;
+	}
+	return *vreg == 0;
+}
+
+/* "<ttl>:<cmd>;<ttl>:<cmd>.." */
+static void cache_load(struct PubnubAt* nubat, char const* config)
+{
+	struct PubnubAtCache* entry;
+	char const* end;
+	char* cmd;
+	size_t len;
+	u32 ttl;
+
+	cache_clear(nubat);
+	nubat->cacheConfig = cacheChanges;
+
+	while (config && *config) {
+		end = strchr(config, ';');
+		if (!end)
+			end = config + strlen(config);
+
+		ttl = strtoul(config, &cmd, 10);
+		if (*cmd != ':' || cmd >= end || ttl == 0 || ttl > 0xFFFF || cmd + 1 == end) {
+			ve_warning("pubnub.cache: ignoring invalid entry");
+		} else if (nubat->cacheCount == PUBNUB_AT_CACHE) {
+			ve_warning("pubnub.cache: too many entries");
+			break;
+		} else {
+			cmd++;
+			len = end - cmd;
+			entry = &nubat->cache[nubat->cacheCount];
+			entry->cmd = (char*) ve_malloc(len + 1);
+			if (!entry->cmd)
+				break;
+			memcpy(entry->cmd, cmd, len);
+			entry->cmd[len] = 0;
+			entry->ttl = (u16) ttl;
+			entry->readsRegs = cmd_readsRegs(entry->cmd);
+			entry->valid = veFalse;
+			entry->rsp.data = NULL;
+			entry->rsp.error = veTrue;
+			nubat->cacheCount++;
+		}
+
+		config = (*end ? end + 1 : end);
+	}
+}
+
+static struct PubnubAtCache* cache_find(struct PubnubAt* nubat, char const* cmd)
+{
+	u8 n;
 
+	if (nubat->cacheConfig != cacheChanges)
+		cache_load(nubat, dev_regs.pubnubCache);
+
+	for (n = 0; n < nubat->cacheCount; n++)
+		if (stricmp(nubat->cache[n].cmd, cmd) == 0)
+			return &nubat->cache[n];
+
+	return NULL;
+}
+
+static veBool cache_fresh(struct PubnubAtCache const* entry)
+{
+	return	entry->valid &&
+			ve_timer_uptime() - entry->stored < entry->ttl &&
+			!(entry->readsRegs && entry->regChanges != regChanges);
+}
+
+static void cache_record_start(struct PubnubAt* nubat, struct PubnubAtCache* entry)
+{
+	str_free(&entry->rsp);
+	str_new(&entry->rsp, 64, 64);
+	entry->valid = veFalse;
+	entry->stored = ve_timer_uptime();
+	entry->regChanges = regChanges;
+	nubat->recording = entry;
+}
+
+/* the lines are stored as received, so they can be answered again as is */
+static void cache_record(struct PubnubAt* nubat, char const* line, veBool terminal)
+{
+	struct PubnubAtCache* entry = nubat->recording;
+
+	str_addn(&entry->rsp, line, strlen(line) + 1);
+	if (terminal) {
+		entry->valid = !entry->rsp.error && rsp_is_ok(line);
+		nubat->recording = NULL;
+	}
+}
+
+/* "lines":[<lines> */
+static veBool gen_lines(yajl_gen g, Str const* lines)
+{
+	char const* line = lines->data;
+	char const* end = line + str_len(lines);
+	veBool ok;
+
+	ok =	yajl_gen_string(g, (u8*) "lines", 5) == yajl_gen_status_ok &&
+			yajl_gen_array_open(g) == yajl_gen_status_ok;
+	for (; ok && line < end; line += strlen(line) + 1)
+		ok = yajl_gen_string(g, (u8 const*) line, strlen(line)) == yajl_gen_status_ok;
+	return ok;
+}
+
+static void delta_clear(struct PubnubAt* nubat)
+{
+	struct PubnubAtDelta* entry;
+
+	while (nubat->deltaCount) {
+		entry = &nubat->delta[--nubat->deltaCount];
+		ve_free(entry->cmd);
+		str_free(&entry->lines);
+	}
+}
+
+/* the last reply to cmd, the least recently used one is replaced if needed */
+static struct PubnubAtDelta* delta_find(struct PubnubAt* nubat, char const* cmd)
+{
+	struct PubnubAtDelta* entry = NULL;
+	char* copy;
+	u8 n;
+
+	for (n = 0; n < nubat->deltaCount; n++) {
+		if (stricmp(nubat->delta[n].cmd, cmd) == 0) {
+			entry = &nubat->delta[n];
+			entry->used = ve_timer_uptime();
+			return entry;
+		}
+		if (!entry || nubat->delta[n].used < entry->used)
+			entry = &nubat->delta[n];
+	}
+
+	if ((copy = (char*) ve_malloc(strlen(cmd) + 1)) == NULL)
+		return NULL;
+	strcpy(copy, cmd);
+
+	if (nubat->deltaCount < PUBNUB_AT_DELTA) {
+		entry = &nubat->delta[nubat->deltaCount++];
+	} else {
+		ve_free(entry->cmd);
+		str_free(&entry->lines);
+	}
+	entry->cmd = copy;
+	entry->lines.data = NULL;
+	entry->lines.error = veTrue;
+	entry->seq = 0;
+	entry->deltas = 0;
+	entry->dict = veFalse;
+	entry->used = ve_timer_uptime();
+	return entry;
+}
+
+/*
+ * Completes the reply to the current command with either its lines or, when
+ * that is shorter, the difference with the previous reply to the command.
+ */
+static void delta_reply(struct PubnubAt* nubat, char const* final)
+{
+	struct PubnubDeltaOp ops[PUBNUB_DELTA_OPS];
+	struct PubnubAtDelta* entry;
+	yajl_gen g = nubat->reply;
+	int n = -1;
+	veBool ok;
+
+	nubat->reply = NULL;
+	entry = delta_find(nubat, nubat->step);
+	if (nubat->lines.error) {
+		ve_error("lines of %s lost", nubat->step);
+		entry = NULL;
+	}
+	/* coded and plain lines cannot be compared */
+	if (entry && entry->dict != nubat->cur.dict) {
+		str_free(&entry->lines);
+		entry->dict = nubat->cur.dict;
+	}
+
+	if (entry && !entry->lines.error && entry->deltas < PUBNUB_AT_KEYFRAME)
+		n = pubnub_deltaDiff(&entry->lines, &nubat->lines, ops, PUBNUB_DELTA_OPS);
+	if (n >= 0 && pubnub_deltaSize(ops, n, &nubat->lines) >= str_len(&nubat->lines))
+		n = -1;
+
+	ok = veTrue;
+	if (entry)
+		ok =	yajl_gen_string(g, (u8*) "seq", 3) == yajl_gen_status_ok &&
+				yajl_gen_integer(g, (u16) (entry->seq + 1)) == yajl_gen_status_ok;
+	if (ok && n >= 0)
+		ok =	yajl_gen_string(g, (u8*) "base", 4) == yajl_gen_status_ok &&
+				yajl_gen_integer(g, entry->seq) == yajl_gen_status_ok &&
+				yajl_gen_string(g, (u8*) "diff", 4) == yajl_gen_status_ok &&
+				yajl_gen_array_open(g) == yajl_gen_status_ok &&
+				pubnub_deltaGen(g, ops, n, &nubat->lines);
+	else if (ok)
+		ok = gen_lines(g, &nubat->lines);
+
+	if (!ok) {
+		ve_error("json: could not add lines");
+		yajl_gen_free(g);
+		str_free(&nubat->replyJson);
+		return;
+	}
+	reply_end(nubat, g, &nubat->replyJson, final, ve_timer_now_ms() - nubat->cmdStart);
+
+	/* this reply is the base of the next one */
+	if (entry) {
+		entry->seq++;
+		entry->deltas = (n >= 0 ? entry->deltas + 1 : 0);
+		str_free(&entry->lines);
+		entry->lines = nubat->lines;
+		nubat->lines.data = NULL;
+		nubat->lines.error = veTrue;
+	}
+}
+
+/* {"origin":"<origin>","dict":1,"rsp":"<coded line>"} */
+static void publish_coded(struct PubnubAt* nubat, char const* line)
+{
+	struct PubnubAtCmd plain;
+	u8 const *json;
+	size_t json_len;
+	yajl_gen g;
+	Str coded;
+
+	plain.id = NULL;
+	plain.dict = veTrue;
+	if ((g = reply_open(nubat, &plain, NULL)) == NULL)
+		return;
+
+	str_new(&coded, 64, 64);
+	pubnub_dictEncode(line, strlen(line), &coded);
+	if (	coded.error ||
+			yajl_gen_string(g, (u8*) "rsp", 3) != yajl_gen_status_ok ||
+			yajl_gen_string(g, (u8*) coded.data, str_len(&coded)) != yajl_gen_status_ok ||
+			yajl_gen_map_close(g) != yajl_gen_status_ok ||
+			yajl_gen_get_buf(g, &json, &json_len) != yajl_gen_status_ok) {
+		ve_error("json: could not code response");
+	} else {
+		pubnub_atPublishJson(nubat, (char const*) json, PUBNUB_AT_TTL);
+	}
+
+	str_free(&coded);
+	yajl_gen_free(g);
+}
+
+/* a trimmed response line of the current command, coded when it was */
+static void line_add(struct PubnubAt* nubat, Str* s, char const* line, size_t len)
+{
+	if (nubat->cur.dict)
+		pubnub_dictEncode(line, len, s);
+	else
+		str_addn(s, line, len);
+}
+
+/* a response line of the step being executed */
+static void cmd_response(struct PubnubAt* nubat, char const* line, veBool terminal)
+{
+	char const* trimmed;
+	size_t len;
+	Str coded;
+
+	if (nubat->recording)
+		cache_record(nubat, line, terminal);
+
+	if (!nubat->cur.envelope) {
+		if (nubat->cur.dict)
+			publish_coded(nubat, line);
+		else
+			pubnub_atPublish(nubat, line);
+	} else if (!terminal && nubat->reply && nubat->cur.delta) {
+		trimmed = line_trim(line, &len);
+		line_add(nubat, &nubat->lines, trimmed, len);
+		str_addn(&nubat->lines, "", 1);
+	} else if (!terminal && nubat->reply && nubat->cur.dict) {
+		trimmed = line_trim(line, &len);
+		str_new(&coded, len + 8, 16);
+		line_add(nubat, &coded, trimmed, len);
+		if (coded.error || yajl_gen_string(nubat->reply, (u8*) coded.data,
+												str_len(&coded)) != yajl_gen_status_ok)
+			ve_error("json: could not add line");
+		str_free(&coded);
+	} else if (!terminal && nubat->reply && !gen_line(nubat->reply, line)) {
+		ve_error("json: could not add line");
+	}
+
+	if (terminal) {
+		cmd_result(nubat, line);
+		cmd_next(nubat);
+	}
+}
+
+/*
+ * The lines are escaped straight into the reply, which is taken over by the
+ * journal and urlencoded from there into the publish request. So apart from
+ * the ADL response of a modem command, a byte is copied twice before it is
+ * written to the socket.
+ */
+static void at_rspSink(char const* line, veBool terminal, void* ctx)
+{
+	struct PubnubAt* nubat = (struct PubnubAt*) ctx;
+
+	ve_qtrace("rsp '%s' %p %d", line, nubat, terminal);
+	cmd_response(nubat, line, terminal);
+}
+
+/* the commands of a script, stored zero terminated one after the other */
+static int msg_script(struct AtMsg* msg, const u8 *buf, size_t bufLen)
+{
+	if (msg->steps == PUBNUB_AT_SCRIPT_MAX || memchr(buf, 0, bufLen)) {
+		ve_warning("script too long or invalid");
+		return 0;
+	}
+
+	if (msg->script.error)
+		str_new(&msg->script, 256, 256);
+	str_addn(&msg->script, (char const*) buf, bufLen);
+	str_addn(&msg->script, "", 1);
+	msg->steps++;
+
+	return !msg->script.error;
+}
+
+static int msg_string(void *ctx, const u8 *buf, size_t bufLen)
+{
+	struct AtMsg* msg = (struct AtMsg*) ctx;
+
+	if (msg->level == 2 && msg->key == MSG_KEY_SCRIPT)
+		return msg_script(msg, buf, bufLen);
+
+	if (msg->level != 1)
+		return 1;
+
+	switch (msg->key)
+	{
+	case MSG_KEY_ORIGIN:
+		str_free(&msg->origin);
+		return str_newn(&msg->origin, (char const*) buf, bufLen);
+	case MSG_KEY_CMD:
+		str_free(&msg->cmd);
+		return str_newn(&msg->cmd, (char const*) buf, bufLen);
+	case MSG_KEY_ID:
+		str_free(&msg->id);
+		msg->idIsNumber = veFalse;
+		return str_newn(&msg->id, (char const*) buf, bufLen);
+	case MSG_KEY_RSP:
+		msg->isRsp = veTrue;
+		return 1;
+	case MSG_KEY_DATA:
+		str_free(&msg->data);
+		return str_newn(&msg->data, (char const*) buf, bufLen);
+	case MSG_KEY_TO:
+		str_free(&msg->to);
+		return str_newn(&msg->to, (char const*) buf, bufLen);
+	case MSG_KEY_MODE:
+		msg->stopOnError = !(bufLen == 8 && strncmp((char const*) buf, "continue", 8) == 0);
+		return 1;
 	default:
-		;
+		return 1;
+	}
+}
+
+static int msg_u32(const char *buf, size_t bufLen, u32* value)
+{
+	char tmp[12];
+
+	if (bufLen >= sizeof(tmp))
+		return 0;
+	memcpy(tmp, buf, bufLen);
+	tmp[bufLen] = 0;
+	*value = strtoul(tmp, NULL, 10);
+	return 1;
+}
+
+static int msg_number(void *ctx, const char *buf, size_t bufLen)
+{
+	struct AtMsg* msg = (struct AtMsg*) ctx;
+	u32 value;
+
+	if (msg->level == 2 && msg->key == MSG_KEY_SACK) {
+		if (msg->sackCount == PUBNUB_FRAG_SACK)
+			return 1;
+		if (!msg_u32(buf, bufLen, &value))
+			return 0;
+		msg->sack[msg->sackCount++] = (u16) value;
+		return 1;
+	}
+
+	if (msg->level != 1)
+		return 1;
+
+	switch (msg->key)
+	{
+	case MSG_KEY_ID:
+		str_free(&msg->id);
+		msg->idIsNumber = veTrue;
+		return str_newn(&msg->id, buf, bufLen);
+	case MSG_KEY_TIMEOUT:
+		return msg_u32(buf, bufLen, &msg->timeout);
+	case MSG_KEY_DICT:
+		return msg_u32(buf, bufLen, &msg->dict);
+	case MSG_KEY_FRAG:
+		msg->isFrag = veTrue;
+		return msg_u32(buf, bufLen, &msg->frag);
+	case MSG_KEY_SEQ:
+		return msg_u32(buf, bufLen, &msg->seq);
+	case MSG_KEY_OF:
+		return msg_u32(buf, bufLen, &msg->of);
+	case MSG_KEY_ACK:
+		msg->isAck = veTrue;
+		return msg_u32(buf, bufLen, &msg->ack);
+	case MSG_KEY_NEXT:
+		return msg_u32(buf, bufLen, &msg->next);
+	default:
+		return 1;
+	}
+}
+
+static int msg_boolean(void *ctx, int value)
+{
+	struct AtMsg* msg = (struct AtMsg*) ctx;
+
+	if (msg->level == 1 && msg->key == MSG_KEY_DELTA)
+		msg->delta = (value != 0);
+	return 1;
+}
+
+static int msg_map_key(void *ctx, const u8 *buf, size_t bufLen)
+{
+	struct AtMsg* msg = (struct AtMsg*) ctx;
+
+	if (msg->level != 1)
+		return 1;
+
+	msg->key = MSG_KEY_NONE;
+	if (bufLen == 6 && strncmp((char const*) buf, "origin", 6) == 0)
+		msg->key = MSG_KEY_ORIGIN;
+	else if (bufLen == 3 && strncmp((char const*) buf, "cmd", 3) == 0)
+		msg->key = MSG_KEY_CMD;
+	else if (bufLen == 3 && strncmp((char const*) buf, "rsp", 3) == 0)
+		msg->key = MSG_KEY_RSP;
+	else if (bufLen == 2 && strncmp((char const*) buf, "id", 2) == 0)
+		msg->key = MSG_KEY_ID;
+	else if (bufLen == 7 && strncmp((char const*) buf, "timeout", 7) == 0)
+		msg->key = MSG_KEY_TIMEOUT;
+	else if (bufLen == 6 && strncmp((char const*) buf, "script", 6) == 0)
+		msg->key = MSG_KEY_SCRIPT;
+	else if (bufLen == 4 && strncmp((char const*) buf, "mode", 4) == 0)
+		msg->key = MSG_KEY_MODE;
+	else if (bufLen == 5 && strncmp((char const*) buf, "delta", 5) == 0)
+		msg->key = MSG_KEY_DELTA;
+	else if (bufLen == 4 && strncmp((char const*) buf, "dict", 4) == 0)
+		msg->key = MSG_KEY_DICT;
+	else if (bufLen == 4 && strncmp((char const*) buf, "frag", 4) == 0)
+		msg->key = MSG_KEY_FRAG;
+	else if (bufLen == 3 && strncmp((char const*) buf, "seq", 3) == 0)
+		msg->key = MSG_KEY_SEQ;
+	else if (bufLen == 2 && strncmp((char const*) buf, "of", 2) == 0)
+		msg->key = MSG_KEY_OF;
+	else if (bufLen == 4 && strncmp((char const*) buf, "data", 4) == 0)
+		msg->key = MSG_KEY_DATA;
+	else if (bufLen == 3 && strncmp((char const*) buf, "ack", 3) == 0)
+		msg->key = MSG_KEY_ACK;
+	else if (bufLen == 2 && strncmp((char const*) buf, "to", 2) == 0)
+		msg->key = MSG_KEY_TO;
+	else if (bufLen == 4 && strncmp((char const*) buf, "next", 4) == 0)
+		msg->key = MSG_KEY_NEXT;
+	else if (bufLen == 4 && strncmp((char const*) buf, "sack", 4) == 0)
+		msg->key = MSG_KEY_SACK;
+	return 1;
+}
+
+static int msg_open(void *ctx)
+{
+	((struct AtMsg*) ctx)->level++;
+	return 1;
+}
+
+static int msg_close(void *ctx)
+{
+	((struct AtMsg*) ctx)->level--;
+	return 1;
+}
+
+static yajl_callbacks msgCallbacks = {
+	NULL,
+	msg_boolean,
+	NULL,
+	NULL,
+	msg_number,
+	msg_string,
+	msg_open,
+	msg_map_key,
+	msg_close,
+	msg_open,
+	msg_close
+};
+
+static void msg_init(struct AtMsg* msg)
+{
+	msg->origin.data = NULL;
+	msg->origin.error = veTrue;
+	msg->cmd.data = NULL;
+	msg->cmd.error = veTrue;
+	msg->id.data = NULL;
+	msg->id.error = veTrue;
+	msg->idIsNumber = veFalse;
+	msg->timeout = 0;
+	msg->script.data = NULL;
+	msg->script.error = veTrue;
+	msg->steps = 0;
+	msg->stopOnError = veTrue;
+	msg->delta = veFalse;
+	msg->dict = 0;
+	msg->isFrag = veFalse;
+	msg->frag = 0;
+	msg->seq = 0;
+	msg->of = 0;
+	msg->data.data = NULL;
+	msg->data.error = veTrue;
+	msg->isAck = veFalse;
+	msg->ack = 0;
+	msg->to.data = NULL;
+	msg->to.error = veTrue;
+	msg->next = 0;
+	msg->sackCount = 0;
+	msg->isRsp = veFalse;
+	msg->key = MSG_KEY_NONE;
+	msg->level = 0;
+}
+
+static void msg_free(struct AtMsg* msg)
+{
+	str_free(&msg->origin);
+	str_free(&msg->cmd);
+	str_free(&msg->id);
+	str_free(&msg->script);
+	str_free(&msg->data);
+	str_free(&msg->to);
+}
+
+/* note: the message must be freed, also when parsing fails */
+static veBool msg_parse(struct AtMsg* msg, char const* json, int len)
+{
+	yajl_handle yajl;
+	veBool ret;
+
+	msg_init(msg);
+	yajl = yajl_alloc(&msgCallbacks, NULL, msg);
+	if (!yajl)
+		return veFalse;
+
+	ret = yajl_parse(yajl, (u8 const*) json, len) == yajl_status_ok &&
+			yajl_complete_parse(yajl) == yajl_status_ok;
+	yajl_free(yajl);
+
+	return ret;
+}
+
+/* a coded cmd or script is replaced by the plain one */
+static veBool msg_decode(struct AtMsg* msg)
+{
+	Str* coded = (msg->steps ? &msg->script : &msg->cmd);
+	Str plain;
+	veBool ok;
+
+	if (!msg->dict || coded->error)
+		return veTrue;
+	if (msg->dict != PUBNUB_DICT_VERSION) {
+		ve_warning("unknown dictionary %u", msg->dict);
+		return veFalse;
+	}
+
+	str_new(&plain, str_len(coded) * 2 + 1, 64);
+	ok = pubnub_dictDecode(coded->data, str_len(coded), &plain);
+	str_free(coded);
+	*coded = plain;
+
+	return ok;
+}
+
+/* own responses come back when commands and responses share a channel */
+static veBool msg_is_echo(struct PubnubAt* nubat, struct AtMsg* msg)
+{
+	if (!nubat->origin[0] || msg->origin.error)
+		return veFalse;
+	return strcmp(str_cstr(&msg->origin), nubat->origin) == 0;
+}
+
+static void token_save(void *ctx)
+{
+	struct PubnubAt* nubat = (struct PubnubAt*) ctx;
+
+	nubat->tokenTmrArmed = veFalse;
+	nubat->tokenSaveSoon = veFalse;
+	nubat->cmdReceived = veFalse;
+	if (dev_regs.pubnubTimeToken && strcmp(dev_regs.pubnubTimeToken, nubat->nub.timeToken) == 0)
+		return;
+
+	if (!dev_regChangeString(DEV_REG_PUBNUB_TOKEN, nubat->nub.timeToken))
+		ve_error("could not save the time token");
+}
+
+static void nat_save(struct PubnubAt* nubat)
+{
+	Str s;
+
+	/* not known yet which network it is for */
+	if (!nubat->nat.changed || !nubat->nat.net[0])
+		return;
+
+	str_new(&s, 64, 64);
+	pubnub_natStore(&nubat->nat, dev_regs.pubnubNat, &s);
+	if (s.error || !dev_regChangeString(DEV_REG_PUBNUB_NAT, s.data))
+		ve_error("could not save the NAT estimate");
+	str_free(&s);
+}
+
+/*
+ * The network the connection goes over, as the bearer names it, e.g. "eth",
+ * or "gprs-<mcc><mnc>" so every operator gets its own NAT estimate. It is
+ * stored in pubnub.nat per network and used from the next poll on.
+ */
+void pubnub_atNetwork(struct PubnubAt* nubat, char const* net)
+{
+	nat_save(nubat);
+	pubnub_natInit(&nubat->nat, net, dev_regs.pubnubNat);
+}
+
+/* called when a subscribe is done, the time token has changed */
+static void token_changed(struct PubnubAt* nubat)
+{
+	/* not moved on by later polls, so a save is not put off forever */
+	if (nubat->cmdReceived) {
+		if (!nubat->tokenSaveSoon) {
+			nubat->tokenTmrArmed = veTrue;
+			nubat->tokenSaveSoon = veTrue;
+			ve_timer_slack(&nubat->tokenTmr, TOKEN_CMD_DELAY * 1000, TOKEN_CMD_SLACK * 1000,
+							token_save, nubat);
+		}
+		return;
 	}
+
+	if (!nubat->tokenTmrArmed) {
+		nubat->tokenTmrArmed = veTrue;
+		ve_timer_slack(&nubat->tokenTmr, TOKEN_SAVE_INTERVAL * 1000, TOKEN_SAVE_SLACK * 1000,
+						token_save, nubat);
+	}
+}
+
+/*
+ * Commands are executed one at a time, in order of arrival. The subscribe
+ * continues meanwhile, so the next commands are already waiting when one
+ * finishes. When more than half of the queue is used the subscribe is held
+ * back, commands which still do not fit are answered with BUSY.
+ */
+static void cmd_timeout(void *ctx)
+{
+	struct PubnubAt* nubat = (struct PubnubAt*) ctx;
+
+	/* the modem still has to finish it, till then the queue waits */
+	ve_warning("command %s timed out", nubat->cur.id ? nubat->cur.id : nubat->step);
+	if (!nubat->reply)
+		return;
+
+	if (nubat->cur.steps && !step_end(nubat->reply, "TIMEOUT"))
+		ve_error("json: could not end step");
+	/* the lines so far, a partial reply is no base for a delta */
+	if (nubat->cur.delta && !gen_lines(nubat->reply, &nubat->lines)) {
+		ve_error("json: could not add lines");
+		yajl_gen_free(nubat->reply);
+		nubat->reply = NULL;
+		str_free(&nubat->replyJson);
+		return;
+	}
+	reply_end(nubat, nubat->reply, &nubat->replyJson, "TIMEOUT",
+				ve_timer_now_ms() - nubat->cmdStart);
+	nubat->reply = NULL;
 }
 
-static veBool at_rspHandler(adl_atResponse_t *params)
+/* take the next command from the queue */
+static void cmd_start(struct PubnubAt* nubat)
 {
-	struct PubnubAt* nubat = (struct PubnubAt*) params->Contxt;
+	struct PubnubAtCmd* cmd = &nubat->cur;
+
+	*cmd = nubat->cmdQueue[nubat->cmdHead];
+	nubat->cmdHead = (nubat->cmdHead + 1) % PUBNUB_AT_QUEUE;
+	nubat->cmdCount--;
+
+	nubat->step = cmd->cmd;
+	nubat->scriptFailed = veFalse;
+	nubat->cmdStart = ve_timer_now_ms();
 
-	ve_qtrace("rsp '%s' %p %d", params->StrData, nubat, params->IsTerminal);
-	pubnub_atPublish(nubat, params->StrData);
+	if (!cmd->envelope)
+		return;
 
-	if (params->IsTerminal)
-		nubat->atCmdPending = veFalse;
+	/* a delta reply is completed when the lines are known */
+	if (cmd->delta) {
+		nubat->reply = reply_open(nubat, cmd, &nubat->replyJson);
+		str_new(&nubat->lines, 256, 256);
+	} else {
+		nubat->reply = reply_begin(nubat, cmd, &nubat->replyJson);
+	}
+	if (nubat->reply && cmd->steps && !step_begin(nubat->reply, nubat->step)) {
+		ve_error("json: could not begin step");
+		yajl_gen_free(nubat->reply);
+		nubat->reply = NULL;
+		str_free(&nubat->replyJson);
+	}
+	if (cmd->timeout)
+		ve_timer_ms(&nubat->cmdTmr, cmd->timeout, cmd_timeout, nubat);
+}
 
-	return veFalse;
+/* the current command has finished */
+static void cmd_done(struct PubnubAt* nubat)
+{
+	ve_timer_cancel(&nubat->cmdTmr);
+	if (nubat->reply) {
+		yajl_gen_free(nubat->reply);
+		nubat->reply = NULL;
+	}
+	str_free(&nubat->replyJson);
+	str_free(&nubat->lines);
+	ve_free(nubat->cur.cmd);
+	nubat->cur.cmd = NULL;
+	nubat->cur.id = NULL;
+	nubat->cur.envelope = veFalse;
+	nubat->cur.delta = veFalse;
+	nubat->cur.dict = veFalse;
+	nubat->step = NULL;
+}
+
+/* the terminal response of the step being executed, continues a script */
+static void cmd_result(struct PubnubAt* nubat, char const* final)
+{
+	struct PubnubAtCmd* cmd = &nubat->cur;
+	veBool ok = rsp_is_ok(final);
+
+	nubat->atCmdPending = veFalse;
+
+	if (!cmd->steps) {
+		if (nubat->reply && cmd->delta) {
+			delta_reply(nubat, final);
+		} else if (nubat->reply) {
+			reply_end(nubat, nubat->reply, &nubat->replyJson, final,
+						ve_timer_now_ms() - nubat->cmdStart);
+			nubat->reply = NULL;
+		}
+		cmd_done(nubat);
+		return;
+	}
+
+	if (!ok)
+		nubat->scriptFailed = veTrue;
+
+	/* a timed out script has no reply anymore and ends here */
+	if (nubat->reply && !step_end(nubat->reply, final))
+		ve_error("json: could not end step");
+
+	if (--cmd->steps && nubat->reply && (ok || !cmd->stopOnError)) {
+		nubat->step += strlen(nubat->step) + 1;
+		if (step_begin(nubat->reply, nubat->step))
+			return;
+		ve_error("json: could not begin step");
+		nubat->scriptFailed = veTrue;
+	}
+
+	if (nubat->reply) {
+		reply_end(nubat, nubat->reply, &nubat->replyJson, nubat->scriptFailed ? "ERROR" : "OK",
+					ve_timer_now_ms() - nubat->cmdStart);
+		nubat->reply = NULL;
+	}
+	cmd_done(nubat);
+}
+
+/* answer the step being executed with the stored lines */
+static void cache_replay(struct PubnubAt* nubat, struct PubnubAtCache const* entry)
+{
+	char const* line = entry->rsp.data;
+	char const* end = line + str_len(&entry->rsp);
+	char const* next;
+
+	ve_qtrace("answering %s from the cache", entry->cmd);
+	nubat->atCmdPending = veTrue;
+	while (line < end) {
+		next = line + strlen(line) + 1;
+		cmd_response(nubat, line, next >= end);
+		line = next;
+	}
+}
+
+/* send the step of the current command */
+static void cmd_execute(struct PubnubAt* nubat)
+{
+	struct PubnubAtCache* entry = cache_find(nubat, nubat->step);
+
+	if (entry && cache_fresh(entry)) {
+		cache_replay(nubat, entry);
+		return;
+	}
+	if (entry)
+		cache_record_start(nubat, entry);
+
+	/* This relies on the fact that command always sends at terminal response! */
+	nubat->atCmdPending = veTrue;
+	if (ve_atCmdSendSink(nubat->step, veFalse, 0, nubat, at_rspSink) != OK) {
+		nubat->recording = NULL;
+		if (!nubat->cur.envelope)
+			pubnub_atPublish(nubat, "ERROR");
+		cmd_result(nubat, "ERROR");
+	}
+}
+
+static void cmd_next(struct PubnubAt* nubat)
+{
+	/* local commands can respond before ve_atCmdSendSink returns */
+	if (nubat->cmdRunning)
+		return;
+
+	nubat->cmdRunning = veTrue;
+	while (!nubat->atCmdPending) {
+		if (!nubat->cur.cmd) {
+			if (!nubat->cmdCount)
+				break;
+			cmd_start(nubat);
+		}
+		cmd_execute(nubat);
+	}
+	nubat->cmdRunning = veFalse;
+
+	/* there is room again */
+	pubnub_atSubscribe(nubat);
+}
+
+static void cmd_busy(struct PubnubAt* nubat, char const* cmd, size_t len, struct AtMsg const* msg)
+{
+	struct PubnubAtCmd reject;
+	yajl_gen g;
+	Str busy;
+
+	if (msg && (!msg->id.error || msg->steps)) {
+		ve_warning("command queue full, dropping %s", msg->id.error ? "script" : msg->id.data);
+		reject.id = (msg->id.error ? NULL : msg->id.data);
+		reject.idIsNumber = msg->idIsNumber;
+		reject.steps = msg->steps;
+		reject.dict = (msg->dict != 0);
+		if ((g = reply_begin(nubat, &reject, NULL)) != NULL)
+			reply_end(nubat, g, NULL, "BUSY", 0);
+		return;
+	}
+
+	str_new(&busy, len + 6, 0);
+	str_add(&busy, "BUSY ");
+	str_addn(&busy, cmd, len);
+	ve_warning("command queue full, %s", str_cstr(&busy));
+	if (!busy.error)
+		pubnub_atPublish(nubat, busy.data);
+	str_free(&busy);
+}
+
+/*
+ * msg is the envelope of the command, if any. For a script cmd are all its
+ * commands, zero terminated.
+ */
+static void cmd_enqueue(struct PubnubAt* nubat, char const* cmd, size_t len, struct AtMsg const* msg)
+{
+	struct PubnubAtCmd* entry;
+	size_t idLen = 0;
+	char* p;
+
+	nubat->cmdReceived = veTrue;
+
+	if (msg && !msg->id.error)
+		idLen = str_len(&msg->id) + 1;
+
+	/* the id is stored after the command */
+	if (nubat->cmdCount == PUBNUB_AT_QUEUE || (p = (char*) ve_malloc(len + 1 + idLen)) == NULL) {
+		cmd_busy(nubat, cmd, len, msg);
+		return;
+	}
+
+	entry = &nubat->cmdQueue[(nubat->cmdHead + nubat->cmdCount) % PUBNUB_AT_QUEUE];
+	memcpy(p, cmd, len);
+	p[len] = 0;
+	entry->cmd = p;
+	entry->id = NULL;
+	entry->idIsNumber = veFalse;
+	entry->envelope = veFalse;
+	entry->steps = 0;
+	entry->stopOnError = veTrue;
+	entry->delta = veFalse;
+	entry->dict = veFalse;
+	entry->timeout = 0;
+	if (msg) {
+		entry->envelope = (idLen || msg->steps);
+		entry->steps = msg->steps;
+		entry->stopOnError = msg->stopOnError;
+		/* a script is always answered in full */
+		entry->delta = (idLen && msg->delta && !msg->steps);
+		entry->dict = (msg->dict != 0);
+		entry->timeout = msg->timeout;
+	}
+	if (idLen) {
+		entry->id = p + len + 1;
+		memcpy(entry->id, msg->id.data, idLen);
+		entry->idIsNumber = msg->idIsNumber;
+	}
+
+	nubat->cmdCount++;
+	cmd_next(nubat);
+}
+
+/* a json message, received as is or in fragments */
+void pubnub_atReceived(struct PubnubAt* nubat, char const* json, size_t len)
+{
+	struct AtMsg msg;
+
+	if (!msg_parse(&msg, json, (int) len) || !msg_decode(&msg))
+		ve_qtrace("ignoring malformed message");
+	else if (msg_is_echo(nubat, &msg))
+		ve_ltrace(17, "ignoring own message");
+	else if (msg.isFrag && !msg.data.error)
+		pubnub_fragReceived(&nubat->frag, msg.origin.error ? NULL : msg.origin.data,
+					(u16) msg.frag, (u16) msg.seq, (u16) msg.of, msg.data.data, str_len(&msg.data));
+	else if (msg.isAck)
+		pubnub_fragAcked(&nubat->frag, msg.to.error ? NULL : msg.to.data,
+					(u16) msg.ack, (u16) msg.next, msg.sack, msg.sackCount);
+	else if (msg.steps)
+		cmd_enqueue(nubat, msg.script.data, str_len(&msg.script), &msg);
+	else if (!msg.cmd.error)
+		cmd_enqueue(nubat, msg.cmd.data, str_len(&msg.cmd), &msg);
+	else if (!msg.isRsp)
+		ve_qtrace("ignoring unknown message");
+	msg_free(&msg);
 }
 
 static void subscribe_callback(struct PubnubRequest* req, NubEv ev,
@@ -70,20 +1274,16 @@ static void subscribe_callback(struct PubnubRequest* req, NubEv ev,
 	switch (ev)
 	{
 	case NUB_DATA:
-		{
-			Str str;
-			if (!str_newn(&str, buf, buf_len))
-				return;
-
-			/* This relies on the fact that command always sends at terminal response! */
-			nubat->atCmdPending = veTrue;
-			if (ve_atCmdSendExt(str.data, veFalse, 0, nubat, at_rspHandler) != OK)
-				nubat->atCmdPending = veFalse;
-			str_free(&str);
-			break;
-		}
+		cmd_enqueue(nubat, buf, buf_len, NULL);
+		break;
+
+	case NUB_JSON:
+		pubnub_atReceived(nubat, buf, buf_len);
+		break;
 
 	case NUB_DONE:
+		token_changed(nubat);
+		nat_save(nubat);
 		pubnub_atSubscribe(nubat);	/* wait for commands when idle */
 		break;
 
@@ -92,64 +1292,70 @@ static void subscribe_callback(struct PubnubRequest* req, NubEv ev,
 	}
 }
 
-/* wait for commands when idle */
+/* wait for commands, unless many are waiting already */
 void pubnub_atSubscribe(struct PubnubAt* nubat)
 {
-	if (nubat->nub.httpc.reqQueue || nubat->atCmdPending)
+	if (nubat->nub.subQueued)
 		return;
+
+	if (nubat->cmdCount > PUBNUB_AT_QUEUE / 2) {
+		ve_qtrace("%d commands waiting, not subscribing", nubat->cmdCount);
+		return;
+	}
+
 	pubnub_subscribe(&nubat->subReq, nubat->nub.timeToken, subscribe_callback);
 }
 
+/* {"origin":"<origin>","rsp": */
+static veBool json_tag_begin(struct PubnubAt* nubat)
+{
+	return	yajl_gen_map_open(nubat->g) == yajl_gen_status_ok &&
+			yajl_gen_string(nubat->g, (u8*) "origin", 6) == yajl_gen_status_ok &&
+			yajl_gen_string(nubat->g, (u8*) nubat->origin, strlen(nubat->origin)) == yajl_gen_status_ok &&
+			yajl_gen_string(nubat->g, (u8*) "rsp", 3) == yajl_gen_status_ok;
+}
+
+/*
+ * publish json text as is, it is dropped when not sent within ttl seconds.
+ * Messages too long for a single publish are sent in fragments.
+ */
+veBool pubnub_atPublishJson(struct PubnubAt* nubat, char const* json, u16 ttl)
+{
+	size_t len = strlen(json);
+
+	if (len > PUBNUB_JOURNAL_BATCH)
+		return pubnub_fragSend(&nubat->frag, json, len, veFalse, ttl);
+	return pubnub_journalAdd(&nubat->journal, json, ttl);
+}
+
 veBool pubnub_atPublishN(struct PubnubAt* nubat, char const *buf, size_t buf_len)
 {
-	struct PubnubRequest *nubreq;
 	u8 const *json;
 	size_t json_len;
+	veBool ret = veFalse;
 
-	/* allocate request */
 	if (!nubat->g) {
 		nubat->g = yajl_gen_alloc(NULL);
 		if (!nubat->g)
 			return veFalse;
 	}
 
-	nubreq = (struct PubnubRequest *) ve_malloc(sizeof(struct PubnubRequest));
-	if (!nubreq) {
-		/* reuse the nubat->q next time */
-		return veFalse;
-	}
-
-	pubnub_req_init(&nubat->nub, nubreq, 512, 512);
-
 	/* build json data.. */
-	if (yajl_gen_string(nubat->g, (u8*) buf, buf_len) != yajl_gen_status_ok) {
+	if (nubat->tagResponses && !json_tag_begin(nubat))
+		ve_error("json: could not tag response");
+	else if (yajl_gen_string(nubat->g, (u8*) buf, buf_len) != yajl_gen_status_ok)
 		ve_error("json: not a valid string");
-		goto error;
-	}
-
-	if (yajl_gen_get_buf(nubat->g, &json, &json_len) != yajl_gen_status_ok) {
+	else if (nubat->tagResponses && yajl_gen_map_close(nubat->g) != yajl_gen_status_ok)
+		ve_error("json: could not tag response");
+	else if (yajl_gen_get_buf(nubat->g, &json, &json_len) != yajl_gen_status_ok)
 		ve_error("json: could not get buf");
-		return veFalse;
-	}
+	else
+		ret = pubnub_atPublishJson(nubat, (char const*) json, PUBNUB_AT_TTL);
 
-	/* sent it */
-	if (pubnub_publish(nubreq, (char*) json, publish_callback) != RET_OK) {
-		ve_error("could not pubnub_publish");
-		goto error;
-	}
-
-	yajl_gen_clear(nubat->g);	/* empty buffers */
-	yajl_gen_free(nubat->g);
-	nubat->g = NULL;
-	return veTrue;
-
-error:
-	pubnub_req_deinit(nubreq);
-	ve_free(nubreq);
 	yajl_gen_free(nubat->g);
 	nubat->g = NULL;
 
-	return veFalse;
+	return ret;
 }
 
 veBool pubnub_atPublish(struct PubnubAt* nubat, char const *str)
@@ -157,21 +1363,93 @@ veBool pubnub_atPublish(struct PubnubAt* nubat, char const *str)
 	return pubnub_atPublishN(nubat, str, strlen(str));
 }
 
-int pubnub_atInit(struct PubnubAt* nubat, char const* channel, const char* publishKey,
-		const char* subscribeKey, const char* secretKey, const char* host, u16 port)
+/*
+ * Commands are received on cmdChannel, responses are published to rspChannel.
+ * When both are the same, responses are tagged with the origin so they can be
+ * recognised and ignored when they are received again.
+ */
+int pubnub_atInit(struct PubnubAt* nubat, char const* cmdChannel, char const* rspChannel,
+		char const* origin, const char* publishKey, const char* subscribeKey,
+		const char* secretKey, const char* host, u16 port)
 {
-	pubnub_init(&nubat->nub, channel, publishKey, subscribeKey, secretKey, host, port, nubat);
+	pubnub_init(&nubat->nub, cmdChannel, publishKey, subscribeKey, secretKey, host, port, nubat);
+	pubnub_setPublishChannel(&nubat->nub, rspChannel);
+	pubnub_setTimeToken(&nubat->nub, dev_regs.pubnubTimeToken);
 	pubnub_req_init(&nubat->nub, &nubat->subReq, 512, 512);
+	/* the estimate is for an unknown network till pubnub_atNetwork */
+	pubnub_natInit(&nubat->nat, "", dev_regs.pubnubNat);
+	pubnub_req_init(&nubat->nub, &nubat->probeReq, 256, 256);
+	str_new(&nubat->probeChannel, 32, 32);
+	str_add(&nubat->probeChannel, cmdChannel);
+	str_add(&nubat->probeChannel, "-nat");
+	if (origin && *origin) {
+		str_addc(&nubat->probeChannel, '-');
+		str_add(&nubat->probeChannel, origin);
+	}
+	pubnub_setNat(&nubat->nub, &nubat->nat, &nubat->probeReq,
+					nubat->probeChannel.error ? NULL : nubat->probeChannel.data);
+	pubnub_journalInit(&nubat->journal, &nubat->nub, dev_regs.pubnubJournal);
+	pubnub_fragInit(&nubat->frag, nubat);
+	nubat->origin = (origin ? origin : "");
+	nubat->tagResponses = veFalse;
 	nubat->atCmdPending = veFalse;
+	nubat->cmdRunning = veFalse;
+	nubat->cmdHead = 0;
+	nubat->cmdCount = 0;
+	nubat->cur.cmd = NULL;
+	nubat->cur.id = NULL;
+	nubat->cur.envelope = veFalse;
+	nubat->cur.delta = veFalse;
+	nubat->cur.dict = veFalse;
+	nubat->step = NULL;
+	nubat->scriptFailed = veFalse;
+	nubat->reply = NULL;
+	nubat->lines.data = NULL;
+	nubat->lines.error = veTrue;
+	nubat->replyJson.data = NULL;
+	nubat->replyJson.error = veTrue;
+	nubat->cacheCount = 0;
+	nubat->deltaCount = 0;
+	cache_load(nubat, dev_regs.pubnubCache);
+	pubnub_urcInit(&nubat->urc, nubat, dev_regs.pubnubUrc);
+	pubnub_schedInit(&nubat->sched, nubat);
+	nubat->cmdReceived = veFalse;
+	nubat->tokenTmrArmed = veFalse;
+	nubat->tokenSaveSoon = veFalse;
 	nubat->g = NULL;
 
+	if (strcmp(cmdChannel, rspChannel) == 0) {
+		if (nubat->origin[0])
+			nubat->tagResponses = veTrue;
+		else
+			ve_warning("no origin, own responses will be seen as commands");
+	}
+
 	return RET_OK;
 }
 
 void pubnub_atDeinit(struct PubnubAt* nubat)
 {
+	ve_timer_cancel(&nubat->tokenTmr);
+	/* commands were received, do not run them again */
+	if (nubat->tokenSaveSoon)
+		token_save(nubat);
+	cmd_done(nubat);
+	cache_clear(nubat);
+	delta_clear(nubat);
+	pubnub_urcDeinit(&nubat->urc);
+	pubnub_schedDeinit(&nubat->sched);
+	while (nubat->cmdCount) {
+		ve_free(nubat->cmdQueue[nubat->cmdHead].cmd);
+		nubat->cmdHead = (nubat->cmdHead + 1) % PUBNUB_AT_QUEUE;
+		nubat->cmdCount--;
+	}
 	pubnub_deinit(&nubat->nub);
 	pubnub_req_deinit(&nubat->subReq);
+	pubnub_req_deinit(&nubat->probeReq);
+	str_free(&nubat->probeChannel);
+	pubnub_fragDeinit(&nubat->frag);
+	pubnub_journalDeinit(&nubat->journal);
 	if (nubat->g) {
 		yajl_gen_free(nubat->g);
 		nubat->g = NULL;
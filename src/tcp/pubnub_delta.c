@@ -0,0 +1,304 @@
+/*
+ * Copyright (c) 2012 All rights reserved.
+ * Jeroen Hofstee, Victron Energy, jhofstee@victronenergy.com.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#define VE_MOD	VE_MOD_PUBNUBAT
+
+#include <platform.h>
+
+#include <pubnub_delta.h>
+#include <ve_trace.h>
+#include <yajl/yajl_parse.h>
+
+struct LineList {
+	char const** line;		/* allocated */
+	u16 count;
+};
+
+static veBool list_init(struct LineList* list, Str const* lines)
+{
+	char const* p = lines->data;
+	char const* end = p + str_len(lines);
+	u16 n = 0;
+
+	list->count = 0;
+	list->line = NULL;
+	if (lines->error)
+		return veTrue;
+
+	for (; p < end; p += strlen(p) + 1)
+		list->count++;
+	if (!list->count)
+		return veTrue;
+
+	list->line = (char const**) ve_malloc(list->count * sizeof(char const*));
+	if (!list->line)
+		return veFalse;
+
+	for (p = lines->data; p < end; p += strlen(p) + 1)
+		list->line[n++] = p;
+	return veTrue;
+}
+
+static veBool list_eq(struct LineList const* a, u16 i, struct LineList const* b, u16 j)
+{
+	return strcmp(a->line[i], b->line[j]) == 0;
+}
+
+struct DiffOut {
+	struct PubnubDeltaOp* ops;
+	int n;
+	int max;
+};
+
+/* adds an operation, merged with the previous one when of the same kind */
+static veBool diff_op(struct DiffOut* out, s16 n, u16 line)
+{
+	struct PubnubDeltaOp* last = (out->n ? &out->ops[out->n - 1] : NULL);
+
+	if (last && n > 0 && last->n > 0 && last->n <= 0x7FFF - n) {
+		last->n += n;
+		return veTrue;
+	}
+	if (last && n < 0 && last->n < 0 && last->n >= -0x7FFF - n) {
+		last->n += n;
+		return veTrue;
+	}
+	if (out->n == out->max)
+		return veFalse;
+
+	out->ops[out->n].n = n;
+	out->ops[out->n].line = line;
+	out->n++;
+	return veTrue;
+}
+
+/*
+ * Returns the number of operations turning base into lines, -1 if more than
+ * maxOps are needed. This is not a minimal diff, lines are compared in order
+ * and only a few lines ahead are searched for a match. That is enough for
+ * the output of the same command some time later.
+ */
+int pubnub_deltaDiff(Str const* base, Str const* lines, struct PubnubDeltaOp* ops, int maxOps)
+{
+	struct LineList old;
+	struct LineList cur;
+	struct DiffOut out;
+	u16 i = 0;
+	u16 j = 0;
+	u16 k;
+	veBool ok = veTrue;
+
+	out.ops = ops;
+	out.n = 0;
+	out.max = maxOps;
+
+	if (!list_init(&old, base))
+		return -1;
+	if (!list_init(&cur, lines)) {
+		ve_free(old.line);
+		return -1;
+	}
+
+	while (ok && (i < cur.count || j < old.count)) {
+		if (i < cur.count && j < old.count && list_eq(&cur, i, &old, j)) {
+			ok = diff_op(&out, 1, 0);
+			i++;
+			j++;
+			continue;
+		}
+
+		if (j == old.count) {
+			ok = diff_op(&out, 0, i++);
+			continue;
+		}
+		if (i == cur.count) {
+			ok = diff_op(&out, -1, 0);
+			j++;
+			continue;
+		}
+
+		/* lines removed or added */
+		for (k = 1; k <= PUBNUB_DELTA_LOOKAHEAD; k++) {
+			if (j + k < old.count && list_eq(&cur, i, &old, j + k)) {
+				ok = diff_op(&out, -(s16) k, 0);
+				j += k;
+				break;
+			}
+			if (i + k < cur.count && list_eq(&cur, i + k, &old, j)) {
+				while (ok && k--)
+					ok = diff_op(&out, 0, i++);
+				break;
+			}
+		}
+		if (k <= PUBNUB_DELTA_LOOKAHEAD)
+			continue;
+
+		/* a changed line */
+		ok = diff_op(&out, -1, 0) && diff_op(&out, 0, i);
+		i++;
+		j++;
+	}
+
+	ve_free(old.line);
+	ve_free(cur.line);
+
+	return ok ? out.n : -1;
+}
+
+/* rough size of the diff in json, to compare it with sending all lines */
+size_t pubnub_deltaSize(struct PubnubDeltaOp const* ops, int n, Str const* lines)
+{
+	struct LineList cur;
+	size_t size = 0;
+
+	if (!list_init(&cur, lines))
+		return (size_t) -1;
+
+	for (; n--; ops++)
+		size += (ops->n ? 5 : strlen(cur.line[ops->line]) + 3);
+
+	ve_free(cur.line);
+	return size;
+}
+
+veBool pubnub_deltaGen(yajl_gen g, struct PubnubDeltaOp const* ops, int n, Str const* lines)
+{
+	struct LineList cur;
+	veBool ok = veTrue;
+
+	if (!list_init(&cur, lines))
+		return veFalse;
+
+	for (; ok && n--; ops++) {
+		if (ops->n)
+			ok = yajl_gen_integer(g, ops->n) == yajl_gen_status_ok;
+		else
+			ok = yajl_gen_string(g, (u8 const*) cur.line[ops->line],
+							strlen(cur.line[ops->line])) == yajl_gen_status_ok;
+	}
+
+	ve_free(cur.line);
+	return ok;
+}
+
+/*
+ * Reference decoder, for the receiving side. Applies the json array diff to
+ * the lines of base, out is initialised with the resulting lines.
+ */
+struct DiffIn {
+	struct LineList old;
+	u16 pos;				/* next line of old */
+	Str* out;
+	int level;
+};
+
+static int apply_number(void *ctx, const char *buf, size_t len)
+{
+	struct DiffIn* in = (struct DiffIn*) ctx;
+	char tmp[8];
+	int n;
+
+	if (in->level != 1 || len >= sizeof(tmp))
+		return 0;
+	memcpy(tmp, buf, len);
+	tmp[len] = 0;
+	n = atoi(tmp);
+
+	if (n < 0) {
+		if (in->pos - n > in->old.count)
+			return 0;
+		in->pos -= n;
+		return 1;
+	}
+
+	if (n == 0 || in->pos + n > in->old.count)
+		return 0;
+	while (n--) {
+		str_addn(in->out, in->old.line[in->pos], strlen(in->old.line[in->pos]) + 1);
+		in->pos++;
+	}
+	return !in->out->error;
+}
+
+static int apply_string(void *ctx, const u8 *buf, size_t len)
+{
+	struct DiffIn* in = (struct DiffIn*) ctx;
+
+	if (in->level != 1 || memchr(buf, 0, len))
+		return 0;
+	str_addn(in->out, (char const*) buf, len);
+	str_addn(in->out, "", 1);
+	return !in->out->error;
+}
+
+static int apply_open(void *ctx)
+{
+	return ++((struct DiffIn*) ctx)->level == 1;
+}
+
+static int apply_close(void *ctx)
+{
+	((struct DiffIn*) ctx)->level--;
+	return 1;
+}
+
+static yajl_callbacks applyCallbacks = {
+	NULL,
+	NULL,
+	NULL,
+	NULL,
+	apply_number,
+	apply_string,
+	NULL,
+	NULL,
+	NULL,
+	apply_open,
+	apply_close
+};
+
+veBool pubnub_deltaApply(Str const* base, char const* diff, size_t len, Str* out)
+{
+	struct DiffIn in;
+	yajl_handle yajl;
+	veBool ret;
+
+	if (!list_init(&in.old, base))
+		return veFalse;
+	in.pos = 0;
+	in.out = out;
+	in.level = 0;
+	str_new(out, 256, 256);
+
+	yajl = yajl_alloc(&applyCallbacks, NULL, &in);
+	ret =	yajl != NULL &&
+			yajl_parse(yajl, (u8 const*) diff, len) == yajl_status_ok &&
+			yajl_complete_parse(yajl) == yajl_status_ok;
+	if (yajl)
+		yajl_free(yajl);
+	ve_free(in.old.line);
+
+	return ret && !out->error;
+}
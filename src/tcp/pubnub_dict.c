@@ -0,0 +1,180 @@
+/*
+ * Copyright (c) 2012 All rights reserved.
+ * Jeroen Hofstee, Victron Energy, jhofstee@victronenergy.com.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#define VE_MOD	VE_MOD_PUBNUBAT
+
+#include <platform.h>
+
+#include <pubnub_dict.h>
+#include <ve_trace.h>
+
+#define DICT_ESC	'~'
+
+struct DictEntry {
+	char const* str;
+	u8 len;
+};
+
+#define D(s)	{s, sizeof(s) - 1}
+
+/*
+ * Version 1, taken from the answers of the V commands and the register
+ * names. An entry must be at least as long as its code, "\r\n" is since
+ * it is escaped in json. Entries may only be appended or the version must be changed, the
+ * other side must use the same table. The position in dictCodes is the code
+ * of the entry, so there are at most 62.
+ */
+static struct DictEntry const dict[] = {
+	D("\r\nOK\r\n"),
+	D("\r\nERROR\r\n"),
+	D("\r\n+CME ERROR: "),
+	D("\r\n"),
+	D("AT+VREG"),
+	D("AT+VIND"),
+	D("AT+VLIST"),
+	D("AT+VERR"),
+	D("AT+VWRN"),
+	D("AT+VWIPDUMP"),
+	D("+VREG: "),
+	D("+VIND: "),
+	D("+VLIST: "),
+	D("+VERR: "),
+	D("+VWRN: "),
+	D("AT+CSQ"),
+	D("AT+CREG"),
+	D("AT+CGREG"),
+	D("+CSQ: "),
+	D("+CREG: "),
+	D("+CGREG: "),
+	D("pubnub."),
+	D("channel."),
+	D("publish"),
+	D("subscribe"),
+	D("timetoken"),
+	D("origin"),
+	D("journal"),
+	D("cache"),
+	D("trace.port"),
+	D("common"),
+	D("PUBNUB"),
+	D("VHTTPC"),
+	D("0x0000"),
+	D("00000"),
+	D("\",\""),
+	D("\","),
+	D(",\""),
+	D(",0,"),
+	D(",1,"),
+	D("ERROR"),
+	D("my_channel"),
+	D("invalid"),
+	D("no such "),
+	D("Command must be numeric")
+};
+
+static char const dictCodes[] =
+	"0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+
+#define DICT_ENTRIES	(sizeof(dict) / sizeof(dict[0]))
+
+/* the longest entry at the start of in, -1 if none */
+static int dict_match(char const* in, size_t len)
+{
+	int best = -1;
+	u8 n;
+
+	for (n = 0; n < DICT_ENTRIES; n++) {
+		if (dict[n].str[0] != *in || dict[n].len > len)
+			continue;
+		if (best >= 0 && dict[n].len <= dict[best].len)
+			continue;
+		if (memcmp(dict[n].str, in, dict[n].len) == 0)
+			best = n;
+	}
+	return best;
+}
+
+/* appends the coded in to out, check out->error afterwards */
+void pubnub_dictEncode(char const* in, size_t len, Str* out)
+{
+	char code[2];
+	size_t start = 0;
+	size_t n = 0;
+	int entry;
+
+	code[0] = DICT_ESC;
+	while (n < len) {
+		entry = (in[n] == DICT_ESC ? -1 : dict_match(in + n, len - n));
+		if (in[n] != DICT_ESC && entry < 0) {
+			n++;
+			continue;
+		}
+
+		str_addn(out, in + start, n - start);
+		if (entry >= 0) {
+			code[1] = dictCodes[entry];
+			n += dict[entry].len;
+		} else {
+			code[1] = DICT_ESC;
+			n++;
+		}
+		str_addn(out, code, 2);
+		start = n;
+	}
+	str_addn(out, in + start, n - start);
+}
+
+/* appends the decoded in to out, veFalse if it is not validly coded */
+veBool pubnub_dictDecode(char const* in, size_t len, Str* out)
+{
+	char const* code;
+	size_t start = 0;
+	size_t n = 0;
+
+	while (n < len) {
+		if (in[n] != DICT_ESC) {
+			n++;
+			continue;
+		}
+
+		str_addn(out, in + start, n - start);
+		if (n + 1 == len)
+			return veFalse;
+		if (in[n + 1] == DICT_ESC) {
+			str_addn(out, in + n, 1);
+		} else {
+			code = (in[n + 1] ? strchr(dictCodes, in[n + 1]) : NULL);
+			if (!code || (size_t) (code - dictCodes) >= DICT_ENTRIES)
+				return veFalse;
+			str_addn(out, dict[code - dictCodes].str, dict[code - dictCodes].len);
+		}
+		n += 2;
+		start = n;
+	}
+	str_addn(out, in + start, n - start);
+
+	return !out->error;
+}
@@ -0,0 +1,622 @@
+/*
+ * Copyright (c) 2012 All rights reserved.
+ * Jeroen Hofstee, Victron Energy, jhofstee@victronenergy.com.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#define VE_MOD	VE_MOD_PUBNUBFRAG
+
+#include <platform.h>
+#ifndef __OAT_API_VERSION__
+#include <time.h>
+#endif
+
+#include <pubnub_at.h>
+#include <pubnub_frag.h>
+#include <ve_trace.h>
+#include <yajl/yajl_gen.h>
+
+#define BIT_SET(a, n)	((a)[(n) >> 3] |= (u8) (1 << ((n) & 7)))
+#define BIT_CLR(a, n)	((a)[(n) >> 3] &= (u8) ~(1 << ((n) & 7)))
+#define BIT_GET(a, n)	(((a)[(n) >> 3] >> ((n) & 7)) & 1)
+
+static char const base64Chars[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static void out_start(struct PubnubFrag* frag);
+static void out_flush(struct PubnubFrag* frag);
+
+/* the number of bytes c takes in a json string */
+static u8 json_escaped(u8 c)
+{
+	if (c == '"' || c == '\\' || c == '\b' || c == '\f' || c == '\n' || c == '\r' || c == '\t')
+		return 2;
+	return (c < 0x20 ? 6 : 1);
+}
+
+/*
+ * Splits data in parts of at most PUBNUB_FRAG_DATA bytes once escaped, utf-8
+ * sequences are kept together. Returns the number of parts, offset is set to
+ * the start of each part and the end when not NULL.
+ */
+static u32 frag_split(char const* data, u32 len, u32* offset)
+{
+	u32 count = 0;
+	u32 pos = 0;
+	u32 escaped;
+	u32 end;
+
+	while (pos < len) {
+		escaped = 0;
+		for (end = pos; end < len && escaped + json_escaped(data[end]) <= PUBNUB_FRAG_DATA; end++)
+			escaped += json_escaped(data[end]);
+		while (end < len && end > pos + 1 && ((u8) data[end] & 0xC0) == 0x80)
+			end--;
+		if (offset)
+			offset[count] = pos;
+		count++;
+		pos = end;
+	}
+	if (offset)
+		offset[count] = len;
+
+	return count;
+}
+
+static void base64(u8 const* in, u32 len, char* out)
+{
+	u32 v;
+	u32 n;
+
+	for (n = 0; n < len; n += 3) {
+		v = (u32) in[n] << 16;
+		if (n + 1 < len)
+			v |= (u32) in[n + 1] << 8;
+		if (n + 2 < len)
+			v |= in[n + 2];
+		*out++ = base64Chars[(v >> 18) & 0x3F];
+		*out++ = base64Chars[(v >> 12) & 0x3F];
+		*out++ = (n + 1 < len ? base64Chars[(v >> 6) & 0x3F] : '=');
+		*out++ = (n + 2 < len ? base64Chars[v & 0x3F] : '=');
+	}
+}
+
+/* {"origin":"<origin>", */
+static veBool gen_open(struct PubnubFrag* frag, yajl_gen g)
+{
+	struct PubnubAt* nubat = frag->nubat;
+	veBool ok = yajl_gen_map_open(g) == yajl_gen_status_ok;
+
+	if (ok && nubat->tagResponses)
+		ok =	yajl_gen_string(g, (u8*) "origin", 6) == yajl_gen_status_ok &&
+				yajl_gen_string(g, (u8*) nubat->origin, strlen(nubat->origin)) == yajl_gen_status_ok;
+	return ok;
+}
+
+static veBool gen_int(yajl_gen g, char const* key, long value)
+{
+	return	yajl_gen_string(g, (u8 const*) key, strlen(key)) == yajl_gen_status_ok &&
+			yajl_gen_integer(g, value) == yajl_gen_status_ok;
+}
+
+/* }, published, a copy which was not sent before it is resent is dropped */
+static void gen_publish(struct PubnubFrag* frag, yajl_gen g, veBool ok)
+{
+	u8 const *json;
+	size_t json_len;
+
+	if (	!ok || yajl_gen_map_close(g) != yajl_gen_status_ok ||
+			yajl_gen_get_buf(g, &json, &json_len) != yajl_gen_status_ok)
+		ve_error("json: could not build message");
+	else
+		pubnub_journalAdd(&frag->nubat->journal, (char const*) json, PUBNUB_FRAG_RTO);
+}
+
+/* {"origin":"<origin>","frag":<id>,"seq":<seq>,"of":<count>,"data":"<part>"} */
+static veBool gen_fragment(struct PubnubFrag* frag, yajl_gen g, struct PubnubFragOut* out, u16 seq)
+{
+	veBool ok;
+
+	ok =	gen_open(frag, g) &&
+			gen_int(g, "frag", out->id) &&
+			gen_int(g, "seq", seq) &&
+			gen_int(g, "of", out->count);
+	if (ok && out->binary)
+		ok =	yajl_gen_string(g, (u8*) "b64", 3) == yajl_gen_status_ok &&
+				yajl_gen_bool(g, 1) == yajl_gen_status_ok;
+	return	ok &&
+			yajl_gen_string(g, (u8*) "data", 4) == yajl_gen_status_ok &&
+			yajl_gen_string(g, (u8*) out->data + out->offset[seq],
+					out->offset[seq + 1] - out->offset[seq]) == yajl_gen_status_ok &&
+			yajl_gen_map_close(g) == yajl_gen_status_ok;
+}
+
+static void out_sent(struct PubnubRequest* req, NubEv ev,
+									char const* buf, int buf_len, void *ctx)
+{
+	struct PubnubFrag* frag = (struct PubnubFrag*) req;
+
+	if (ev != NUB_DONE)
+		return;
+
+	/* lost ones are sent again when the acknowledgement tells */
+	frag->busy = veFalse;
+	out_flush(frag);
+}
+
+/* the escaped json is urlencoded straight into the request */
+static void out_print(void* ctx, char const* str, size_t len)
+{
+	str_addUrlEncN((Str*) ctx, str, len);
+}
+
+/*
+ * Publish up to PUBNUB_FRAG_BATCH of the pending fragments of the transfer
+ * being sent, as a json array when there are more. The rest waits till this
+ * publish is done, meanwhile more may become pending.
+ */
+static void out_flush(struct PubnubFrag* frag)
+{
+	struct PubnubFragOut* out = frag->out;
+	yajl_gen g;
+	veBool ok = veTrue;
+	u16 seq;
+	u8 n = 0;
+
+	if (frag->busy || !out)
+		return;
+
+	for (seq = out->acks; seq < out->sent && n < PUBNUB_FRAG_BATCH; seq++)
+		if (BIT_GET(out->pending, seq) && !BIT_GET(out->acked, seq))
+			n++;
+	if (!n)
+		return;
+
+	g = yajl_gen_alloc(NULL);
+	if (!g)
+		return;
+	yajl_gen_config(g, yajl_gen_print_callback, out_print,
+				pubnub_publishBegin(&frag->req, frag->nubat->nub.pubChannel));
+
+	if (n > 1)
+		ok = yajl_gen_array_open(g) == yajl_gen_status_ok;
+	for (seq = out->acks, n = 0; ok && seq < out->sent && n < PUBNUB_FRAG_BATCH; seq++) {
+		if (!BIT_GET(out->pending, seq))
+			continue;
+		BIT_CLR(out->pending, seq);
+		if (BIT_GET(out->acked, seq))
+			continue;
+		ok = gen_fragment(frag, g, out, seq);
+		n++;
+	}
+	if (ok && n > 1)
+		ok = yajl_gen_array_close(g) == yajl_gen_status_ok;
+
+	if (!ok) {
+		ve_error("json: could not build message");
+	} else {
+		frag->busy = veTrue;
+		if (pubnub_publishEnd(&frag->req, out_sent) != RET_OK) {
+			ve_error("could not publish, retrying later");
+			frag->busy = veFalse;
+		}
+	}
+	yajl_gen_free(g);
+}
+
+/* publish the fragment, together with others pending when possible */
+static void out_publish(struct PubnubFrag* frag, struct PubnubFragOut* out, u16 seq)
+{
+	BIT_SET(out->pending, seq);
+}
+
+/* send new fragments, as far as the window allows */
+static void out_pump(struct PubnubFrag* frag)
+{
+	struct PubnubFragOut* out = frag->out;
+
+	while (out->sent < out->count && out->sent - out->acks < PUBNUB_FRAG_WINDOW)
+		out_publish(frag, out, out->sent++);
+	out_flush(frag);
+}
+
+/* the first transfer is done or given up, continue with the next one */
+static void out_done(struct PubnubFrag* frag)
+{
+	struct PubnubFragOut* out = frag->out;
+
+	ve_timer_cancel(&frag->outTmr);
+	frag->out = out->next;
+	frag->outSize -= out->size;
+	ve_free(out);
+	out_start(frag);
+}
+
+/* no progress for a while, the unacknowledged fragments are sent again */
+static void out_timeout(void* ctx)
+{
+	struct PubnubFrag* frag = (struct PubnubFrag*) ctx;
+	struct PubnubFragOut* out = frag->out;
+	u16 seq;
+
+	if ((s32) (ve_timer_uptime() - out->expires) >= 0) {
+		ve_warning("transfer %d not acknowledged, dropped", out->id);
+		out_done(frag);
+		return;
+	}
+
+	ve_qtrace("transfer %d, resending from %d", out->id, out->acks);
+	for (seq = out->acks; seq < out->sent; seq++)
+		if (!BIT_GET(out->acked, seq))
+			out_publish(frag, out, seq);
+	out_flush(frag);
+	ve_timer(&frag->outTmr, PUBNUB_FRAG_RTO, out_timeout, frag);
+}
+
+static void out_start(struct PubnubFrag* frag)
+{
+	if (!frag->out)
+		return;
+
+	out_pump(frag);
+	ve_timer(&frag->outTmr, PUBNUB_FRAG_RTO, out_timeout, frag);
+}
+
+/*
+ * Publish data in fragments, it is dropped when not acknowledged within ttl
+ * seconds. Binary data is sent base64 encoded. Transfers are sent one after
+ * the other.
+ */
+veBool pubnub_fragSend(struct PubnubFrag* frag, char const* data, size_t len,
+							veBool binary, u16 ttl)
+{
+	struct PubnubFragOut* out;
+	struct PubnubFragOut** p;
+	u32 textLen = (u32) (binary ? (len + 2) / 3 * 4 : len);
+	u32 count;
+	u32 size;
+
+	/* base64 does not need escaping */
+	if (binary)
+		count = (textLen + PUBNUB_FRAG_DATA - 1) / PUBNUB_FRAG_DATA;
+	else
+		count = frag_split(data, textLen, NULL);
+
+	size = sizeof(*out) + (count + 1) * sizeof(u32) + 2 * ((count + 7) / 8) + textLen + 1;
+	if (!count || count > 0xFFFF || frag->outSize + size > PUBNUB_FRAG_OUT_SIZE) {
+		ve_warning("cannot send %d bytes, %d bytes waiting", len, frag->outSize);
+		return veFalse;
+	}
+
+	out = (struct PubnubFragOut*) ve_malloc(size);
+	if (!out) {
+		ve_error("out of memory, %d bytes dropped", len);
+		return veFalse;
+	}
+
+	out->offset = (u32*) (out + 1);
+	out->acked = (u8*) (out->offset + count + 1);
+	out->pending = out->acked + (count + 7) / 8;
+	out->data = (char*) (out->pending + (count + 7) / 8);
+	memset(out->acked, 0, 2 * ((count + 7) / 8));
+	if (binary)
+		base64((u8 const*) data, (u32) len, out->data);
+	else
+		memcpy(out->data, data, len);
+	out->data[textLen] = 0;
+	frag_split(out->data, textLen, out->offset);
+
+	out->next = NULL;
+	out->id = ++frag->lastId;
+	out->count = (u16) count;
+	out->acks = 0;
+	out->sent = 0;
+	out->binary = binary;
+	out->expires = ve_timer_uptime() + ttl;
+	out->size = size;
+
+	for (p = &frag->out; *p; p = &(*p)->next)
+		;
+	*p = out;
+	frag->outSize += size;
+
+	ve_qtrace("transfer %d, %d bytes in %d fragments", out->id, len, count);
+	if (frag->out == out)
+		out_start(frag);
+
+	return veTrue;
+}
+
+/*
+ * An acknowledgement of the transfer being sent. The fragments before one
+ * which was received have been lost and are sent again directly.
+ */
+void pubnub_fragAcked(struct PubnubFrag* frag, char const* to, u16 id, u16 next,
+							u16 const* sack, u8 sackCount)
+{
+	struct PubnubFragOut* out = frag->out;
+	u16 holes = 0;
+	u16 seq;
+	u8 n;
+
+	if (to && strcmp(to, frag->nubat->origin) != 0)
+		return;
+
+	if (!out || out->id != id || next > out->sent) {
+		ve_qtrace("ignoring acknowledgement of %d", id);
+		return;
+	}
+
+	for (seq = out->acks; seq < next; seq++)
+		BIT_SET(out->acked, seq);
+	for (n = 0; n < sackCount; n++) {
+		if (sack[n] >= out->sent)
+			continue;
+		BIT_SET(out->acked, sack[n]);
+		if (sack[n] >= holes)
+			holes = sack[n] + 1;
+	}
+	while (out->acks < out->count && BIT_GET(out->acked, out->acks))
+		out->acks++;
+
+	if (out->acks == out->count) {
+		ve_qtrace("transfer %d done", out->id);
+		out_done(frag);
+		return;
+	}
+
+	for (seq = out->acks; seq < holes; seq++)
+		if (!BIT_GET(out->acked, seq))
+			out_publish(frag, out, seq);
+	out_pump(frag);
+	ve_timer(&frag->outTmr, PUBNUB_FRAG_RTO, out_timeout, frag);
+}
+
+static void in_free_parts(struct PubnubFragIn* in)
+{
+	u16 n;
+
+	if (in->part) {
+		for (n = 0; n < in->count; n++)
+			ve_free(in->part[n]);
+		ve_free(in->part);
+		in->part = NULL;
+	}
+	in->have = 0;
+	in->size = 0;
+}
+
+static void in_forget(struct PubnubFragIn* in)
+{
+	in_free_parts(in);
+	ve_free(in->origin);
+	in->origin = NULL;
+	in->count = 0;
+	in->done = veFalse;
+	in->ackDue = veFalse;
+}
+
+/* {"origin":"<origin>","ack":<id>,"to":"<sender>","next":<n>,"sack":[..]} */
+static void in_ack(struct PubnubFrag* frag)
+{
+	struct PubnubFragIn* in = &frag->in;
+	yajl_gen g = yajl_gen_alloc(NULL);
+	u16 next = 0;
+	u16 seq;
+	u8 n = 0;
+	veBool ok;
+
+	in->ackDue = veFalse;
+	if (!g)
+		return;
+
+	if (in->done)
+		next = in->count;
+	while (next < in->count && in->part[next])
+		next++;
+
+	ok = gen_open(frag, g) && gen_int(g, "ack", in->id);
+	if (ok && in->origin[0])
+		ok =	yajl_gen_string(g, (u8*) "to", 2) == yajl_gen_status_ok &&
+				yajl_gen_string(g, (u8*) in->origin, strlen(in->origin)) == yajl_gen_status_ok;
+	ok = ok &&	gen_int(g, "next", next) &&
+				yajl_gen_string(g, (u8*) "sack", 4) == yajl_gen_status_ok &&
+				yajl_gen_array_open(g) == yajl_gen_status_ok;
+	for (seq = next + 1; ok && seq < in->count && n < PUBNUB_FRAG_SACK; seq++) {
+		if (!in->part[seq])
+			continue;
+		ok = yajl_gen_integer(g, seq) == yajl_gen_status_ok;
+		n++;
+	}
+	ok = ok && yajl_gen_array_close(g) == yajl_gen_status_ok;
+	gen_publish(frag, g, ok);
+	yajl_gen_free(g);
+}
+
+/* sends a pending acknowledgement, or gives up / forgets the transfer */
+static void in_timeout(void* ctx)
+{
+	struct PubnubFrag* frag = (struct PubnubFrag*) ctx;
+	struct PubnubFragIn* in = &frag->in;
+
+	if (in->ackDue) {
+		in_ack(frag);
+		ve_timer(&frag->inTmr, PUBNUB_FRAG_IDLE, in_timeout, frag);
+		return;
+	}
+
+	if (!in->done)
+		ve_warning("transfer %d incomplete, dropped", in->id);
+	in_forget(in);
+}
+
+static veBool in_start(struct PubnubFragIn* in, char const* origin, u16 id, u16 count)
+{
+	in_forget(in);
+
+	if (!count || count > PUBNUB_FRAG_IN_COUNT) {
+		ve_warning("transfer %d of %d fragments refused", id, count);
+		return veFalse;
+	}
+
+	in->origin = (char*) ve_malloc(strlen(origin) + 1);
+	in->part = (char**) ve_malloc(count * sizeof(char*));
+	if (!in->origin || !in->part) {
+		ve_free(in->origin);
+		ve_free(in->part);
+		in->origin = NULL;
+		in->part = NULL;
+		return veFalse;
+	}
+	strcpy(in->origin, origin);
+	memset(in->part, 0, count * sizeof(char*));
+	in->id = id;
+	in->count = count;
+
+	return veTrue;
+}
+
+/* all fragments are there, handle them as a single message */
+static void in_complete(struct PubnubFrag* frag)
+{
+	struct PubnubFragIn* in = &frag->in;
+	Str msg;
+	u16 n;
+
+	str_new(&msg, in->size + 1, 0);
+	for (n = 0; n < in->count; n++)
+		str_addn(&msg, in->part[n], strlen(in->part[n]));
+
+	in_free_parts(in);
+	in->done = veTrue;
+	in_ack(frag);
+	/* remembered for a while, to acknowledge fragments sent again */
+	ve_timer(&frag->inTmr, PUBNUB_FRAG_IDLE, in_timeout, frag);
+
+	ve_qtrace("transfer %d received, %d bytes", in->id, str_len(&msg));
+	if (msg.error)
+		ve_error("out of memory, transfer %d dropped", in->id);
+	else
+		pubnub_atReceived(frag->nubat, msg.data, str_len(&msg));
+	str_free(&msg);
+}
+
+/*
+ * A fragment of a long message for the device. A single transfer is received
+ * at a time, fragments of others are ignored till it completes and are then
+ * sent again by their sender.
+ */
+void pubnub_fragReceived(struct PubnubFrag* frag, char const* origin, u16 id,
+							u16 seq, u16 count, char const* data, size_t len)
+{
+	struct PubnubFragIn* in = &frag->in;
+	char* part;
+
+	if (!origin)
+		origin = "";
+
+	if (!in->origin || in->id != id || strcmp(in->origin, origin) != 0) {
+		if (in->count && !in->done) {
+			ve_qtrace("receiving transfer %d, ignoring %d", in->id, id);
+			return;
+		}
+		if (!in_start(in, origin, id, count))
+			return;
+	}
+
+	if (count != in->count || seq >= count || memchr(data, 0, len)) {
+		ve_warning("invalid fragment %d of transfer %d", seq, id);
+		return;
+	}
+
+	if (!in->done && !in->part[seq]) {
+		if (in->size + len > PUBNUB_FRAG_IN_SIZE || (part = (char*) ve_malloc(len + 1)) == NULL) {
+			ve_warning("transfer %d too long, dropped", id);
+			ve_timer_cancel(&frag->inTmr);
+			in_forget(in);
+			return;
+		}
+		memcpy(part, data, len);
+		part[len] = 0;
+		in->part[seq] = part;
+		in->have++;
+		in->size += (u32) len;
+	}
+
+	if (!in->done && in->have == in->count) {
+		in_complete(frag);
+		return;
+	}
+
+	if (!in->ackDue) {
+		in->ackDue = veTrue;
+		ve_timer(&frag->inTmr, PUBNUB_FRAG_ACK_DELAY, in_timeout, frag);
+	}
+}
+
+/*
+ * A receiver might still remember the ids used before a restart. The ids
+ * start from the wall clock in seconds, which moves on faster than ids are
+ * used, so they are not used again.
+ */
+static u16 frag_first_id(void)
+{
+#ifdef __OAT_API_VERSION__
+	adl_rtcTime_t now;
+
+	adl_rtcGetTime(&now);
+	return (u16) (((now.Day * 24 + now.Hour) * 60 + now.Minute) * 60 + now.Second);
+#else
+	return (u16) time(NULL);
+#endif
+}
+
+void pubnub_fragInit(struct PubnubFrag* frag, struct PubnubAt* nubat)
+{
+	frag->nubat = nubat;
+	pubnub_req_init(&nubat->nub, &frag->req, 1024, 1024);
+	frag->busy = veFalse;
+	frag->lastId = frag_first_id();
+	frag->out = NULL;
+	frag->outSize = 0;
+	frag->in.origin = NULL;
+	frag->in.part = NULL;
+	frag->in.count = 0;
+	in_forget(&frag->in);
+}
+
+void pubnub_fragDeinit(struct PubnubFrag* frag)
+{
+	struct PubnubFragOut* out;
+
+	ve_timer_cancel(&frag->outTmr);
+	ve_timer_cancel(&frag->inTmr);
+	while (frag->out) {
+		out = frag->out;
+		frag->out = out->next;
+		ve_free(out);
+	}
+	frag->outSize = 0;
+	in_forget(&frag->in);
+	pubnub_req_deinit(&frag->req);
+}
@@ -0,0 +1,388 @@
+/*
+ * Copyright (c) 2012 All rights reserved.
+ * Jeroen Hofstee, Victron Energy, jhofstee@victronenergy.com.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#define VE_MOD	VE_MOD_PUBNUBJOURNAL
+
+#include <platform.h>
+
+#include <pubnub_journal.h>
+#include <ve_trace.h>
+
+#define JOURNAL_FLASH	"pubnub.journal"
+
+/* stored before each message in flash: ttl left and length, both u16 */
+#define JOURNAL_REC_HDR	4
+
+static void journal_send(struct PubnubJournal* journal);
+
+/* own is a buffer taken over, else json is copied */
+static void journal_append(struct PubnubJournal* journal, char const* json, u16 len,
+								u16 ttl, char* own)
+{
+	struct PubnubJournalMsg* msg;
+	u32 now = ve_timer_uptime();
+
+	msg = (struct PubnubJournalMsg*) ve_malloc(sizeof(*msg) + (own ? 0 : len + 1));
+	if (!msg) {
+		ve_error("out of memory, message dropped");
+		ve_free(own);
+		return;
+	}
+	if (own) {
+		msg->json = own;
+	} else {
+		msg->json = (char*) (msg + 1);
+		memcpy(msg->json, json, len);
+		msg->json[len] = 0;
+	}
+	msg->len = len;
+	msg->queued = now;
+	msg->expires = now + ttl;
+	msg->next = NULL;
+
+	if (journal->tail)
+		journal->tail->next = msg;
+	else
+		journal->head = msg;
+	journal->tail = msg;
+	journal->size += len;
+	journal->dirty = veTrue;
+}
+
+/* *p is not underway, prev is the message before it or NULL */
+static void journal_remove(struct PubnubJournal* journal, struct PubnubJournalMsg** p,
+								struct PubnubJournalMsg* prev)
+{
+	struct PubnubJournalMsg* msg = *p;
+
+	*p = msg->next;
+	if (journal->tail == msg)
+		journal->tail = prev;
+	journal->size -= msg->len;
+	journal->dirty = veTrue;
+	if (msg->json != (char*) (msg + 1))
+		ve_free(msg->json);
+	ve_free(msg);
+}
+
+/* the messages which are not underway */
+static struct PubnubJournalMsg** journal_waiting(struct PubnubJournal* journal,
+								struct PubnubJournalMsg** prev)
+{
+	struct PubnubJournalMsg** p = &journal->head;
+	u8 n;
+
+	*prev = NULL;
+	for (n = 0; n < journal->inFlight; n++) {
+		*prev = *p;
+		p = &(*p)->next;
+	}
+	return p;
+}
+
+/* stale data is dropped instead of sent */
+static void journal_expire(struct PubnubJournal* journal)
+{
+	struct PubnubJournalMsg* prev;
+	struct PubnubJournalMsg** p = journal_waiting(journal, &prev);
+	u32 now = ve_timer_uptime();
+	u16 expired = 0;
+
+	while (*p) {
+		if ((s32) (now - (*p)->expires) >= 0) {
+			journal_remove(journal, p, prev);
+			expired++;
+		} else {
+			prev = *p;
+			p = &(*p)->next;
+		}
+	}
+
+	if (expired)
+		ve_qtrace("%d messages expired", expired);
+}
+
+static veBool journal_drop_oldest(struct PubnubJournal* journal)
+{
+	struct PubnubJournalMsg* prev;
+	struct PubnubJournalMsg** p = journal_waiting(journal, &prev);
+
+	if (!*p)
+		return veFalse;
+
+	journal_remove(journal, p, prev);
+	journal->dropped++;
+	return veTrue;
+}
+
+/* write the waiting messages to flash, replacing what was stored */
+static void journal_store(struct PubnubJournal* journal)
+{
+	struct PubnubJournalMsg* msg;
+	u32 now = ve_timer_uptime();
+	u32 ttl;
+	u16 len = 0;
+	u8* buf;
+	u8* p;
+
+	for (msg = journal->head; msg; msg = msg->next)
+		len += JOURNAL_REC_HDR + msg->len;
+
+	buf = (u8*) ve_malloc(len);
+	if (!buf)
+		return;
+
+	for (p = buf, msg = journal->head; msg; msg = msg->next) {
+		ttl = ((s32) (msg->expires - now) > 0 ? msg->expires - now : 0);
+		ttl = MIN(ttl, 0xFFFF);
+		*p++ = (u8) (ttl >> 8);
+		*p++ = (u8) ttl;
+		*p++ = (u8) (msg->len >> 8);
+		*p++ = (u8) msg->len;
+		memcpy(p, msg->json, msg->len);
+		p += msg->len;
+	}
+
+	if (adl_flhWrite((char*) journal->flash, 0, len, buf) == OK) {
+		ve_qtrace("stored %d bytes", len);
+		journal->stored = veTrue;
+		journal->dirty = veFalse;
+	} else {
+		ve_error("could not store the journal");
+	}
+	ve_free(buf);
+}
+
+/* the time the device was off does not count for the ttl */
+static void journal_load(struct PubnubJournal* journal)
+{
+	s32 length = adl_flhExist((char*) journal->flash, 0);
+	u8* buf;
+	u8* p;
+	u16 ttl;
+	u16 len;
+
+	if (length <= 0)
+		return;
+
+	buf = (u8*) ve_malloc(length);
+	if (!buf)
+		return;
+
+	if (adl_flhRead((char*) journal->flash, 0, (u16) length, buf) == OK) {
+		for (p = buf; p + JOURNAL_REC_HDR <= buf + length; p += len) {
+			ttl = (p[0] << 8) | p[1];
+			len = (p[2] << 8) | p[3];
+			p += JOURNAL_REC_HDR;
+			if (p + len > buf + length || journal->size + len > PUBNUB_JOURNAL_SIZE)
+				break;
+			journal_append(journal, (char const*) p, len, ttl, NULL);
+		}
+		ve_qtrace("loaded %d bytes", journal->size);
+		journal->stored = veTrue;
+		journal->dirty = veFalse;
+	}
+	ve_free(buf);
+}
+
+static void journal_sync(void* ctx)
+{
+	struct PubnubJournal* journal = (struct PubnubJournal*) ctx;
+
+	journal->syncArmed = veFalse;
+	journal_send(journal);
+	if (!journal->head)
+		return;
+
+	/* a backlog, the connection is probably down */
+	if (	journal->flash && journal->dirty &&
+			ve_timer_uptime() - journal->head->queued >= PUBNUB_JOURNAL_SYNC)
+		journal_store(journal);
+
+	journal->syncArmed = veTrue;
+	ve_timer_slack(&journal->syncTmr, PUBNUB_JOURNAL_SYNC * 1000, PUBNUB_JOURNAL_SYNC_SLACK * 1000,
+					journal_sync, journal);
+}
+
+static void journal_sent(struct PubnubRequest* req, NubEv ev,
+									char const* buf, int buf_len, void *ctx)
+{
+	struct PubnubJournal* journal = (struct PubnubJournal*) req;
+
+	if (ev != NUB_DONE)
+		return;
+
+	while (journal->inFlight) {
+		journal->inFlight--;
+		journal_remove(journal, &journal->head, NULL);
+	}
+	journal->busy = veFalse;
+
+	if (journal->dropped) {
+		ve_warning("journal full, %d messages dropped", journal->dropped);
+		journal->dropped = 0;
+	}
+
+	journal_send(journal);
+}
+
+/*
+ * Publish the oldest messages. As many as fit in PUBNUB_JOURNAL_BATCH are
+ * sent at once, as a json array, when more than one is waiting. They are
+ * urlencoded straight into the request.
+ */
+static void journal_send(struct PubnubJournal* journal)
+{
+	struct PubnubJournalMsg* msg;
+	u16 len = 0;
+	u8 n = 0;
+	u8 i;
+	Str* s;
+
+	if (journal->busy)
+		return;
+
+	journal_expire(journal);
+	if (!journal->head) {
+		if (journal->stored) {
+			adl_flhErase((char*) journal->flash, 0);
+			journal->stored = veFalse;
+		}
+		return;
+	}
+
+	for (msg = journal->head; msg && n < 0xFF; msg = msg->next, n++) {
+		if (n && len + msg->len + 1 > PUBNUB_JOURNAL_BATCH)
+			break;
+		len += msg->len + 1;
+	}
+
+	s = pubnub_publishBegin(&journal->req, journal->nub->pubChannel);
+	if (n > 1)
+		str_addUrlEnc(s, "[");
+	for (i = 0, msg = journal->head; i < n; i++, msg = msg->next) {
+		if (i)
+			str_addUrlEnc(s, ",");
+		str_addUrlEncN(s, msg->json, msg->len);
+	}
+	if (n > 1)
+		str_addUrlEnc(s, "]");
+	journal->inFlight = n;
+
+	journal->busy = veTrue;
+	if (pubnub_publishEnd(&journal->req, journal_sent) != RET_OK) {
+		ve_error("could not publish, retrying later");
+		journal->busy = veFalse;
+		journal->inFlight = 0;
+	}
+}
+
+static veBool journal_add(struct PubnubJournal* journal, char const* json, size_t len,
+								u16 ttl, char* own)
+{
+	if (len > PUBNUB_JOURNAL_BATCH) {
+		ve_error("message too long, %d bytes", len);
+		ve_free(own);
+		return veFalse;
+	}
+
+	journal_expire(journal);
+	while (journal->size + len > PUBNUB_JOURNAL_SIZE) {
+		if (!journal_drop_oldest(journal)) {
+			ve_free(own);
+			return veFalse;
+		}
+	}
+
+	journal_append(journal, json, (u16) len, ttl, own);
+	journal_send(journal);
+
+	if (!journal->syncArmed && journal->head) {
+		journal->syncArmed = veTrue;
+		ve_timer_slack(&journal->syncTmr, PUBNUB_JOURNAL_SYNC * 1000, PUBNUB_JOURNAL_SYNC_SLACK * 1000,
+					journal_sync, journal);
+	}
+
+	return veTrue;
+}
+
+/*
+ * Publish a message, it is dropped when not sent within ttl seconds. When
+ * the journal is full the oldest waiting messages make room.
+ */
+veBool pubnub_journalAdd(struct PubnubJournal* journal, char const* json, u16 ttl)
+{
+	return journal_add(journal, json, strlen(json), ttl, NULL);
+}
+
+/* as pubnub_journalAdd, the buffer of json is taken over instead of copied */
+veBool pubnub_journalAddStr(struct PubnubJournal* journal, Str* json, u16 ttl)
+{
+	char* own = json->data;
+	size_t len = str_len(json);
+
+	if (json->error)
+		return veFalse;
+
+	json->data = NULL;
+	str_free(json);
+	return journal_add(journal, own, len, ttl, own);
+}
+
+/* with persistent set, messages left from before a reboot are sent first */
+void pubnub_journalInit(struct PubnubJournal* journal, struct Pubnub* nub, veBool persistent)
+{
+	journal->nub = nub;
+	pubnub_req_init(nub, &journal->req, 512, 512);
+	journal->busy = veFalse;
+	journal->inFlight = 0;
+	journal->head = NULL;
+	journal->tail = NULL;
+	journal->size = 0;
+	journal->dropped = 0;
+	journal->flash = NULL;
+	journal->stored = veFalse;
+	journal->dirty = veFalse;
+	journal->syncArmed = veFalse;
+
+	if (!persistent)
+		return;
+
+	journal->flash = JOURNAL_FLASH;
+	adl_flhSubscribe((char*) journal->flash, 1);
+	journal_load(journal);
+	journal_send(journal);
+}
+
+void pubnub_journalDeinit(struct PubnubJournal* journal)
+{
+	ve_timer_cancel(&journal->syncTmr);
+	journal->syncArmed = veFalse;
+	journal->inFlight = 0;
+	while (journal->head)
+		journal_remove(journal, &journal->head, NULL);
+	pubnub_req_deinit(&journal->req);
+}
@@ -0,0 +1,278 @@
+/*
+ * Copyright (c) 2012 All rights reserved.
+ * Jeroen Hofstee, Victron Energy, jhofstee@victronenergy.com.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#define VE_MOD	VE_MOD_PUBNUBNAT
+
+#include <platform.h>
+#include <stdlib.h>
+
+#include <pubnub_nat.h>
+#include <ve_timer.h>
+#include <ve_trace.h>
+
+/*
+ * Three kinds of evidence are used:
+ * - a response of the server after t seconds shows the connection survived
+ *   being idle for t seconds.
+ * - when a poll ended without a response and the next one directly returns
+ *   messages which were published while the previous one was listening, the
+ *   previous connection was already dead. The time tokens are the server time
+ *   in 100ns units, so they tell how long it was listening till then.
+ * - a probe: after t seconds of a poll the device publishes a message to
+ *   itself. When it does not come back through the subscribe within
+ *   PUBNUB_NAT_QUICK seconds, the connection did not survive t seconds.
+ *   When it does, the response is evidence of the first kind.
+ *
+ * An idle device only gets the first kind of evidence from its probes. They
+ * search between the longest idle time which survived and the shortest which
+ * failed, each poll, till they are close. After that every NAT_PROBE_POLLS a
+ * probe checks whether the failure still stands, so the estimate follows a
+ * network which got better.
+ *
+ * The poll is ended by the client somewhat before the shortest failure seen.
+ */
+#define NAT_QUICK			PUBNUB_NAT_QUICK	/* seconds, a direct response */
+#define NAT_SLACK			5u		/* seconds, timing uncertainty */
+#define NAT_PROBE_POLLS		10
+
+/* seconds part of a time token, 0 if unknown */
+static u32 token_seconds(char const* token)
+{
+	char buf[11];
+	size_t len = strlen(token);
+
+	if (len <= 7 || len - 7 >= sizeof(buf))
+		return 0;
+
+	memcpy(buf, token, len - 7);
+	buf[len - 7] = 0;
+	return strtoul(buf, NULL, 10);
+}
+
+/* the value of net in "net:good:bad;net:good:bad" */
+static char const* entry_find(char const* stored, char const* net)
+{
+	size_t len = strlen(net);
+	char const* p = stored;
+
+	while (p && *p) {
+		if (strncmp(p, net, len) == 0 && p[len] == ':')
+			return p + len + 1;
+		p = strchr(p, ';');
+		if (p)
+			p++;
+	}
+	return NULL;
+}
+
+static void nat_good(struct PubnubNat* nat, u32 t)
+{
+	if (t <= nat->good)
+		return;
+
+	if (t >= nat->good + NAT_SLACK)
+		nat->changed = veTrue;
+	nat->good = (u16) t;
+
+	if (nat->bad && nat->good >= nat->bad) {
+		ve_qtrace("%s: idle for %ds survived, forgetting %ds", nat->net, t, nat->bad);
+		nat->bad = 0;
+		nat->changed = veTrue;
+	}
+}
+
+static void nat_bad(struct PubnubNat* nat, u32 t)
+{
+	if (t < PUBNUB_NAT_MIN)
+		t = PUBNUB_NAT_MIN;
+	if (nat->bad && t >= nat->bad)
+		return;
+
+	ve_warning("%s: idle connection lost within %ds", nat->net, t);
+	nat->bad = (u16) t;
+	/* the network changed, the recent failure counts */
+	if (nat->good >= nat->bad)
+		nat->good = nat->bad - NAT_SLACK;
+	nat->changed = veTrue;
+}
+
+/*
+ * stored is the pubnub.nat register, "net:good:bad;...". Characters of net
+ * which would break that are replaced.
+ */
+void pubnub_natInit(struct PubnubNat* nat, char const* net, char const* stored)
+{
+	char const* p;
+	char *end;
+	size_t n;
+
+	for (n = 0; net[n] && n < sizeof(nat->net) - 1; n++)
+		nat->net[n] = (strchr(":; ", net[n]) ? '_' : net[n]);
+	nat->net[n] = 0;
+
+	p = entry_find(stored, nat->net);
+	nat->good = 0;
+	nat->bad = 0;
+	nat->polls = 0;
+	nat->probe = 0;
+	nat->polling = veFalse;
+	nat->start = 0;
+	nat->startToken = 0;
+	nat->aborted = 0;
+	nat->changed = veFalse;
+
+	if (!p)
+		return;
+
+	nat->good = (u16) strtoul(p, &end, 10);
+	if (*end == ':')
+		nat->bad = (u16) strtoul(end + 1, NULL, 10);
+	ve_qtrace("%s: survived %ds, lost %ds", nat->net, nat->good, nat->bad);
+}
+
+/* How long to poll before reconnecting, 0 if there is no need to */
+u16 pubnub_natTimeout(struct PubnubNat* nat)
+{
+	u16 limit;
+
+	if (!nat->bad)
+		return 0;
+
+	limit = nat->bad - nat->bad / 4;
+	if (limit < nat->good)
+		limit = nat->good;
+	if (limit < PUBNUB_NAT_MIN)
+		limit = PUBNUB_NAT_MIN;
+	if (limit > PUBNUB_NAT_MAX)
+		limit = PUBNUB_NAT_MAX;
+	return limit;
+}
+
+/*
+ * The idle time the poll being started should test with a probe, 0 for
+ * none. Called after pubnub_natPollStart.
+ */
+u16 pubnub_natProbe(struct PubnubNat* nat)
+{
+	u16 lo = MAX(nat->good, PUBNUB_NAT_MIN);
+	u16 hi = (nat->bad ? nat->bad : PUBNUB_NAT_MAX);
+
+	nat->probe = 0;
+	nat->polls++;
+
+	if (!nat->bad && nat->good >= PUBNUB_NAT_MAX)
+		return 0;
+
+	if (!nat->bad)
+		nat->probe = PUBNUB_NAT_MAX;				/* is there a limit at all? */
+	else if (hi > lo + 2 * NAT_SLACK)
+		nat->probe = lo + (hi - lo) / 2;			/* still searching */
+	else if (nat->polls >= NAT_PROBE_POLLS)
+		nat->probe = MIN(nat->bad, PUBNUB_NAT_MAX);	/* does it still fail? */
+
+	if (nat->probe) {
+		nat->polls = 0;
+		ve_qtrace("%s: probing %ds idle", nat->net, nat->probe);
+	}
+	return nat->probe;
+}
+
+/* the probe did not come back, the poll is ended by the client */
+void pubnub_natProbeLost(struct PubnubNat* nat)
+{
+	if (!nat->probe)
+		return;
+
+	nat_bad(nat, nat->probe);
+	nat->probe = 0;
+	nat->polling = veFalse;
+}
+
+void pubnub_natPollStart(struct PubnubNat* nat, char const* token)
+{
+	nat->polling = veTrue;
+	nat->start = ve_timer_uptime();
+	nat->startToken = token_seconds(token);
+}
+
+/* the poll ended without a response, by the client or by an error */
+void pubnub_natPollAbort(struct PubnubNat* nat)
+{
+	if (!nat->polling)
+		return;
+	nat->polling = veFalse;
+
+	nat->aborted = (u16) MIN(ve_timer_uptime() - nat->start, 0xFFFF);
+	nat->probe = 0;
+}
+
+/* a response was received, token is the new time token */
+void pubnub_natPollDone(struct PubnubNat* nat, char const* token, veBool hadMessages)
+{
+	u32 elapsed;
+	u32 published;
+
+	if (!nat->polling)
+		return;
+	nat->polling = veFalse;
+
+	elapsed = ve_timer_uptime() - nat->start;
+
+	/* missed by the previous poll? */
+	if (hadMessages && nat->aborted && nat->startToken && elapsed < NAT_QUICK) {
+		published = token_seconds(token) - nat->startToken;
+		if (published + NAT_SLACK < nat->aborted) {
+			nat->aborted = 0;
+			nat->probe = 0;
+			nat_bad(nat, published);
+			return;
+		}
+	}
+
+	nat->aborted = 0;
+	nat->probe = 0;
+	nat_good(nat, elapsed);
+}
+
+/* replaces the entry of this network in stored, out must be initialised */
+void pubnub_natStore(struct PubnubNat* nat, char const* stored, Str* out)
+{
+	size_t netLen = strlen(nat->net);
+	char const* p = stored;
+	char const* end;
+
+	str_set(out, "");
+	while (p && *p) {
+		end = strchr(p, ';');
+		if (!(strncmp(p, nat->net, netLen) == 0 && p[netLen] == ':')) {
+			str_addn(out, p, end ? (size_t) (end - p) : strlen(p));
+			str_addc(out, ';');
+		}
+		p = (end ? end + 1 : NULL);
+	}
+	str_addf(out, "%s:%d:%d", nat->net, nat->good, nat->bad);
+	nat->changed = veFalse;
+}
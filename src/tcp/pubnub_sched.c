@@ -0,0 +1,352 @@
+/*
+ * Copyright (c) 2012 All rights reserved.
+ * Jeroen Hofstee, Victron Energy, jhofstee@victronenergy.com.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#define VE_MOD	VE_MOD_PUBNUBSCHED
+
+#include <platform.h>
+#include <stdlib.h>
+
+#include <dev_reg_app.h>
+#include <pubnub_at.h>
+#include <pubnub_sched.h>
+#include <ve_at.h>
+#include <ve_trace.h>
+
+static void sched_next(struct PubnubSched* sched);
+
+/* "<interval>[,<threshold>]:<cmd>" */
+static void sched_load(struct PubnubSched* sched, char const* config)
+{
+	struct PubnubSchedEntry* entry;
+	u32 threshold = 0;
+	u32 interval;
+	char* p;
+
+	if (!config || !*config)
+		return;
+
+	interval = strtoul(config, &p, 10);
+	if (*p == ',')
+		threshold = strtoul(p + 1, &p, 10);
+	if (*p != ':' || !p[1] || interval == 0 || interval > 0xFFFF || threshold > 0xFFFF) {
+		ve_warning("sched: ignoring invalid entry '%s'", config);
+		return;
+	}
+	p++;
+
+	entry = &sched->entries[sched->count];
+	entry->sched = sched;
+	entry->cmd = (char*) ve_malloc(strlen(p) + 1);
+	if (!entry->cmd)
+		return;
+	strcpy(entry->cmd, p);
+	entry->interval = (u16) MAX(interval, PUBNUB_SCHED_MIN);
+	entry->threshold = (u16) threshold;
+	entry->due = ve_timer_uptime() + entry->interval;
+	entry->last.data = NULL;
+	entry->last.error = veTrue;
+	entry->reported = veFalse;
+	entry->stale = 0;
+	sched->count++;
+}
+
+static veBool num_start(char const* p)
+{
+	return isdigit((u8) *p) || (*p == '-' && isdigit((u8) p[1]));
+}
+
+/* other text must be equal, numbers may differ up to threshold */
+static veBool line_changed(char const* a, char const* b, u16 threshold)
+{
+	char* endA;
+	char* endB;
+	long diff;
+
+	while (*a && *b) {
+		if (num_start(a) && num_start(b)) {
+			diff = strtol(a, &endA, 10) - strtol(b, &endB, 10);
+			if (labs(diff) > threshold)
+				return veTrue;
+			a = endA;
+			b = endB;
+			continue;
+		}
+		if (*a++ != *b++)
+			return veTrue;
+	}
+	return *a != *b;
+}
+
+static veBool answer_changed(Str const* last, Str const* lines, u16 threshold)
+{
+	char const* a = last->data;
+	char const* b = lines->data;
+	char const* endA = a + str_len(last);
+	char const* endB = b + str_len(lines);
+
+	for (; a < endA && b < endB; a += strlen(a) + 1, b += strlen(b) + 1)
+		if (line_changed(a, b, threshold))
+			return veTrue;
+	return a < endA || b < endB;
+}
+
+static veBool gen_str(yajl_gen g, char const* str)
+{
+	return yajl_gen_string(g, (u8 const*) str, strlen(str)) == yajl_gen_status_ok;
+}
+
+/* {"origin":"<origin>","sched":[ the first time */
+static veBool report_begin(struct PubnubSched* sched)
+{
+	struct PubnubAt* nubat = sched->nubat;
+	veBool ok;
+
+	if (sched->report)
+		return veTrue;
+
+	sched->report = yajl_gen_alloc(NULL);
+	if (!sched->report)
+		return veFalse;
+
+	ok = yajl_gen_map_open(sched->report) == yajl_gen_status_ok;
+	if (ok && nubat->tagResponses)
+		ok = gen_str(sched->report, "origin") && gen_str(sched->report, nubat->origin);
+	return	ok && gen_str(sched->report, "sched") &&
+			yajl_gen_array_open(sched->report) == yajl_gen_status_ok;
+}
+
+/* {"cmd":"<cmd>","lines":[..],"final":"<final>"} */
+static veBool report_add(struct PubnubSched* sched, struct PubnubSchedEntry const* entry,
+							Str const* lines)
+{
+	yajl_gen g = sched->report;
+	char const* line = lines->data;
+	char const* end = line + str_len(lines);
+	char const* final = line;
+	veBool ok;
+
+	/* the last line is the final response */
+	while (final + strlen(final) + 1 < end)
+		final += strlen(final) + 1;
+
+	ok =	yajl_gen_map_open(g) == yajl_gen_status_ok &&
+			gen_str(g, "cmd") && gen_str(g, entry->cmd) &&
+			gen_str(g, "lines") && yajl_gen_array_open(g) == yajl_gen_status_ok;
+	for (; ok && line < final; line += strlen(line) + 1)
+		ok = gen_str(g, line);
+	return	ok && yajl_gen_array_close(g) == yajl_gen_status_ok &&
+			gen_str(g, "final") && gen_str(g, final) &&
+			yajl_gen_map_close(g) == yajl_gen_status_ok;
+}
+
+/* ]} and publish the changes of this round */
+static void report_end(struct PubnubSched* sched)
+{
+	u8 const *json;
+	size_t json_len;
+
+	if (!sched->report)
+		return;
+
+	if (	yajl_gen_array_close(sched->report) != yajl_gen_status_ok ||
+			yajl_gen_map_close(sched->report) != yajl_gen_status_ok ||
+			yajl_gen_get_buf(sched->report, &json, &json_len) != yajl_gen_status_ok)
+		ve_error("json: could not finish report");
+	else
+		pubnub_atPublishJson(sched->nubat, (char const*) json, PUBNUB_SCHED_TTL);
+
+	yajl_gen_free(sched->report);
+	sched->report = NULL;
+}
+
+/* trimmed, like the lines of a reply */
+static void lines_add(Str* lines, char const* line)
+{
+	size_t len;
+
+	while (*line == '\r' || *line == '\n')
+		line++;
+	len = strlen(line);
+	while (len && (line[len - 1] == '\r' || line[len - 1] == '\n'))
+		len--;
+	str_addn(lines, line, len);
+	str_addn(lines, "", 1);
+}
+
+/* the running command is done, final is the last of its lines */
+static void sched_done(struct PubnubSched* sched)
+{
+	struct PubnubSchedEntry* entry = sched->running;
+
+	ve_timer_cancel(&sched->cmdTmr);
+	sched->running = NULL;
+	if (sched->lines.error) {
+		ve_error("sched: answer to %s lost", entry->cmd);
+		return;
+	}
+
+	if (entry->reported && !answer_changed(&entry->last, &sched->lines, entry->threshold)) {
+		str_free(&sched->lines);
+		return;
+	}
+
+	if (!report_begin(sched) || !report_add(sched, entry, &sched->lines)) {
+		ve_error("json: could not add %s", entry->cmd);
+		str_free(&sched->lines);
+		return;
+	}
+
+	str_free(&entry->last);
+	entry->last = sched->lines;
+	entry->reported = veTrue;
+	sched->lines.data = NULL;
+	sched->lines.error = veTrue;
+}
+
+static void sched_rspSink(char const* line, veBool terminal, void* ctx)
+{
+	struct PubnubSchedEntry* entry = (struct PubnubSchedEntry*) ctx;
+	struct PubnubSched* sched = entry->sched;
+
+	/* of a run which timed out already */
+	if (entry->stale) {
+		if (terminal)
+			entry->stale--;
+		return;
+	}
+
+	lines_add(&sched->lines, line);
+	if (terminal) {
+		sched_done(sched);
+		sched_next(sched);
+	}
+}
+
+static void sched_timeout(void* ctx)
+{
+	sched_next((struct PubnubSched*) ctx);
+}
+
+/* the answer is ignored once it comes, the other commands go on */
+static void sched_cmdTimeout(void* ctx)
+{
+	struct PubnubSched* sched = (struct PubnubSched*) ctx;
+
+	ve_warning("sched: %s timed out", sched->running->cmd);
+	sched->running->stale++;
+	lines_add(&sched->lines, "TIMEOUT");
+	sched_done(sched);
+	sched_next(sched);
+}
+
+/* wake up when the first command is due */
+static void sched_arm(struct PubnubSched* sched)
+{
+	u32 now = ve_timer_uptime();
+	u32 wait = 0xFFFF;
+	s32 left;
+	u8 n;
+
+	for (n = 0; n < sched->count; n++) {
+		left = (s32) (sched->entries[n].due - now);
+		wait = MIN(wait, (u32) MAX(left, 1));
+	}
+	if (sched->count)
+		ve_timer_slack(&sched->tmr, wait * 1000, PUBNUB_SCHED_SLACK * 1000, sched_timeout, sched);
+}
+
+/* run the commands which are due, one at a time */
+static void sched_next(struct PubnubSched* sched)
+{
+	struct PubnubSchedEntry* entry;
+	u32 now = ve_timer_uptime();
+	u8 n;
+
+	/* local commands can respond before ve_atCmdSendSink returns */
+	if (sched->looping)
+		return;
+
+	sched->looping = veTrue;
+	while (!sched->running) {
+		for (n = 0, entry = NULL; n < sched->count && !entry; n++)
+			if ((s32) (now - sched->entries[n].due) >= 0)
+				entry = &sched->entries[n];
+		if (!entry)
+			break;
+
+		entry->due = now + entry->interval;
+		sched->running = entry;
+		str_new(&sched->lines, 128, 128);
+		ve_timer(&sched->cmdTmr, PUBNUB_SCHED_TIMEOUT, sched_cmdTimeout, sched);
+		if (ve_atCmdSendSink(entry->cmd, veFalse, 0, entry, sched_rspSink) != OK) {
+			lines_add(&sched->lines, "ERROR");
+			sched_done(sched);
+		}
+	}
+	sched->looping = veFalse;
+
+	if (!sched->running) {
+		report_end(sched);
+		sched_arm(sched);
+	}
+}
+
+void pubnub_schedInit(struct PubnubSched* sched, struct PubnubAt* nubat)
+{
+	sched->nubat = nubat;
+	sched->count = 0;
+	sched->running = NULL;
+	sched->looping = veFalse;
+	sched->lines.data = NULL;
+	sched->lines.error = veTrue;
+	sched->report = NULL;
+
+	sched_load(sched, dev_regs.sched1);
+	sched_load(sched, dev_regs.sched2);
+	sched_load(sched, dev_regs.sched3);
+	sched_load(sched, dev_regs.sched4);
+	if (sched->count)
+		ve_qtrace("%d commands scheduled", sched->count);
+	sched_arm(sched);
+}
+
+void pubnub_schedDeinit(struct PubnubSched* sched)
+{
+	struct PubnubSchedEntry* entry;
+
+	ve_timer_cancel(&sched->tmr);
+	ve_timer_cancel(&sched->cmdTmr);
+	while (sched->count) {
+		entry = &sched->entries[--sched->count];
+		ve_free(entry->cmd);
+		str_free(&entry->last);
+	}
+	str_free(&sched->lines);
+	if (sched->report) {
+		yajl_gen_free(sched->report);
+		sched->report = NULL;
+	}
+}
@@ -0,0 +1,278 @@
+/*
+ * Copyright (c) 2012 All rights reserved.
+ * Jeroen Hofstee, Victron Energy, jhofstee@victronenergy.com.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#define VE_MOD	VE_MOD_PUBNUBURC
+
+#include <platform.h>
+#include <stdlib.h>
+
+#include <pubnub_at.h>
+#include <pubnub_urc.h>
+#include <ve_trace.h>
+#include <yajl/yajl_gen.h>
+
+/* unsolicited lines are surrounded by line ends, drop them */
+static char const* urc_trim(char const* line, size_t* len)
+{
+	while (*line == '\r' || *line == '\n')
+		line++;
+	*len = strlen(line);
+	while (*len && (line[*len - 1] == '\r' || line[*len - 1] == '\n'))
+		(*len)--;
+	return line;
+}
+
+/*
+ * Traces of the modules which publish would otherwise cause new traces while
+ * publishing them, and so on. They are not passed to the listeners at all.
+ */
+static VeModule const ownModules[] = {
+	VE_MOD_VHTTPC,
+	VE_MOD_PUBNUB,
+	VE_MOD_PUBNUBAT,
+	VE_MOD_PUBNUBNAT,
+	VE_MOD_PUBNUBURC,
+	VE_MOD_PUBNUBJOURNAL,
+	VE_MOD_PUBNUBFRAG,
+	VE_MOD_PUBNUBSCHED
+};
+
+#define OWN_MODULES		(sizeof(ownModules) / sizeof(ownModules[0]))
+
+static void urc_free_lines(struct PubnubUrc* urc)
+{
+	while (urc->lineCount)
+		ve_free(urc->lines[--urc->lineCount].line);
+	urc->dropped = 0;
+}
+
+/* {"origin":"<origin>","urc":[{"line":"<line>","count":<n>},..],"dropped":<n>} */
+static void urc_flush(void* ctx)
+{
+	struct PubnubUrc* urc = (struct PubnubUrc*) ctx;
+	struct PubnubAt* nubat = urc->nubat;
+	struct PubnubUrcLine* p;
+	yajl_gen g;
+	u8 const *json;
+	size_t json_len;
+	veBool ok;
+
+	ve_timer_cancel(&urc->windowTmr);
+	urc->windowOpen = veFalse;
+	if (!urc->lineCount && !urc->dropped)
+		return;
+
+	g = yajl_gen_alloc(NULL);
+	if (!g) {
+		urc_free_lines(urc);
+		return;
+	}
+
+	ok = yajl_gen_map_open(g) == yajl_gen_status_ok;
+	if (ok && nubat->tagResponses)
+		ok =	yajl_gen_string(g, (u8*) "origin", 6) == yajl_gen_status_ok &&
+				yajl_gen_string(g, (u8*) nubat->origin, strlen(nubat->origin)) == yajl_gen_status_ok;
+	ok =	ok &&
+			yajl_gen_string(g, (u8*) "urc", 3) == yajl_gen_status_ok &&
+			yajl_gen_array_open(g) == yajl_gen_status_ok;
+	for (p = urc->lines; ok && p < urc->lines + urc->lineCount; p++)
+		ok =	yajl_gen_map_open(g) == yajl_gen_status_ok &&
+				yajl_gen_string(g, (u8*) "line", 4) == yajl_gen_status_ok &&
+				yajl_gen_string(g, (u8*) p->line, strlen(p->line)) == yajl_gen_status_ok &&
+				yajl_gen_string(g, (u8*) "count", 5) == yajl_gen_status_ok &&
+				yajl_gen_integer(g, p->count) == yajl_gen_status_ok &&
+				yajl_gen_map_close(g) == yajl_gen_status_ok;
+	ok = ok && yajl_gen_array_close(g) == yajl_gen_status_ok;
+	if (ok && urc->dropped)
+		ok =	yajl_gen_string(g, (u8*) "dropped", 7) == yajl_gen_status_ok &&
+				yajl_gen_integer(g, urc->dropped) == yajl_gen_status_ok;
+	ok =	ok &&
+			yajl_gen_map_close(g) == yajl_gen_status_ok &&
+			yajl_gen_get_buf(g, &json, &json_len) == yajl_gen_status_ok;
+
+	if (ok)
+		pubnub_atPublishJson(nubat, (char const*) json, PUBNUB_URC_TTL);
+	else
+		ve_error("json: could not build urc message");
+
+	yajl_gen_free(g);
+	urc_free_lines(urc);
+}
+
+static void urc_window_open(struct PubnubUrc* urc)
+{
+	if (urc->windowOpen)
+		return;
+	urc->windowOpen = veTrue;
+	ve_timer(&urc->windowTmr, PUBNUB_URC_WINDOW, urc_flush, urc);
+}
+
+/* whether another line of this type may be sent */
+static veBool urc_rate(struct PubnubUrc* urc, char const* line, size_t len)
+{
+	struct PubnubUrcType* type = NULL;
+	u32 now = ve_timer_uptime();
+	size_t nameLen = 0;
+	u8 n;
+
+	while (nameLen < len && nameLen < sizeof(type->name) - 1 && line[nameLen] != ':')
+		nameLen++;
+
+	for (n = 0; n < urc->typeCount; n++) {
+		if (strncmp(urc->types[n].name, line, nameLen) == 0 && urc->types[n].name[nameLen] == 0) {
+			type = &urc->types[n];
+			break;
+		}
+	}
+
+	/* a new type, replace the one which was limited longest ago if needed */
+	if (!type) {
+		if (urc->typeCount < PUBNUB_URC_TYPES) {
+			type = &urc->types[urc->typeCount++];
+		} else {
+			type = &urc->types[0];
+			for (n = 1; n < urc->typeCount; n++)
+				if (urc->types[n].since < type->since)
+					type = &urc->types[n];
+		}
+		memcpy(type->name, line, nameLen);
+		type->name[nameLen] = 0;
+		type->sent = 0;
+		type->since = now;
+	}
+
+	if (now - type->since >= 60) {
+		type->sent = 0;
+		type->since = now;
+	}
+
+	if (type->sent == PUBNUB_URC_RATE)
+		return veFalse;
+	type->sent++;
+	return veTrue;
+}
+
+static void urc_line(char const* line, void* ctx)
+{
+	struct PubnubUrc* urc = (struct PubnubUrc*) ctx;
+	struct PubnubUrcLine* p;
+	size_t len;
+
+	line = urc_trim(line, &len);
+	if (!len)
+		return;
+
+	for (p = urc->lines; p < urc->lines + urc->lineCount; p++) {
+		if (strncmp(p->line, line, len) == 0 && p->line[len] == 0) {
+			if (p->count != 0xFFFF)
+				p->count++;
+			return;
+		}
+	}
+
+	if (!urc_rate(urc, line, len)) {
+		if (urc->dropped != 0xFFFF)
+			urc->dropped++;
+		urc_window_open(urc);
+		return;
+	}
+
+	if (urc->lineCount == PUBNUB_URC_LINES)
+		urc_flush(urc);
+
+	p = &urc->lines[urc->lineCount];
+	p->line = (char*) ve_malloc(len + 1);
+	if (!p->line)
+		return;
+	memcpy(p->line, line, len);
+	p->line[len] = 0;
+	p->count = 1;
+	urc->lineCount++;
+
+	urc_window_open(urc);
+}
+
+/* prefixes is a list like "+CREG;+CSQ;+VERR", empty for none */
+void pubnub_urcInit(struct PubnubUrc* urc, struct PubnubAt* nubat, char const* prefixes)
+{
+	char* prefix;
+	char* end;
+	u8 n;
+
+	urc->nubat = nubat;
+	urc->unsoCount = 0;
+	urc->lineCount = 0;
+	urc->typeCount = 0;
+	urc->dropped = 0;
+	urc->windowOpen = veFalse;
+	urc->prefixes = NULL;
+
+	if (!prefixes || !*prefixes)
+		return;
+
+	urc->prefixes = (char*) ve_malloc(strlen(prefixes) + 1);
+	if (!urc->prefixes)
+		return;
+	strcpy(urc->prefixes, prefixes);
+
+	for (n = 0; n < OWN_MODULES; n++)
+		ve_traceUnsoDisable(ownModules[n]);
+
+	for (prefix = urc->prefixes; prefix; prefix = end) {
+		end = strchr(prefix, ';');
+		if (end)
+			*end++ = 0;
+		if (!*prefix)
+			continue;
+
+		if (urc->unsoCount == PUBNUB_URC_PREFIXES) {
+			ve_warning("pubnub.urc: too many prefixes");
+			break;
+		}
+		if (ve_atUnsoSubscribe(&urc->unso[urc->unsoCount], prefix, urc_line, urc) != OK) {
+			ve_error("could not listen to %s", prefix);
+			continue;
+		}
+		urc->unsoCount++;
+	}
+}
+
+void pubnub_urcDeinit(struct PubnubUrc* urc)
+{
+	u8 n;
+
+	if (urc->prefixes) {
+		for (n = 0; n < OWN_MODULES; n++)
+			ve_traceUnsoEnable(ownModules[n]);
+	}
+	while (urc->unsoCount)
+		ve_atUnsoUnSubscribe(&urc->unso[--urc->unsoCount]);
+	ve_timer_cancel(&urc->windowTmr);
+	urc->windowOpen = veFalse;
+	urc_free_lines(urc);
+	ve_free(urc->prefixes);
+	urc->prefixes = NULL;
+}
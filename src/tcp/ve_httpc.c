@@ -33,6 +33,7 @@
 #include <str_utils.h>
 #include <ve_assert.h>
 #include <ve_httpc.h>
+#include <ve_lag.h>
 #include <ve_trace.h>
 
 #define TMR_SHOULD_NOT_OCCUR		(10*60)
@@ -487,13 +488,12 @@ static int vhttpc_send_ev(struct VHttpcRequest* req, ReqEvent ev)
 {
 	struct VHttpc* httpc = req->httpc;
 
-	httpc->tx_bytes = strlen(req->data.data);
-	httpc->tx_ptr = req->data.data;
 	httpc->parseState = PARSE_HTTP;
 	httpc->isChunked = veFalse;
 	httpc->parsePos = 0;
 	httpc->contentLength = -1;
 
+	/* note: the callback may still change the request data */
 	if (req->callback) {
 		int ret = req->callback(req, ev, NULL, 0);
 		if (vhttpc_is_error(ret)) {
@@ -502,6 +502,9 @@ static int vhttpc_send_ev(struct VHttpcRequest* req, ReqEvent ev)
 		}
 	}
 
+	httpc->tx_bytes = strlen(req->data.data);
+	httpc->tx_ptr = req->data.data;
+
 	if (httpc->socket == WIP_CHANNEL_INVALID) {
 		httpc->socket = wip_TCPClientCreate(httpc->host, httpc->port, tcp_handler, httpc);
 		if (httpc->socket == WIP_CHANNEL_INVALID) {
@@ -588,6 +591,7 @@ void vhttpc_req_keepalive_timeout(struct VHttpcRequest* req, s32 sec, s32 margin
 	str_addf(&req->data, "Keep-Alive: timeout=%d\r\n", sec);
 }
 
+/* sec 0 retries as soon as the callback returned */
 void vhttpc_req_retry(struct VHttpcRequest* req, u32 sec)
 {
 	ve_assert(req == req->httpc->reqQueue);
@@ -595,6 +599,33 @@ void vhttpc_req_retry(struct VHttpcRequest* req, u32 sec)
 
 	req->httpc->error = 0;
 	set_state(req->httpc, VHTTPC_RETRY_SOCKET_OPEN, sec);
+	if (sec == 0)
+		ve_timer_ms(&req->httpc->tmr, 1, vhttpc_timeout, req->httpc);
+}
+
+/*
+ * Abort a request which is being send or waited for. The callback will get
+ * a REQ_TCP_PEER_CLOSE or REQ_TCP_ERROR and can retry it as usual. A request
+ * which is still queued or waiting for a retry is not touched, it will be
+ * (re)send anyway.
+ */
+void vhttpc_req_abort(struct VHttpcRequest* req)
+{
+	struct VHttpc* httpc = req->httpc;
+
+	if (req != httpc->reqQueue)
+		return;
+
+	switch (httpc->state)
+	{
+	case VHTTPC_SOCKET_OPEN:
+	case VHTTPC_SENDING_REQUEST:
+	case VHTTPC_PARSING_REPLY:
+		vhttpc_error(httpc, RET_ABORTED);
+		break;
+	default:
+		break;
+	}
 }
 
 /* @note Only call once (or after free) */
@@ -606,6 +637,13 @@ void vhttpc_req_init(struct VHttpc* httpc, struct VHttpcRequest* req, u16 length
 	str_new(&req->data, length, step);
 }
 
+/* send the request over another connection, @note not for queued requests */
+void vhttpc_req_setHttpc(struct VHttpcRequest* req, struct VHttpc* httpc)
+{
+	ve_assert(req->next == NULL && req->httpc->reqQueue != req);
+	req->httpc = httpc;
+}
+
 /* @note Only call this on non queued request. Typically from REQ_DONE */
 void vhttpc_req_deinit(struct VHttpcRequest* req)
 {
@@ -618,17 +656,61 @@ void vhttpc_init(struct VHttpc* httpc, char const* host, u16 port)
 	httpc->port = port;
 	httpc->reqQueue = NULL;
 	httpc->socket = WIP_CHANNEL_INVALID;
+	httpc->preconnect = veFalse;
 	set_state(httpc, VHTTPC_IDLE, TMR_SHOULD_NOT_OCCUR);
 }
 
+/*
+ * Open the connection before there is a request, so the name lookup and
+ * connect are done by the time the first request is added. When it fails
+ * the first request will just try again.
+ */
+void vhttpc_connect(struct VHttpc* httpc)
+{
+	if (httpc->socket != WIP_CHANNEL_INVALID || httpc->state != VHTTPC_IDLE)
+		return;
+
+	httpc->socket = wip_TCPClientCreate(httpc->host, httpc->port, tcp_handler, httpc);
+	if (httpc->socket == WIP_CHANNEL_INVALID)
+		return;
+
+	/* expect WIP_OPEN or WIP_ERROR */
+	httpc->preconnect = veTrue;
+	set_state(httpc, VHTTPC_SOCKET_OPEN, TMR_SHOULD_NOT_OCCUR);
+}
+
 void vhttpc_deinit(struct VHttpc* httpc)
 {
 	/* do not dispose an active client */
 	ve_assert(httpc->state == VHTTPC_IDLE && !httpc->reqQueue);
 }
 
+/* send the next request if there is one */
+static void send_next(struct VHttpc* httpc)
+{
+	int ret;
+
+	if (!httpc->reqQueue) {
+		set_state(httpc, VHTTPC_IDLE, 0);
+		return;
+	}
+
+	set_state(httpc, VHTTPC_SENDING_REQUEST, TMR_SHOULD_NOT_OCCUR);
+	ret = vhttpc_send(httpc->reqQueue);
+	if (ret == RET_DONE)
+		set_state(httpc, VHTTPC_PARSING_REPLY, httpc->reqQueue->read_timeout);
+}
+
 static void handle_error(struct VHttpc* httpc, ReqEvent ev)
 {
+	httpc->preconnect = veFalse;
+
+	/* a failed connect without requests, the next request retries */
+	if (!httpc->reqQueue) {
+		set_state(httpc, VHTTPC_IDLE, 0);
+		return;
+	}
+
 	set_state(httpc, VHTTPC_ERROR, 0);
 	if (httpc->reqQueue && httpc->reqQueue->callback)
 		httpc->reqQueue->callback(httpc->reqQueue, ev, NULL, 0);
@@ -638,12 +720,19 @@ static void handle_error(struct VHttpc* httpc, ReqEvent ev)
 static void tcp_handler(wip_event_t *ev, void *ctx)
 {
 	struct VHttpc* httpc = (struct VHttpc*) ctx;
+	u32 start = ve_timer_now_ms();
 	int ret;
 
 	switch(ev->kind)
 	{
 	case WIP_CEV_OPEN:
 		ve_assert(httpc->state == VHTTPC_SOCKET_OPEN);
+		/* requests added while connecting are not send yet */
+		if (httpc->preconnect) {
+			httpc->preconnect = veFalse;
+			send_next(httpc);
+			break;
+		}
 		set_state(httpc, VHTTPC_SENDING_REQUEST, TMR_SHOULD_NOT_OCCUR);
 		break;
 
@@ -658,16 +747,8 @@ static void tcp_handler(wip_event_t *ev, void *ctx)
 	case WIP_CEV_READ:
 		ve_assert(httpc->state == VHTTPC_PARSING_REPLY);
 		handle_rx(httpc);
-		if (httpc->parseState == PARSE_DONE) {
-			if (httpc->reqQueue) {
-				set_state(httpc, VHTTPC_SENDING_REQUEST, TMR_SHOULD_NOT_OCCUR);
-				ret = vhttpc_send(httpc->reqQueue);
-				if (ret == RET_DONE)
-					set_state(httpc, VHTTPC_PARSING_REPLY, httpc->reqQueue->read_timeout);
-			} else {
-				set_state(httpc, VHTTPC_IDLE, 0);
-			}
-		}
+		if (httpc->parseState == PARSE_DONE)
+			send_next(httpc);
 		break;
 
 	case WIP_CEV_ERROR:
@@ -688,6 +769,8 @@ static void tcp_handler(wip_event_t *ev, void *ctx)
 	default:
 		break;
 	}
+
+	ve_lagAdd(VE_LAG_SOCKET, ve_timer_now_ms() - start);
 }
 
 static void vhttpc_timeout(void *ctx)
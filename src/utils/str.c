@@ -88,7 +88,7 @@ static void str_resize(Str *str, u16 newSize)
 	dbg_memset(tmp, 0, newSize);
 	if (str->data != NULL)
 	{
-		strcpy(tmp, str->data);
+		memcpy(tmp, str->data, str->str_len + 1);
 		ve_free(str->data);
 	}
 
@@ -114,12 +114,13 @@ static void str_resize(Str *str, u16 newSize)
 static void str_fit(Str *str, size_t lengthNeeded)
 {
 	size_t spaceLeft;
+	size_t newSize;
 
 	if (str->error)
 		return;
 
 	// if the string does not fit, allocate a multiple of step to make it fit
-	spaceLeft = (u16) (str->buf_size - str_len(str) - 1);	// 1 for the ending 0
+	spaceLeft = str->buf_size - str_len(str) - 1;	// 1 for the ending 0
 	if (spaceLeft < lengthNeeded)
 	{
 		if (str->step == 0)
@@ -128,7 +129,15 @@ static void str_fit(Str *str, size_t lengthNeeded)
 			return;
 		}
 
-		str_resize(str, (u16) ( str->buf_size + ((lengthNeeded - spaceLeft) / str->step + 1) * str->step));
+		// the buffer size is a u16, a larger one is an error and not wrapped
+		newSize = str->buf_size + ((lengthNeeded - spaceLeft) / str->step + 1) * str->step;
+		if (newSize > STR_MAX_SIZE)
+		{
+			str_free(str);
+			return;
+		}
+
+		str_resize(str, (u16) newSize);
 	}
 }
 
@@ -301,6 +310,26 @@ size_t str_add(Str *str, char const *value)
 	return len;
 }
 
+/** Appends len bytes, which may contain zeros.
+ *
+ * @param str the string
+ * @param buf the bytes to append
+ * @param len the number of bytes
+ */
+void str_addn(Str *str, char const *buf, size_t len)
+{
+	char *p;
+
+	str_fit(str, len);
+	if (str->error)
+		return;
+
+	p = str_cur(str);
+	memcpy(p, buf, len);
+	p[len] = 0;
+	str->str_len += len;
+}
+
 /** Appends a char.
  *
  * @param str the string
@@ -564,10 +593,38 @@ void str_addUrlEncChr(Str *str, char chr)
  */
 void str_addUrlEnc(Str *str, char const *string)
 {
+	str_addUrlEncN(str, string, strlen(string));
+}
+
+/**
+ * Add len bytes urlencoded, in a single pass.
+ *
+ * @note room for the worst case is made first, 3 chars per byte
+ */
+void str_addUrlEncN(Str *str, char const *buf, size_t len)
+{
+	static char const hex[] = "0123456789ABCDEF";
+	char *p;
+	char c;
 	size_t n;
 
-	for (n = 0; n < strlen(string); n++)
-		str_addUrlEncChr(str, string[n]);
+	str_fit(str, 3 * len);
+	if (str->error)
+		return;
+
+	p = str_cur(str);
+	for (n = 0; n < len; n++) {
+		c = buf[n];
+		if (c == '#' || c == '/' || c == '-' || c == '_' || isalnum((u8) c)) {
+			*p++ = c;
+		} else {
+			*p++ = '%';
+			*p++ = hex[(u8) c >> 4];
+			*p++ = hex[c & 0xF];
+		}
+	}
+	*p = 0;
+	str_added(str, p - str_cur(str));
 }
 
 /**
@@ -26,7 +26,10 @@
 
 #include <ve_at.h>
 #include <platform.h>
+#include <stddef.h>
 #include <ve_assert.h>
+#include <ve_lag.h>
+#include <ve_timer.h>
 #include <ve_trace.h>
 
 /**
@@ -45,8 +48,11 @@
  * are directly called, which directly calls this module again, which directly
  * call the original caller.
  *
- * As a consequence:
- *	Don't call other local AT from local AT commands!
+ * Every running local command has a context with its own port, on which its
+ * handler responds, so the responses go back to the right caller. A local
+ * AT command may thus call other local AT commands, till VE_AT_CONTEXTS
+ * commands are running. A handler which has to wait, e.g. for I/O, can
+ * finish the command later, see ve_atDefer.
  *
  * @note
  * 	Naming is a bit confusing
@@ -57,7 +63,8 @@
  *
  * @note
  * 	This is not a complete implementation:
- * 		- Unsolicited responses are not supported
+ * 		- Unsolicited responses can only be listened to, see
+ * 		  ve_atUnsoSubscribe
  *		- Local commands can not be unsubscribed (but we don't do that anyway..)
  *
  * @{
@@ -69,37 +76,127 @@ typedef struct VeAtCmdSubcribeS
 	char *atCmd;					///< AT command which is implemented in the VGR
 	adl_atCmdHandler_t cmdHndl;		///< Handler for processing the AT command
 	u16 cmdOpt;						///< number of arguments etc
-	struct VeAtCmdSubcribeS *next;
+	struct VeAtCmdSubcribeS *next;	///< next handler of the same command
 } VeAtCmdSubcribe;
 
-static adl_atCmdPreParser_t*	ve_atAllocCmdPreParser(char const *str);
-static s8						ve_atCmdParse(adl_atCmdPreParser_t *paras, char const *atcmd);
-static void						ve_atFreeCmdPreParser(adl_atCmdPreParser_t *paras);
+/**
+ * Node of the case insensitive prefix tree of the subscribed commands, so
+ * a command is looked up in a single pass over it instead of comparing it
+ * with every subscribed one. Children are kept as a sibling list, since
+ * few commands share a prefix.
+ */
+typedef struct VeAtTrieS
+{
+	char c;							///< upper case
+	struct VeAtTrieS *child;
+	struct VeAtTrieS *sibling;
+	VeAtCmdSubcribe *cmds;			///< handlers of the command ending here
+} VeAtTrie;
 
-/// list with locally available ATV commands
-static VeAtCmdSubcribe* ve_atSubsribedList = NULL;
+/// longest command parsed without using the heap
+#define VE_AT_ARENA_CMD		128
 
-/*
- * Since AT+V commands are blocking there can only be one at a
- * time and only one instance is needed..
+/// max number of parameters of a local command, see the cmdOpt nibbles
+#define VE_AT_PARAMS_MAX	15
+
+/**
+ * The parse object of a local command with a fixed array of its parameters.
+ * On OAT the handlers would otherwise need a wm_lst, which allocates for the
+ * list and for every item. The parameters are read with ve_atParam.
  */
-static adl_atRspHandler_t	ve_atRspHandler;
-static void					*ve_atRspContext;
+typedef struct
+{
+	char const *params[VE_AT_PARAMS_MAX];
+	adl_atCmdPreParser_t paras;		///< last, StrData runs on
+} VeAtParsed;
+
+#define VE_AT_PARSED(p)		((VeAtParsed*) ((char*) (p) - offsetof(VeAtParsed, paras)))
+
+/**
+ * Room for the parse object of a local command, so it can live on the stack
+ * of ve_atCmdSendExt. Since a local command may run another one, a single
+ * static instance would not do.
+ */
+typedef union
+{
+	VeAtParsed parsed;
+	char mem[sizeof(VeAtParsed) + 2 * VE_AT_ARENA_CMD + 1];
+} VeAtCmdArena;
+
+static adl_atCmdPreParser_t*	ve_atAllocCmdPreParser(char const *str, VeAtCmdArena *arena);
+static s8						ve_atCmdParse(adl_atCmdPreParser_t *paras, char const *atcmd);
+static void						ve_atFreeCmdPreParser(adl_atCmdPreParser_t *paras, VeAtCmdArena *arena);
+static s8						ve_atCmdSend(char *atstr, adl_atPort_e port, u16 ni, void* ctx,
+											adl_atRspHandler_t rsphdl, ve_atRspSink_t sink);
 
-static void add_cmd(VeAtCmdSubcribe *cmd)
+/// the locally available ATV commands
+static VeAtTrie ve_atSubscribed;
+
+/**
+ * The caller of a running AT+V command. Every context has its own port, the
+ * handler answers on, so the responses reach the right caller, also when a
+ * command is issued while another one is running.
+ */
+typedef struct
+{
+	veBool busy;
+	adl_atRspHandler_t rspHandler;
+	ve_atRspSink_t sink;			///< gets the lines instead of rspHandler
+	void *rspContext;
+	veBool deferred;				///< the handler returned, see ve_atDefer
+	u8 seq;							///< tells the commands using the port apart
+	struct VeTimer tmr;				///< limits the time a deferred command takes
+} VeAtContext;
+
+static VeAtContext			ve_atContexts[VE_AT_CONTEXTS];
+
+/// listeners for unsolicited output
+static VeAtUnso*			ve_atUnsoList = NULL;
+static veBool				ve_atUnsoDispatching;
+
+static VeAtTrie* trie_child(VeAtTrie *node, char c)
 {
-	VeAtCmdSubcribe* p = ve_atSubsribedList;
+	VeAtTrie *child;
 
-	if (p) {
-		while (p->next)
-			p = p->next;
+	for (child = node->child; child; child = child->sibling)
+		if (child->c == c)
+			return child;
+	return NULL;
+}
+
+/// the node of cmdStr, created when needed
+static VeAtTrie* trie_add(char const *cmdStr)
+{
+	VeAtTrie *node = &ve_atSubscribed;
+	VeAtTrie *child;
+	char c;
+
+	for (; *cmdStr; cmdStr++) {
+		c = (char) toupper((u8) *cmdStr);
+		if ((child = trie_child(node, c)) == NULL) {
+			if (!(child = (VeAtTrie*) ve_malloc(sizeof(*child))))
+				return NULL;
+			child->c = c;
+			child->child = NULL;
+			child->cmds = NULL;
+			child->sibling = node->child;
+			node->child = child;
+		}
+		node = child;
 	}
 
+	return node;
+}
+
+/// overloads are tried in order of subscription
+static void add_cmd(VeAtTrie *node, VeAtCmdSubcribe *cmd)
+{
+	VeAtCmdSubcribe **p = &node->cmds;
+
+	while (*p)
+		p = &(*p)->next;
 	cmd->next = NULL;
-	if (p)
-		p->next = cmd;
-	else
-		ve_atSubsribedList = cmd;
+	*p = cmd;
 }
 
 /**
@@ -111,7 +208,8 @@ static void add_cmd(VeAtCmdSubcribe *cmd)
 s16 ve_atCmdSubscribe(char const *cmdStr, adl_atCmdHandler_t cmdHdl, u16 cmdOpt)
 {
 	s16 ret;
-	VeAtCmdSubcribe* cmd;
+	VeAtCmdSubcribe* cmd = NULL;
+	VeAtTrie* node;
 
 	// register as new AT command
 	if ((ret = adl_atCmdSubscribe((char*) cmdStr, cmdHdl, cmdOpt)) != OK)
@@ -130,10 +228,16 @@ s16 ve_atCmdSubscribe(char const *cmdStr, adl_atCmdHandler_t cmdHdl, u16 cmdOpt)
 		goto error;
 	}
 
+	if (!(node = trie_add(cmdStr)))
+	{
+		ret = ERROR;
+		goto error;
+	}
+
 	strcpy(cmd->atCmd, cmdStr);
 	cmd->cmdOpt = cmdOpt;
 	cmd->cmdHndl = cmdHdl;
-	add_cmd(cmd);
+	add_cmd(node, cmd);
 	return OK;
 
 error:
@@ -145,22 +249,119 @@ error:
 }
 
 /**
- * Check if the command is locally implemented, ie locally subscribed.
+ * Check if the command is locally implemented, ie locally subscribed. The
+ * handlers of the longest subscribed command atstr starts with are returned,
+ * one after the other.
  */
 static VeAtCmdSubcribe* ve_atCmdSubscribeFindNext(char* atstr, VeAtCmdSubcribe* from)
 {
-	VeAtCmdSubcribe *ret = (from ? from->next : ve_atSubsribedList);
+	VeAtTrie *node = &ve_atSubscribed;
+	VeAtCmdSubcribe *ret = NULL;
+
+	if (from)
+		return from->next;
 
-	while (ret)
+	while (*atstr && (node = trie_child(node, (char) toupper((u8) *atstr))) != NULL)
 	{
-		if (strnicmp(ret->atCmd, atstr, (u32) strlen(ret->atCmd)) == 0)
-			return ret;
-		ret = ret->next;
+		if (node->cmds)
+			ret = node->cmds;
+		atstr++;
 	}
 
+	return ret;
+}
+
+/// The context of the command being executed on port, if any
+static VeAtContext* ve_atContextOf(u8 port)
+{
+	VeAtContext *context;
+
+	if (!ve_atIsVictronPort(port))
+		return NULL;
+	context = &ve_atContexts[port - ADL_PORT_VICTRON];
+	return (context->busy ? context : NULL);
+}
+
+static VeAtContext* ve_atContextNew(void *ctx, adl_atRspHandler_t rsphdl, ve_atRspSink_t sink)
+{
+	VeAtContext *context;
+
+	for (context = ve_atContexts; context < &ve_atContexts[VE_AT_CONTEXTS]; context++)
+	{
+		if (!context->busy)
+		{
+			context->busy = veTrue;
+			context->seq++;
+			context->rspContext = ctx;
+			context->rspHandler = rsphdl;
+			context->sink = sink;
+			return context;
+		}
+	}
 	return NULL;
 }
 
+static void ve_atContextRelease(VeAtContext *context)
+{
+	if (context->deferred)
+		ve_timer_cancel(&context->tmr);
+	context->deferred = veFalse;
+	context->busy = veFalse;
+	context->rspHandler = NULL;
+	context->sink = NULL;
+	context->rspContext = NULL;
+}
+
+static u8 ve_atContextPort(VeAtContext *context)
+{
+	return (u8) (ADL_PORT_VICTRON + (context - ve_atContexts));
+}
+
+/// a deferred command did not finish in time, tell its caller
+static void ve_atDeferTimeout(void *ctx)
+{
+	VeAtContext *context = (VeAtContext*) ctx;
+	u8 port = ve_atContextPort(context);
+
+	ve_warning("AT command on port %d timed out", port);
+	ve_atSendStdResponsePort(ADL_AT_RSP, port, ADL_STR_ERROR);
+}
+
+/// Passes the responses of the modem to the sink of the caller
+static veBool ve_atModemSink(adl_atResponse_t *paras)
+{
+	VeAtContext *context = (VeAtContext*) paras->Contxt;
+
+	context->sink(paras->StrData, paras->IsTerminal, context->rspContext);
+	if (paras->IsTerminal)
+		ve_atContextRelease(context);
+
+	return veFalse;
+}
+
+/// The ports of internal commands don't exist on the modem
+static s8 ve_atCmdSendModem(char *atstr, adl_atPort_e port, u16 ni, void* ctx,
+							adl_atRspHandler_t rsphdl, ve_atRspSink_t sink)
+{
+	VeAtContext *context;
+	s8 ret;
+
+	if (ve_atIsVictronPort(port))
+		return ADL_RET_ERR_SERVICE_LOCKED;
+
+	if (!sink)
+		return adl_atCmdSendExt(atstr, port, ni, ctx, rsphdl, "*", NULL);
+
+	// the context holds the sink till the final response
+	if (!(context = ve_atContextNew(ctx, NULL, sink)))
+		return ADL_RET_ERR_SERVICE_LOCKED;
+
+	if ((ret = adl_atCmdSendExt(atstr, port, ni, context, ve_atModemSink, "*", NULL)) != OK)
+		ve_atContextRelease(context);
+
+	return ret;
+}
+
 /**
  * @brief
  *  Query or execute an AT command, all responses are sent back to the issuing
@@ -174,16 +375,12 @@ static VeAtCmdSubcribe* ve_atCmdSubscribeFindNext(char* atstr, VeAtCmdSubcribe*
  * 	Filtering is not implemented.
  *
  * @note
- *  Recursion is limited to one level (a custom AT command may only execute
- *  another custom AT command if that command does not execute other custom
- *  AT commands.
- *
- * @note
- *  Recursive calls can only be executed on a terminal (i.e. not from the SMS
- *  handler or other internal parser).
+ *  Every custom AT command being executed gets a context of its own, so a
+ *  custom AT command may execute others, till VE_AT_CONTEXTS are in use.
+ *  Commands for the modem are serialised per port by the modem itself.
  *
  * @param atstr		The AT command to execute.
- * @param port		Not used.
+ * @param port		The port modem commands are sent to.
  * @param NI		Not used.
  * @param Contxt    A context that will be passed to the response handler.
  * @param rsphdl	The handler for responses generated by this command.
@@ -191,40 +388,58 @@ static VeAtCmdSubcribe* ve_atCmdSubscribeFindNext(char* atstr, VeAtCmdSubcribe*
  * @retval	OK The command was executed successfully (note, this does not
  * 			reflect	the return status of the command itself).
  * @retval	ADL_RET_ERR_SERVICE_LOCKED The command could not be executed because
- * 			it was called from a forbidden context (low level interrupt, or too
- * 			many levels of recursion).
+ * 			it was called from a forbidden context (low level interrupt, a port
+ * 			of an internal command or too many levels of recursion).
  * @retval	ERROR The command could not be executed because of a lack of
  * 			resources.
  */
 s8 ve_atCmdSendExt(char *atstr, adl_atPort_e port, u16 ni, void* ctx, adl_atRspHandler_t rsphdl)
+{
+	return ve_atCmdSend(atstr, port, ni, ctx, rsphdl, NULL);
+}
+
+/**
+ * @brief
+ * 	As ve_atCmdSendExt, but the response lines are passed to sink as is.
+ * @details
+ * 	The responses of local commands are not copied into an adl_atResponse_t,
+ * 	so the sink gets the very text the handler sent, e.g. to escape it
+ * 	straight into the buffer it is published from. The lines are only valid
+ * 	during the call. The sink gets the final line with terminal set.
+ */
+s8 ve_atCmdSendSink(char *atstr, adl_atPort_e port, u16 ni, void* ctx, ve_atRspSink_t sink)
+{
+	return ve_atCmdSend(atstr, port, ni, ctx, NULL, sink);
+}
+
+static s8 ve_atCmdSend(char *atstr, adl_atPort_e port, u16 ni, void* ctx,
+						adl_atRspHandler_t rsphdl, ve_atRspSink_t sink)
 {
 	VeAtCmdSubcribe *cmd = NULL;
 	s8 ret = OK;
 	veBool found = veFalse;
 	adl_atCmdPreParser_t* preParser = NULL;
-
-	// Do not nest..
-	if (port == ADL_PORT_VICTRON)
-		return ADL_RET_ERR_SERVICE_LOCKED;
+	VeAtCmdArena arena;
+	VeAtContext *context;
+	u32 start;
 
 	// Check if there is at least one application implementation.
 	if (!(cmd = ve_atCmdSubscribeFindNext(atstr, cmd)))
-	{
-		ret = adl_atCmdSendExt(atstr, port, ni, ctx, rsphdl, "*", NULL);
-		goto cleanup;
-	}
+		return ve_atCmdSendModem(atstr, port, ni, ctx, rsphdl, sink);
 
-	// note global...
-	ve_atRspContext = ctx; 
-	ve_atRspHandler = rsphdl;
+	// the port the handler answers on identifies the caller
+	if (!(context = ve_atContextNew(ctx, rsphdl, sink)))
+		return ADL_RET_ERR_SERVICE_LOCKED;
 
 	// create the parse object
-	preParser = ve_atAllocCmdPreParser(atstr);
+	preParser = ve_atAllocCmdPreParser(atstr, &arena);
 	if (preParser == NULL)
 	{
 		ret = ERROR;
 		goto cleanup;
 	}
+	preParser->Contxt = ctx;
+	preParser->Port = (adl_port_e) ve_atContextPort(context);
 
 	// actually parse it
 	ret = ve_atCmdParse(preParser, cmd->atCmd);
@@ -243,17 +458,19 @@ s8 ve_atCmdSendExt(char *atstr, adl_atPort_e port, u16 ni, void* ctx, adl_atRspH
 			continue;
 
 		found = veTrue;
+		start = ve_timer_now_ms();
 		cmd->cmdHndl(preParser);
+		ve_lagAdd(VE_LAG_AT, ve_timer_now_ms() - start);
 		break;
 	} while ((cmd = ve_atCmdSubscribeFindNext(atstr, cmd)) != NULL);
 
 	if (!found)
 	{
-		ret = adl_atCmdSendExt(atstr, port, ni, ctx, rsphdl, "*", NULL);
+		ret = ve_atCmdSendModem(atstr, port, ni, ctx, rsphdl, sink);
 		goto cleanup;
 	}
 
-	if (ve_atRspHandler != NULL)
+	if (context->busy && !context->deferred)
 	{
 		ve_error("Fatal, command did not send final response!");
 		ve_assert(veFalse);
@@ -261,27 +478,100 @@ s8 ve_atCmdSendExt(char *atstr, adl_atPort_e port, u16 ni, void* ctx, adl_atRspH
 
 cleanup:
 	// Callback not invoked, invalid format etc, cleanup...
-	ve_atFreeCmdPreParser(preParser);
-	ve_atRspHandler = NULL;
-	ve_atRspContext = NULL;
+	ve_atFreeCmdPreParser(preParser, &arena);
+	if (!context->deferred)
+		ve_atContextRelease(context);
 	return ret;
 }
 
+/**
+ * @brief
+ * 	Send the final response of the command later.
+ * @details
+ * 	A handler which has to wait, e.g. for I/O, calls this and returns without
+ * 	a final response. The responses are sent later on the port returned by
+ * 	ve_atPendingPort. If the final one is not sent within timeout seconds,
+ * 	0 for no limit, the caller gets an ERROR instead.
+ *
+ * @note
+ * 	paras is only valid till the handler returns, so copy the parameters
+ * 	which are still needed.
+ *
+ * @return the pending command, to be passed to ve_atPendingPort.
+ */
+VeAtPending ve_atDefer(adl_atCmdPreParser_t *paras, u16 timeout)
+{
+	VeAtContext *context = ve_atContextOf((u8) paras->Port);
+
+	// the modem lets commands it called respond later by itself
+	if (!context)
+		return (VeAtPending) paras->Port;
+
+	context->deferred = veTrue;
+	if (timeout)
+		ve_timer(&context->tmr, timeout, ve_atDeferTimeout, context);
+
+	return (VeAtPending) (context->seq << 8 | paras->Port);
+}
+
+/**
+ * The port to respond to a deferred command on, ADL_PORT_NONE when it
+ * timed out or already got its final response.
+ */
+adl_port_e ve_atPendingPort(VeAtPending pending)
+{
+	u8 port = (u8) pending;
+	VeAtContext *context;
+
+	if (!ve_atIsVictronPort(port))
+		return (adl_port_e) port;
+
+	context = ve_atContextOf(port);
+	if (!context || !context->deferred || context->seq != (u8) (pending >> 8))
+		return ADL_PORT_NONE;
+
+	return (adl_port_e) port;
+}
+
 /**
  * Forward the response of a custom AT command to the local handler who wants
- * to receive the response.
+ * to receive the response. A sink gets the text as is.
  */
-static void ve_atForwardResponse(adl_atResponse_t* paras)
+static s32 ve_atForwardResponse(u16 Type, char const *str, veBool addCrLf, adl_strID_e RspID)
 {
-	// figure out who is interested in this
-	if (ve_atRspHandler)
-		ve_atRspHandler(paras);
+	VeAtContext *context = ve_atContextOf((u8) (Type >> 8));
+	veBool terminal = (Type & 0xFF) == ADL_AT_RSP;
+	adl_atResponse_t* paras;
 
-	if (paras->IsTerminal)
+	if (!context)
 	{
-		ve_atRspHandler = NULL;
-		ve_atRspContext = NULL;
+		ve_warning("response on port %d of no running command", Type >> 8);
+		return OK;
 	}
+
+	// figure out who is interested in this
+	if (context->sink)
+	{
+		context->sink(str, terminal, context->rspContext);
+	}
+	else if (context->rspHandler)
+	{
+		// create a parser object from the string
+		paras = ve_atAllocAtResponse(str, addCrLf, Type);
+		if (paras == NULL)
+			return ERROR;
+
+		// copy some known information
+		paras->RspID = RspID;
+
+		context->rspHandler(paras);
+		ve_free(paras);
+	}
+
+	if (terminal)
+		ve_atContextRelease(context);
+
+	return OK;
 }
 
 /**
@@ -290,32 +580,20 @@ static void ve_atForwardResponse(adl_atResponse_t* paras)
 s32 ve_atSendStdResponse(u16 Type, adl_strID_e RspID)
 {
 	char *str;
-	adl_atResponse_t* paras;
+	s32 ret;
 
-	if ( (Type >> 8) == ADL_PORT_VICTRON )
+	if ( ve_atIsVictronPort(Type >> 8) )
 	{
 		// get the string corresponding the ID
 		str = adl_strGetResponse(RspID);
 		if (str == NULL)
 			return ERROR;
 
-		// create a parser object with the string
-		paras = ve_atAllocAtResponse(str, veTrue, Type);
-		adl_memRelease(str); // note adl memory!
-
-		if (paras == NULL)
-			return ERROR;
-
-		// copy some known information
-		paras->RspID = RspID;
-
 		// actual forwarding of the data
-		ve_atForwardResponse(paras);
-
-		// cleanup
-		ve_free(paras);
+		ret = ve_atForwardResponse(Type, str, veTrue, RspID);
+		adl_memRelease(str); // note adl memory!
 
-		return OK;
+		return ret;
 	}
 
 	return adl_atSendStdResponse(Type, RspID);
@@ -326,27 +604,109 @@ s32 ve_atSendStdResponse(u16 Type, adl_strID_e RspID)
  */
 s32 ve_atSendResponse(u16 Type, char const *Text)
 {
-	if ( (Type >> 8) == ADL_PORT_VICTRON )
+	return ve_atSendResponseExt(Type, Text, veTrue);
+}
+
+/**
+ * As ve_atSendResponse, but unsolicited output is only passed to the local
+ * listeners if dispatch is set. Output which is sent again when sending
+ * failed, like the traces, is dispatched once by the caller instead.
+ */
+s32 ve_atSendResponseExt(u16 Type, char const *Text, veBool dispatch)
+{
+	// local listeners see what is sent to any port
+	if ( dispatch && (Type & 0xFF) == ADL_AT_UNS )
+		ve_atUnsoDispatch(Text);
+
+	if ( ve_atIsVictronPort(Type >> 8) )
+		return ve_atForwardResponse(Type, Text, veFalse, ADL_STR_NO_STRING);
+
+	return adl_atSendResponse(Type, (char*) Text);
+}
+
+/**
+ * Pass an unsolicited line to the listeners with a matching prefix. Output
+ * while doing so, e.g. the traces of a listener, is not passed on again.
+ */
+void ve_atUnsoDispatch(char const *line)
+{
+	VeAtUnso *unso;
+	char const *p = line;
+
+	if (ve_atUnsoDispatching)
+		return;
+
+	while (*p == '\r' || *p == '\n')
+		p++;
+
+	ve_atUnsoDispatching = veTrue;
+	for (unso = ve_atUnsoList; unso; unso = unso->next)
 	{
-		adl_atResponse_t* paras;
+		if (strnicmp(p, unso->prefix, (u32) strlen(unso->prefix)) == 0)
+			unso->handler(line, unso->ctx);
+	}
+	ve_atUnsoDispatching = veFalse;
+}
 
-		// create a parser object from the string
-		paras = ve_atAllocAtResponse(Text, veFalse, Type);
+static veBool ve_atUnsoModem(adl_atUnsolicited_t *paras)
+{
+	ve_atUnsoDispatch(paras->StrData);
+	return veTrue; // forward it to the external application as well
+}
 
-		if (paras == NULL)
-			return ERROR;
+static VeAtUnso* ve_atUnsoFindPrefix(char const *prefix)
+{
+	VeAtUnso *unso;
 
-		// copy some known information
-		paras->RspID = ADL_STR_NO_STRING;
+	for (unso = ve_atUnsoList; unso; unso = unso->next)
+	{
+		if (stricmp(unso->prefix, prefix) == 0)
+			return unso;
+	}
+	return NULL;
+}
 
-		// actual forwarding of the data
-		ve_atForwardResponse(paras);
+/**
+ * @brief
+ * 	Listen to unsolicited output starting with prefix.
+ * @details
+ * 	Both the unsolicited responses of the modem and those sent by the
+ * 	application itself, like traces, are passed to the handler. The prefix
+ * 	must stay valid and unso is owned by the caller till it is unsubscribed.
+ * 	Listeners must not (un)subscribe from the handler.
+ */
+s16 ve_atUnsoSubscribe(VeAtUnso *unso, char const *prefix, ve_atUnsoHandler_t handler, void *ctx)
+{
+	s16 ret;
 
-		ve_free(paras);
-		return OK;
+	// the modem is asked only once per prefix
+	if (!ve_atUnsoFindPrefix(prefix))
+	{
+		if ((ret = adl_atUnSoSubscribe((char*) prefix, ve_atUnsoModem)) != OK)
+			return ret;
 	}
 
-	return adl_atSendResponse(Type, (char*) Text);
+	unso->prefix = prefix;
+	unso->handler = handler;
+	unso->ctx = ctx;
+	unso->next = ve_atUnsoList;
+	ve_atUnsoList = unso;
+
+	return OK;
+}
+
+void ve_atUnsoUnSubscribe(VeAtUnso *unso)
+{
+	VeAtUnso **p = &ve_atUnsoList;
+
+	while (*p && *p != unso)
+		p = &(*p)->next;
+	if (!*p)
+		return;
+	*p = unso->next;
+
+	if (!ve_atUnsoFindPrefix(unso->prefix))
+		adl_atUnSoUnSubscribe((char*) unso->prefix, ve_atUnsoModem);
 }
 
 /**
@@ -356,6 +716,7 @@ s32 ve_atSendResponse(u16 Type, char const *Text)
 adl_atResponse_t* ve_atAllocAtResponse(char const *str, veBool addCrLf, u16 Type)
 {
 	adl_atResponse_t* ret;
+	VeAtContext *context;
 	size_t length;
 
 	length = strlen(str);
@@ -381,25 +742,20 @@ adl_atResponse_t* ve_atAllocAtResponse(char const *str, veBool addCrLf, u16 Type
 	// set some defaults
 	ret->Dest = (Type >> 8);
 	ret->IsTerminal = ( Type & 0xFF ) == ADL_AT_RSP;
-	ret->Contxt = ve_atRspContext;
+	ret->Contxt = (context = ve_atContextOf(ret->Dest)) ? context->rspContext : NULL;
 
 	return ret; // don't forget to release!
 }
 
-/**
- * @note
- *	return object must be released with ve_atFreeCmdPreParser..
+/*
+ * The parameters are sliced in place in a copy of the command stored after
+ * StrData, so the handler still sees the command as it was sent and parsing
+ * needs no further memory.
  */
-adl_atCmdPreParser_t* ve_atAllocCmdPreParser(char const *atstr)
-{
-	// string is appended, \0 is already in adl_atCmdPreParser_t
-	adl_atCmdPreParser_t* ret = (adl_atCmdPreParser_t*) ve_malloc(
-			(u32) (sizeof(adl_atCmdPreParser_t) + strlen(atstr))
-		);
-
-	if (ret == NULL)
-		return NULL;
+#define ve_atCmdPreParserSize(len)	(sizeof(VeAtParsed) + 2 * (len) + 1)
 
+static adl_atCmdPreParser_t* ve_atInitCmdPreParser(adl_atCmdPreParser_t* ret, char const *atstr)
+{
 	ret->StrLength = (u16) strlen(atstr);
 	strcpy(ret->StrData, atstr);
 
@@ -407,84 +763,84 @@ adl_atCmdPreParser_t* ve_atAllocCmdPreParser(char const *atstr)
 	ret->ParaList = NULL;
 	ret->NbPara = 0;
 
-	// set some defaults
+	// set some defaults, the caller sets the context and port
 	ret->NI = 0;
-	ret->Contxt = ve_atRspContext;
+	ret->Contxt = NULL;
 	ret->Port = ADL_PORT_VICTRON;
 	ret->Type = 0;  // no idea yet
 
-	return ret; // don't forget to release!
+	return ret;
 }
 
-#ifdef __OAT_API_VERSION__
-
-static char* parseParamsInit(adl_atCmdPreParser_t *paras, char const * str)
+/**
+ * @note
+ *	return object must be released with ve_atFreeCmdPreParser..
+ */
+static adl_atCmdPreParser_t* ve_atAllocCmdPreParser(char const *atstr, VeAtCmdArena *arena)
 {
-	static wm_lstTable_t freeit = {NULL, ve_free};
-	paras->ParaList = wm_lstCreate(WM_LIST_NONE, &freeit);
-	if (!paras->ParaList)
+	VeAtParsed* ret;
+	size_t length = strlen(atstr);
+
+	// the common, short, commands are parsed on the stack of the caller
+	if (ve_atCmdPreParserSize(length) <= sizeof(*arena))
+		return ve_atInitCmdPreParser(&arena->parsed.paras, atstr);
+
+	ret = (VeAtParsed*) ve_malloc((u32) ve_atCmdPreParserSize(length));
+	if (ret == NULL)
 		return NULL;
-	return ve_strdup(str);
-}
 
-static veBool parseParamsAdd(adl_atCmdPreParser_t *paras, char const * str)
-{
-	char* q = ve_strdup(str);
-	if (!q)
-		return veFalse;
-	wm_lstAddItem(paras->ParaList, (void*) q);
-	paras->NbPara++;
-	return veTrue;
+	return ve_atInitCmdPreParser(&ret->paras, atstr); // don't forget to release!
 }
 
-static void parseParamsCleanup(char * str)
+/// str is part of StrData, the copy starts after its terminator
+static char* parseParamsCopy(adl_atCmdPreParser_t *paras, char const * str)
 {
-	ve_free(str);
-}
+	char *tmp = &paras->StrData[paras->StrLength + 1];
 
-static void ve_atFreeCmdPreParser(adl_atCmdPreParser_t* paras)
-{
-	if (paras && paras->ParaList)
-		wm_lstDestroy(paras->ParaList);
-	ve_free(paras);
+	ve_assert(str >= paras->StrData && str <= &paras->StrData[paras->StrLength]);
+	return strcpy(tmp, str);
 }
-#else
 
 static char* parseParamsInit(adl_atCmdPreParser_t *paras, char const * str)
 {
-	return (paras->ParaList = ve_strdup(str));
+	return parseParamsCopy(paras, str);
 }
 
 static veBool parseParamsAdd(adl_atCmdPreParser_t *paras, char const * str)
 {
-	if (paras->NbPara >= sizeof(paras->params)/sizeof(paras->params[0]))
+	if (paras->NbPara >= VE_AT_PARAMS_MAX)
 		return veFalse;
-	paras->params[paras->NbPara++] = str;
+	VE_AT_PARSED(paras)->params[paras->NbPara++] = str;
 	return veTrue;
 }
 
-static void parseParamsCleanup(char const * str) {}
+static void ve_atFreeCmdPreParser(adl_atCmdPreParser_t* paras, VeAtCmdArena *arena)
+{
+	if (paras != &arena->parsed.paras)
+		ve_free(VE_AT_PARSED(paras));
+}
 
-static void ve_atFreeCmdPreParser(adl_atCmdPreParser_t* paras)
+/**
+ * Parameter n of a command, NULL if there is none. Commands from the ADL
+ * have their parameters in the ParaList, local ones in a fixed array.
+ */
+char const *ve_atParam(adl_atCmdPreParser_t const *paras, u8 n)
 {
-	if (paras)
-		ve_free(paras->ParaList);
-	ve_free(paras);
+	if (!ve_atIsVictronPort(paras->Port))
+		return ADL_GET_PARAM(paras, n);
+	return (n < paras->NbPara ? VE_AT_PARSED((adl_atCmdPreParser_t*) paras)->params[n] : NULL);
 }
-#endif
 
 s8 parseParams(adl_atCmdPreParser_t *paras, char const * str)
 {
 	char *p;
 	char *begin = NULL;
-	char *tmp;
 	veBool inStr = veFalse;
-	s8 ret = OK;
 
-	if (!(tmp = parseParamsInit(paras, str)))
+	if (!(p = parseParamsInit(paras, str)))
 		return ERROR;
 
-	begin = p = tmp;
+	begin = p;
 	for(;;) {
 		char c;
 		switch ((c = *p))
@@ -502,18 +858,14 @@ s8 parseParams(adl_atCmdPreParser_t *paras, char const * str)
 		case 0:
 			if (begin != p) {
 				*p = 0;
-				if (!parseParamsAdd(paras, begin)) {
-					ret = ERROR;
-					goto cleanup;
-				}
+				if (!parseParamsAdd(paras, begin))
+					return ERROR;
 				ve_qtrace("%d: '%s'", paras->NbPara, begin);
 			}
 
 			begin = p + 1;
-			if (c == 0) {
-				ret = (inStr ? ERROR : OK);
-				goto cleanup;
-			}
+			if (c == 0)
+				return (inStr ? ERROR : OK);
 			break;
 
 		case '\\':
@@ -531,19 +883,14 @@ s8 parseParams(adl_atCmdPreParser_t *paras, char const * str)
 		}
 		p++;
 	}
-
-cleanup:
-	parseParamsCleanup(tmp);
-	return ret;
 }
 
 /**
  * @brief Parses an AT string to a adl_atCmdPreParser_t.
  *
  * @note
- * 	it must not already contain an argument list. The argument list is
- *  automatically freed when the atCmdPreParser is freed @see
- *  ve_atFreeCmdPreParser.
+ * 	it must not already contain arguments. They are kept in the VeAtParsed
+ *  around paras, read them with ve_atParam.
  *
  */
 s8 ve_atCmdParse(adl_atCmdPreParser_t *paras, char const *atcmd)
@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2012 All rights reserved.
+ * Jeroen Hofstee, Victron Energy, jhofstee@victronenergy.com.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#define VE_MOD	VE_MOD_LAG
+
+#include <platform.h>
+#include <string.h>
+
+#include <dev_reg_app.h>
+#include <ve_lag.h>
+#include <ve_trace.h>
+
+/**
+ * Keeps histograms of how late timers expire and how long callbacks block
+ * the event loop, so a slow handler shows up before commands time out.
+ * Callbacks taking lag.warn ms or longer are warned about. The histograms
+ * are shown by AT+VLAG.
+ */
+
+#define X(_kind, _name) _name,
+static char const* names[] = {
+	VE_LAGS
+};
+#undef X
+
+static struct VeLagHist hists[VE_LAG_COUNT];
+
+void ve_lagAdd(VeLagKind kind, u32 ms)
+{
+	struct VeLagHist* hist = &hists[kind];
+	u8 bucket = 0;
+	u32 n;
+
+	for (n = ms; n && bucket < VE_LAG_BUCKETS - 1; n >>= 1)
+		bucket++;
+
+	hist->count++;
+	hist->buckets[bucket]++;
+	if (ms > hist->max)
+		hist->max = ms;
+
+	/*
+	 * Lateness is no callback taking long and warning about a slow trace
+	 * would send yet another one.
+	 */
+	if (	kind != VE_LAG_TIMER && kind != VE_LAG_TRACE &&
+			dev_regs.lagWarn && ms >= dev_regs.lagWarn)
+		ve_warning("%s blocked for %u ms", names[kind], ms);
+}
+
+struct VeLagHist const* ve_lagHist(VeLagKind kind)
+{
+	return &hists[kind];
+}
+
+char const* ve_lagName(VeLagKind kind)
+{
+	return names[kind];
+}
+
+void ve_lagReset(void)
+{
+	memset(hists, 0, sizeof(hists));
+}
+
+void ve_lagTrace(void)
+{
+	struct VeLagHist const* hist;
+	u8 kind;
+	u8 n;
+
+	for (kind = 0; kind < VE_LAG_COUNT; kind++) {
+		hist = &hists[kind];
+		ve_qtrace("%s: %u times, max %u ms", names[kind], hist->count, hist->max);
+		for (n = 0; n < VE_LAG_BUCKETS; n++) {
+			if (!hist->buckets[n])
+				continue;
+			if (n < VE_LAG_BUCKETS - 1)
+				ve_qtrace("  < %u ms: %u", 1 << n, hist->buckets[n]);
+			else
+				ve_qtrace("  >= %u ms: %u", 1 << (n - 1), hist->buckets[n]);
+		}
+	}
+}
@@ -25,17 +25,25 @@
  */
 
 #include <platform.h>
+#include <ve_lag.h>
 #include <ve_timer.h>
 #include <ve_trace.h>
 
 /**
- * A simple, one shot, inaccurate timer which, unlike adl_tmrSubscribe, 
- * cannot fail to subscribe. The VeTimer must be preserved till the
- * callback or till cancelation.
+ * A simple, one shot timer which, unlike adl_tmrSubscribe, cannot fail to
+ * subscribe. The VeTimer must be preserved till the callback or till
+ * cancelation.
  *
  * static VeTimer tmr;
  * ve_timer(&tmr, 5, some_callback, ptr);
  *
+ * or, with a timeout in milliseconds, rounded up to VE_TIMER_TICK_MS
+ * ve_timer_ms(&tmr, 150, some_callback, ptr);
+ *
+ * or, if it may expire up to 2 seconds later, so it can share the wakeup of
+ * another timer
+ * ve_timer_slack(&tmr, 5000, 2000, some_callback, ptr);
+ *
  * to cancel call cancel or set zero timeout
  * ve_timer_cancel(&tmr);
  * ve_timer(&tmr, 0, NULL, NULL);
@@ -46,119 +54,420 @@
  * to create a periodic timer, set the timer again in the callback.
  *
  * @note Don't copy VeTimer objects! Their address is used to identify them.
+ * @note A VeTimer must be zeroed before it is used the first time, as static
+ *	ones are.
  * @note Not fully tested yet!
  */
 
-struct VeTimer* queue;
+/*
+ * Timers are kept in a hashed timing wheel: a timer expiring at tick t is
+ * queued in slot t % VE_TIMER_WHEEL, so arming and canceling take constant
+ * time and a tick only looks at the timers of a single slot. A timer due in
+ * more than VE_TIMER_WHEEL ticks is passed over till its round comes.
+ */
+#if defined(__OAT_API_VERSION__)
+#define VE_TIMER_WHEEL	256		/* slots, a power of 2 */
+#else
+#define VE_TIMER_WHEEL	4096
+#endif
+
+static struct VeTimer* wheel[VE_TIMER_WHEEL];
+static u32 ticks;				/* since ve_timer_init */
+static u32 uptime;
+static u16 subTicks;			/* of the current second */
+static u32 armed;				/* timers in the wheel */
+static u32 nearest;				/* tick the first of them expires */
+static veBool nearestKnown;
+static struct VeTimerStats stats;
+static u32 nextTick;			/* ve_timer_now_ms of the next tick */
+static u32 late;				/* ms the current tick is late */
+static veBool updating;			/* in ve_timer_update */
+
+static void timer_schedule(void);
+
+static void timer_link(struct VeTimer** head, struct VeTimer* tmr)
+{
+	tmr->next = *head;
+	if (*head)
+		(*head)->pprev = &tmr->next;
+	*head = tmr;
+	tmr->pprev = head;
+}
+
+static void timer_unlink(struct VeTimer* tmr)
+{
+	*tmr->pprev = tmr->next;
+	if (tmr->next)
+		tmr->next->pprev = tmr->pprev;
+	tmr->next = NULL;
+	tmr->pprev = NULL;
+}
+
+static void timer_arm(struct VeTimer* tmr)
+{
+	if (!armed++) {
+		nearest = tmr->value;
+		nearestKnown = veTrue;
+	} else if (nearestKnown && tmr->value - ticks < nearest - ticks) {
+		nearest = tmr->value;
+	}
+	timer_link(&wheel[tmr->value & (VE_TIMER_WHEEL - 1)], tmr);
+}
+
+/*
+ * Takes the timer out of the wheel or out of the expired ones of the current
+ * tick. The latter are told apart since they expire at the current tick,
+ * while the timers in the wheel expire later.
+ */
+static void timer_disarm(struct VeTimer* tmr)
+{
+	if (tmr->value != ticks) {
+		armed--;
+		if (tmr->value == nearest)
+			nearestKnown = veFalse;
+	}
+	timer_unlink(tmr);
+}
+
+/*
+ * Looks for the first timer to expire, slot by slot. The first timer found
+ * expiring in the current round of the wheel is the first of all.
+ */
+static void timer_find_nearest(void)
+{
+	struct VeTimer *tmr;
+	u32 n;
+	u32 min = 0xFFFFFFFF;
+
+	for (n = 1; n <= VE_TIMER_WHEEL && min != n - 1; n++) {
+		for (tmr = wheel[(ticks + n) & (VE_TIMER_WHEEL - 1)]; tmr; tmr = tmr->next)
+			min = MIN(min, tmr->value - ticks);
+	}
+
+	nearest = ticks + min;
+	nearestKnown = veTrue;
+}
+
+/*
+ * The tick the clock is in. The ticks only run when a timer expires, so
+ * the ones which passed since are added.
+ */
+static u32 timer_now_tick(void)
+{
+	u32 passed = ve_timer_now_ms() - nextTick;
+
+	if ((s32) passed < 0)
+		return ticks;
+	return ticks + passed / VE_TIMER_TICK_MS + 1;
+}
+
+/*
+ * The first tick from till till at which a timer expires already, else
+ * till. A single round of the wheel is searched, a slot holds the timers of
+ * all rounds.
+ */
+static u32 timer_coalesce(u32 from, u32 till)
+{
+	struct VeTimer *tmr;
+	u32 n;
+	u32 best = till - from;
+	veBool found = veFalse;
+
+	for (n = 0; n <= best && n < VE_TIMER_WHEEL; n++) {
+		for (tmr = wheel[(from + n) & (VE_TIMER_WHEEL - 1)]; tmr; tmr = tmr->next) {
+			if (tmr->value - from <= best) {
+				best = tmr->value - from;
+				found = veTrue;
+			}
+		}
+	}
+
+	if (found)
+		stats.coalesced++;
+	return from + best;
+}
 
 void ve_timer(struct VeTimer* tmr, u32 sec, VeTimerCallback cb, void *ctx)
 {
-	struct VeTimer *p = queue;
+	ve_timer_slack(tmr, sec * 1000, 0, cb, ctx);
+}
 
-	if (!sec) {
+void ve_timer_ms(struct VeTimer* tmr, u32 ms, VeTimerCallback cb, void *ctx)
+{
+	ve_timer_slack(tmr, ms, 0, cb, ctx);
+}
+
+/**
+ * Arms a timer which expires between ms and ms + slack milliseconds from
+ * now. It expires together with another timer in that window if there is
+ * one, otherwise as late as allowed, so later timers can join it.
+ */
+void ve_timer_slack(struct VeTimer* tmr, u32 ms, u32 slack, VeTimerCallback cb, void *ctx)
+{
+	u32 from;
+	u32 extra;
+
+	if (!ms) {
 		ve_timer_cancel(tmr);
 		return;
 	}
 
-	tmr->value = sec;
 	tmr->cb = cb;
 	tmr->ctx = ctx;
 
-	/* already enqueued? */
-	while (p) {
-		if (p == tmr)
-			return;
-		p = p->next;
-	}
+	/* a reload likely moves it to another slot */
+	if (tmr->pprev)
+		timer_disarm(tmr);
 
-	/* nope, add it */
-	tmr->next = queue;
-	queue = tmr;
+	from = timer_now_tick() + (ms + VE_TIMER_TICK_MS - 1) / VE_TIMER_TICK_MS;
+	extra = slack / VE_TIMER_TICK_MS;
+	tmr->value = (extra ? timer_coalesce(from, from + extra) : from);
+	timer_arm(tmr);
+	timer_schedule();
 }
 
 void ve_timer_cancel(struct VeTimer* tmr)
 {
-	struct VeTimer *p = queue;
-	struct VeTimer *prev = NULL;
-
-	/* already enqueued? */
-	while (p) {
-		if (p == tmr)
-			break;
-		prev = p;
-		p = p->next;
-	}
-
-	if (!p) {
+	if (!tmr->pprev) {
 		ve_ltrace(17, "ve_timer_cancel timer not found %p", tmr);
 		return;
 	}
 
-	if (prev)
-		prev->next = p->next;
-	else
-		queue = p->next;
-	p->next = NULL;
+	timer_disarm(tmr);
+	if (!armed)
+		timer_schedule();
 }
 
+/**
+ * Milliseconds till the first timer expires, VE_TIMER_NONE if none is armed.
+ * A main loop can wait for events that long before calling ve_timer_update.
+ */
+u32 ve_timer_next_deadline(void)
+{
+	u32 due;
+	u32 now;
+
+	if (!armed)
+		return VE_TIMER_NONE;
+
+	if (!nearestKnown)
+		timer_find_nearest();
+
+	due = nextTick + (nearest - ticks - 1) * VE_TIMER_TICK_MS;
+	now = ve_timer_now_ms();
+	return ((s32) (due - now) > 0 ? due - now : 0);
+}
+
+/* advance the timers by VE_TIMER_TICK_MS */
 void ve_timer_tick(void)
 {
-	struct VeTimer *tmr = queue;
-	struct VeTimer *prev = NULL;
+	struct VeTimer *expired = NULL;
+	struct VeTimer *tmr;
 	struct VeTimer *next;
+	u32 start;
 
-	while (tmr) {
+	ticks++;
+	if (++subTicks == 1000 / VE_TIMER_TICK_MS) {
+		subTicks = 0;
+		uptime++;
+	}
+
+	for (tmr = wheel[ticks & (VE_TIMER_WHEEL - 1)]; tmr; tmr = next) {
 		next = tmr->next;
-		if (--tmr->value == 0)
-		{
-			/* dequeue */
-			if (prev)
-				prev->next = tmr->next;
-			else
-				queue = tmr->next;
-			tmr->next = NULL;
-
-			/* call */
-			if (tmr->cb)
-				tmr->cb(tmr->ctx);
-
-		} else {
-			prev = tmr;
+		if (tmr->value == ticks) {
+			armed--;
+			if (tmr->value == nearest)
+				nearestKnown = veFalse;
+			timer_unlink(tmr);
+			timer_link(&expired, tmr);
 		}
-		tmr = next;
 	}
+
+	/* the callbacks can (re)arm and cancel any timer, expired ones as well */
+	while ((tmr = expired) != NULL) {
+		stats.fired++;
+		timer_unlink(tmr);
+		ve_lagAdd(VE_LAG_TIMER, late);
+		if (tmr->cb) {
+			start = ve_timer_now_ms();
+			tmr->cb(tmr->ctx);
+			ve_lagAdd(VE_LAG_TIMER_CB, ve_timer_now_ms() - start);
+		}
+	}
+}
+
+/**
+ * How often the application was woken for the timers. The difference
+ * between the fired timers and the wakeups is what expiring together saved.
+ */
+void ve_timer_stats(struct VeTimerStats* out, veBool reset)
+{
+	*out = stats;
+	if (reset)
+		memset(&stats, 0, sizeof(stats));
+}
+
+/*
+ * Seconds since ve_timer_init, from the clock. The ticks only run when a
+ * timer expires, so the ones which passed since are added.
+ */
+u32 ve_timer_uptime(void)
+{
+	return uptime + (subTicks + (timer_now_tick() - ticks)) / (1000 / VE_TIMER_TICK_MS);
+}
+
+/* pass over ticks at which no timer expires */
+static void timer_skip(u32 n)
+{
+	ticks += n;
+	nextTick += n * VE_TIMER_TICK_MS;
+	uptime += n / (1000 / VE_TIMER_TICK_MS);
+	subTicks += n % (1000 / VE_TIMER_TICK_MS);
+	if (subTicks >= 1000 / VE_TIMER_TICK_MS) {
+		subTicks -= 1000 / VE_TIMER_TICK_MS;
+		uptime++;
+	}
+}
+
+/*
+ * Run the ticks which are due. Only the ticks at which a timer expires are
+ * run one by one, the application might not have been woken for hours.
+ */
+void ve_timer_update(void)
+{
+	u32 now = ve_timer_now_ms();
+	u32 due;
+	u32 fired = stats.fired;
+
+	updating = veTrue;
+	while ((s32) (now - nextTick) >= 0) {
+		due = (now - nextTick) / VE_TIMER_TICK_MS + 1;
+		if (armed && !nearestKnown)
+			timer_find_nearest();
+		timer_skip((armed ? MIN(due, nearest - ticks) : due) - 1);
+		/* callbacks arming timers count from the next tick */
+		late = now - nextTick;
+		nextTick += VE_TIMER_TICK_MS;
+		ve_timer_tick();
+	}
+	updating = veFalse;
+	timer_schedule();
+
+	if (stats.fired != fired)
+		stats.wakeups++;
 }
 
 #if defined(__OAT_API_VERSION__)
 
-static void stub(u8 ID, void *ctx)
+/*
+ * A step of the RTC larger than the application can have slept is taken to
+ * be the RTC being set, e.g. by AT+CCLK or the network time, and is not
+ * followed by the clock. A minute is added for handlers blocking the
+ * application. A step back is never followed. Without timers the
+ * application is still woken every VE_TIMER_IDLE, so there is always a
+ * limit.
+ */
+#define VE_TIMER_RTC_MARGIN		(60 * 1000)
+#define VE_TIMER_IDLE			(600 * 1000)
+
+static u32 rtcLast;				/* ms, last reading of the RTC */
+static u32 rtcStepMax;			/* ms, the largest step followed */
+static u32 nowMs;
+static adl_tmr_t* wakeTmr;		/* one shot, for the first timer */
+static u32 wakeAt;				/* ve_timer_now_ms it expires */
+
+static u32 timer_rtc_ms(void)
 {
-	ve_timer_tick();
+	adl_rtcTime_t tm;
+	adl_rtcTimeStamp_t stamp;
+
+	adl_rtcGetTime(&tm);
+	adl_rtcConvertTime(&tm, &stamp, ADL_RTC_CONVERT_TO_TIMESTAMP);
+	return stamp.TimeStamp * 1000 + ADL_RTC_GET_TIMESTAMP_MSECONDS(stamp);
 }
 
-void ve_timer_init(void)
+/*
+ * Milliseconds since ve_timer_init, monotonic, wraps. The RTC keeps running
+ * while handlers execute, unlike the ADL timers.
+ */
+u32 ve_timer_now_ms(void)
+{
+	u32 rtc = timer_rtc_ms();
+	u32 step = rtc - rtcLast;
+
+	rtcLast = rtc;
+	if ((s32) step >= 0 && step <= rtcStepMax)
+		nowMs += step;
+	return nowMs;
+}
+
+static void stub(u8 ID, void *ctx)
 {
-	adl_tmrSubscribe(veTrue, 10, ADL_TMR_TYPE_100MS, stub);
+	u32 fired = stats.fired;
+
+	wakeTmr = NULL;
+	ve_timer_update();
+	/* woken for nothing, the timer was canceled or moved */
+	if (stats.fired == fired)
+		stats.wakeups++;
 }
 
-#elif defined(_WIN32)
+/*
+ * There is no periodic tick, the ADL timer is armed for the first timer to
+ * expire only. An earlier timer rearms it, a later one leaves it alone, it
+ * is armed again when it expires. Without timers it expires after
+ * VE_TIMER_IDLE.
+ */
+static void timer_schedule(void)
+{
+	u32 wait;
+	u32 now;
+
+	if (updating)
+		return;
+
+	wait = ve_timer_next_deadline();
+	now = ve_timer_now_ms();
+	if (wakeTmr) {
+		if (wait != VE_TIMER_NONE && (s32) (wakeAt - (now + wait)) <= 0)
+			return;
+		adl_tmrUnSubscribe(wakeTmr, stub, ADL_TMR_TYPE_100MS);
+		wakeTmr = NULL;
+	}
 
-#pragma comment(lib, "winmm.lib")
+	/* only to keep the RTC steps limited */
+	if (wait == VE_TIMER_NONE)
+		wait = VE_TIMER_IDLE;
 
-#include <mmsystem.h>
-static HANDLE tickEv;
+	wait = MAX((wait + 99) / 100, 1);
+	wakeTmr = adl_tmrSubscribe(veFalse, wait, ADL_TMR_TYPE_100MS, stub);
+	wakeAt = now + wait * 100;
+	rtcStepMax = wait * 100 + VE_TIMER_RTC_MARGIN;
+}
 
 void ve_timer_init(void)
 {
-	tickEv = CreateEvent(NULL, veFalse, veFalse, TEXT("TimerEvent")); 
-	timeSetEvent(1000, 100, (LPTIMECALLBACK) tickEv, (DWORD_PTR) NULL,
-								TIME_PERIODIC | TIME_CALLBACK_EVENT_SET);
+	rtcLast = timer_rtc_ms();
+	rtcStepMax = VE_TIMER_RTC_MARGIN;
+	nextTick = VE_TIMER_TICK_MS;
 }
 
-void ve_timer_update(void)
+#else
+
+/* milliseconds since an arbitrary moment, monotonic, wraps */
+u32 ve_timer_now_ms(void)
 {
-	if (WaitForSingleObject(tickEv, 0) == WAIT_OBJECT_0)
-		ve_timer_tick();
+	return GetTickCount();
+}
+
+/* the main loop waits for ve_timer_next_deadline itself */
+static void timer_schedule(void)
+{
+}
+
+void ve_timer_init(void)
+{
+	nextTick = ve_timer_now_ms() + VE_TIMER_TICK_MS;
 }
 
 #endif
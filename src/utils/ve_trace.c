@@ -32,6 +32,8 @@
 #include <dev_reg_app.h>
 #include <str.h>
 #include <ve_at.h>
+#include <ve_lag.h>
+#include <ve_timer.h>
 #include <ve_trace.h>
 
 struct QueueStr {
@@ -42,6 +44,7 @@ struct QueueStr {
 static struct QueueStr *queue;
 static struct QueueStr *tail;
 static adl_tmr_t *tmr;
+static veBool unsoOff[VE_MOD_COUNT];	/* not passed to the local listeners */
 u32 const defaultTrace = 0;
 
 /**
@@ -62,9 +65,18 @@ static void retry(u8 id, void *ctx);
 
 static void try_to_send(void)
 {
+	u32 start;
+	s32 ret;
+
 	while(queue)
 	{
-		if (ve_atSendResponsePort(ADL_AT_UNS, (u8) dev_regs.tracePort, queue->str.data) == OK)
+		start = ve_timer_now_ms();
+		// the listeners had it when it was queued
+		ret = ve_atSendResponseExt(ADL_AT_PORT_TYPE((u8) dev_regs.tracePort, ADL_AT_UNS),
+									queue->str.data, veFalse);
+		ve_lagAdd(VE_LAG_TRACE, ve_timer_now_ms() - start);
+
+		if (ret == OK)
 		{
 			struct QueueStr* q = queue;
 			queue = queue->next;
@@ -154,6 +166,9 @@ void ve_trace(VeModule module, u32 level, char const* format, ...)
 		return;
 	}
 
+	if (!unsoOff[module])
+		ve_atUnsoDispatch(s->data);
+
 	q->next = NULL;
 	if (queue)
 		tail->next = q;
@@ -260,6 +275,21 @@ void ve_tracesDisable(void)
 		ve_traceDisableLevels(n, 0xFFFFFFFF);
 }
 
+/**
+ * Don't pass the traces of module to the local listeners of unsolicited
+ * output, e.g. those of the module forwarding them.
+ */
+void ve_traceUnsoDisable(VeModule module)
+{
+	unsoOff[module] = veTrue;
+}
+
+/// pass the traces of module to the local listeners again
+void ve_traceUnsoEnable(VeModule module)
+{
+	unsoOff[module] = veFalse;
+}
+
 /// returns the state of a single trace
 veBool ve_traceEnabledExt(VeModule module, u32 level)
 {
@@ -37,6 +37,7 @@ typedef int			veBool;
 #define veTrue		TRUE
 #define veFalse		FALSE
 #define MIN(a,b)	min(a,b)
+#define MAX(a,b)	max(a,b)
 
 #include <types.h>
 #include <glue.h>